@@ -0,0 +1,342 @@
+// Microbenchmarks of mini_alloc against the system allocator and, when
+// their shared libraries can be loaded, jemalloc and mimalloc.
+//
+//   bench_allocator [--filter TEXT] [--threads N] [--repetitions N] [--scale X]
+//                   [--trace FILE]
+//
+// --trace adds a replay of an allocation trace recorded with
+// mini_alloc::trace_start (see also trace_replay).
+//
+// On POSIX every case runs in a forked child, so the backends never share a
+// heap and the peak RSS printed is the case's own (plus the small baseline
+// of this process). Inputs come from fixed seeds, and each case reports the
+// median of its repetitions.
+
+#include "bench_common.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#if BENCH_POSIX
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// Cases
+// ---------------------------------------------------------------------------
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string filter;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    int repetitions = 3;
+    double scale = 1.0;
+    std::string trace; // recorded trace to replay, if any
+};
+
+struct Case {
+    std::string name;
+    unsigned threads;
+    // runs the case once and returns the number of operations performed
+    std::function<std::uint64_t(const Backend&)> run;
+};
+
+// Times are wall clock over the operations of all threads together
+struct Result {
+    double ns_per_op;
+    double mops;
+    long peak_rss_kb;
+};
+
+static std::uint64_t scaled(const Options& opt, std::uint64_t n) {
+    return std::max<std::uint64_t>(1, static_cast<std::uint64_t>(double(n) * opt.scale));
+}
+
+// Start fn(thread index) on n threads at once; returns when all are done
+static void run_threads(unsigned n, const std::function<void(unsigned)>& fn) {
+    std::atomic<bool> go{false};
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < n; ++t) {
+        pool.emplace_back([&, t] {
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            fn(t);
+        });
+    }
+    go.store(true, std::memory_order_release);
+    for (std::thread& th : pool) th.join();
+}
+
+// Sizes spread evenly over powers of two in [lo, hi]
+static std::size_t log_uniform(std::mt19937_64& rng, std::size_t lo, std::size_t hi) {
+    std::uniform_real_distribution<double> d(std::log2(double(lo)), std::log2(double(hi)));
+    return static_cast<std::size_t>(std::exp2(d(rng)));
+}
+
+// A synthetic trace with a production-like mix: mostly small objects, a
+// long tail of medium and large ones, and occasional growth by realloc
+static ReplayTrace synthetic_trace(std::uint64_t n, std::uint32_t slots) {
+    std::mt19937_64 rng(42);
+    ReplayTrace trace;
+    trace.slots = slots;
+    std::vector<ReplayOp>& ops = trace.ops;
+    std::vector<std::uint32_t> live, dead(slots);
+    std::vector<std::uint32_t> size_of(slots);
+    for (std::uint32_t i = 0; i < slots; ++i) dead[i] = slots - 1 - i;
+    auto pick_size = [&] {
+        std::uint64_t r = rng() % 100;
+        if (r < 70) return log_uniform(rng, 16, 256);
+        if (r < 95) return log_uniform(rng, 256, 4096);
+        return log_uniform(rng, 4096, 256 * 1024);
+    };
+    ops.reserve(n);
+    while (ops.size() < n) {
+        std::uint64_t r = rng() % 10;
+        if ((r < 5 || live.empty()) && !dead.empty()) {
+            std::uint32_t s = dead.back();
+            dead.pop_back();
+            size_of[s] = static_cast<std::uint32_t>(pick_size());
+            ops.push_back({ReplayOp::Malloc, s, size_of[s]});
+            live.push_back(s);
+        } else if (r < 9 || live.empty()) {
+            std::size_t i = rng() % live.size();
+            ops.push_back({ReplayOp::Free, live[i], 0});
+            dead.push_back(live[i]);
+            live[i] = live.back();
+            live.pop_back();
+        } else {
+            std::uint32_t s = live[rng() % live.size()];
+            size_of[s] = std::min<std::uint32_t>(size_of[s] + size_of[s] / 2, 1024 * 1024);
+            ops.push_back({ReplayOp::Realloc, s, size_of[s]});
+        }
+    }
+    for (std::uint32_t s : live) ops.push_back({ReplayOp::Free, s, 0});
+    return trace;
+}
+
+static std::vector<unsigned> thread_counts(const Options& opt) {
+    std::vector<unsigned> v;
+    for (unsigned t = 1; t < opt.max_threads; t *= 2) v.push_back(t);
+    v.push_back(opt.max_threads);
+    return v;
+}
+
+static std::vector<Case> cases(const Options& opt) {
+    std::vector<Case> v;
+
+    // malloc immediately followed by free, per size
+    for (std::size_t size : {16, 64, 256, 1024, 4096, 65536}) {
+        std::uint64_t n = scaled(opt, 2000000);
+        v.push_back({"pair/" + std::to_string(size), 1, [=](const Backend& be) {
+            for (std::uint64_t i = 0; i < n; ++i) {
+                void* p = be.malloc(size);
+                touch(p, size);
+                be.free(p);
+            }
+            return n;
+        }});
+    }
+
+    // random sizes with random lifetimes, every thread on its own objects
+    for (unsigned threads : thread_counts(opt)) {
+        std::uint64_t n = scaled(opt, 1000000);
+        v.push_back({"churn/threads:" + std::to_string(threads), threads, [=](const Backend& be) {
+            run_threads(threads, [&](unsigned t) {
+                std::mt19937_64 rng(1000 + t);
+                std::vector<void*> slots(4096, nullptr);
+                for (std::uint64_t i = 0; i < n; ++i) {
+                    void*& p = slots[rng() % slots.size()];
+                    be.free(p);
+                    std::size_t size = log_uniform(rng, 16, 16384);
+                    p = be.malloc(size);
+                    touch(p, size);
+                }
+                for (void* p : slots) be.free(p);
+            });
+            return n * threads;
+        }});
+    }
+
+    // pairs of threads where one allocates and the other frees, through a
+    // single-producer single-consumer ring
+    for (unsigned threads : thread_counts(opt)) {
+        if (threads < 2 || threads % 2) continue;
+        std::uint64_t n = scaled(opt, 500000);
+        v.push_back({"producer_consumer/threads:" + std::to_string(threads), threads, [=](const Backend& be) {
+            constexpr std::size_t RING = 1024;
+            struct alignas(64) Ring {
+                std::atomic<std::uint64_t> head{0}, tail{0};
+                void* items[RING];
+            };
+            std::vector<Ring> rings(threads / 2);
+            run_threads(threads, [&](unsigned t) {
+                Ring& r = rings[t / 2];
+                if (t % 2 == 0) {
+                    std::mt19937_64 rng(2000 + t);
+                    for (std::uint64_t i = 0; i < n; ++i) {
+                        std::size_t size = log_uniform(rng, 16, 1024);
+                        void* p = be.malloc(size);
+                        touch(p, size);
+                        std::uint64_t h = r.head.load(std::memory_order_relaxed);
+                        while (h - r.tail.load(std::memory_order_acquire) == RING) std::this_thread::yield();
+                        r.items[h % RING] = p;
+                        r.head.store(h + 1, std::memory_order_release);
+                    }
+                } else {
+                    for (std::uint64_t i = 0; i < n; ++i) {
+                        std::uint64_t tl = r.tail.load(std::memory_order_relaxed);
+                        while (r.head.load(std::memory_order_acquire) == tl) std::this_thread::yield();
+                        be.free(r.items[tl % RING]);
+                        r.tail.store(tl + 1, std::memory_order_release);
+                    }
+                }
+            });
+            return n * (threads / 2);
+        }});
+    }
+
+    // a buffer grown from 16 bytes to 1 MiB by a constant factor
+    for (auto [name, num, den] : {std::tuple{"realloc/grow:1.5", 3, 2}, std::tuple{"realloc/grow:2", 2, 1}}) {
+        std::uint64_t rounds = scaled(opt, 2000);
+        v.push_back({name, 1, [=](const Backend& be) {
+            std::uint64_t ops = 0;
+            for (std::uint64_t i = 0; i < rounds; ++i) {
+                std::size_t size = 16;
+                void* p = be.malloc(size);
+                while (size < 1024 * 1024) {
+                    size = size * num / den;
+                    p = be.realloc(p, size);
+                    touch(p, size);
+                    ++ops;
+                }
+                be.free(p);
+            }
+            return ops;
+        }});
+    }
+
+    // replay of a synthetic production-like trace, and of a recorded one
+    auto synthetic = std::make_shared<ReplayTrace>(synthetic_trace(scaled(opt, 1000000), 8192));
+    v.push_back({"replay/synthetic", 1, [=](const Backend& be) { return replay(be, *synthetic); }});
+    if (!opt.trace.empty()) {
+        auto recorded = std::make_shared<ReplayTrace>();
+        std::string error;
+        if (load_trace(opt.trace.c_str(), *recorded, error)) {
+            v.push_back({"replay/trace", 1, [=](const Backend& be) { return replay(be, *recorded); }});
+        } else {
+            std::fprintf(stderr, "bench_allocator: %s\n", error.c_str());
+        }
+    }
+    return v;
+}
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+static long peak_rss_kb() {
+#if BENCH_POSIX
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+    return ru.ru_maxrss / 1024; // bytes on macOS
+#else
+    return ru.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+static Result measure(const Case& c, const Backend& be, const Options& opt) {
+    if (be.setup) be.setup(c.threads);
+    c.run(be); // warm-up
+    std::vector<double> ns;
+    std::uint64_t ops = 0;
+    for (int r = 0; r < opt.repetitions; ++r) {
+        auto t0 = Clock::now();
+        ops = c.run(be);
+        auto t1 = Clock::now();
+        ns.push_back(double(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count()) / double(ops));
+    }
+    std::sort(ns.begin(), ns.end());
+    double median = ns[ns.size() / 2];
+    return {median, 1e3 / median, peak_rss_kb()};
+}
+
+// Run one case in a child process and collect its result through a pipe
+static bool run_isolated(const Case& c, const Backend& be, const Options& opt, Result& out) {
+#if BENCH_POSIX
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        Result r = measure(c, be, opt);
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == static_cast<ssize_t>(sizeof(r)) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], &out, sizeof(out));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == static_cast<ssize_t>(sizeof(out)) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    out = measure(c, be, opt);
+    return true;
+#endif
+}
+
+static void usage() {
+    std::puts("usage: bench_allocator [--filter TEXT] [--threads N] [--repetitions N] [--scale X] [--trace FILE]");
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--filter" && has_value) opt.filter = argv[++i];
+        else if (arg == "--threads" && has_value) opt.max_threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--repetitions" && has_value) opt.repetitions = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--scale" && has_value) opt.scale = std::atof(argv[++i]);
+        else if (arg == "--trace" && has_value) opt.trace = argv[++i];
+        else {
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    std::vector<Backend> bes = backends();
+    std::printf("%-34s %-12s %12s %12s %12s\n", "case", "backend", "ns/op", "Mops/s", "peak RSS");
+    for (const Case& c : cases(opt)) {
+        if (!opt.filter.empty() && c.name.find(opt.filter) == std::string::npos) continue;
+        for (const Backend& be : bes) {
+            Result r;
+            if (!run_isolated(c, be, opt, r)) {
+                std::printf("%-34s %-12s %12s\n", c.name.c_str(), be.name.c_str(), "failed");
+                continue;
+            }
+            std::printf("%-34s %-12s %12.1f %12.2f %9.1f MiB\n", c.name.c_str(), be.name.c_str(),
+                        r.ns_per_op, r.mops, double(r.peak_rss_kb) / 1024.0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#pragma once
+// Pieces shared by bench_allocator and trace_replay: allocator backends
+// behind one interface, and replay of allocation traces through them.
+#include "allocator.h"
+#include "trace_reader.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BENCH_POSIX 1
+#include <dlfcn.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// Backends
+// ---------------------------------------------------------------------------
+
+struct Backend {
+    std::string name;
+    void* (*malloc)(std::size_t);
+    void (*free)(void*);
+    void* (*realloc)(void*, std::size_t);
+    void* (*calloc)(std::size_t, std::size_t);
+    void (*setup)(unsigned threads); // called once before use, may be null
+};
+
+inline void* mini_malloc(std::size_t n) { return mini_alloc::malloc(n); }
+inline void mini_free(void* p) { mini_alloc::free(p); }
+inline void* mini_realloc(void* p, std::size_t n) { return mini_alloc::realloc(p, n); }
+inline void* mini_calloc(std::size_t n, std::size_t size) { return mini_alloc::calloc(n, size); }
+inline void mini_setup(unsigned threads) { mini_alloc::init_allocator(16 * 1024 * 1024, threads); }
+
+inline void* sys_malloc(std::size_t n) { return std::malloc(n); }
+inline void sys_free(void* p) { std::free(p); }
+inline void* sys_realloc(void* p, std::size_t n) { return std::realloc(p, n); }
+inline void* sys_calloc(std::size_t n, std::size_t size) { return std::calloc(n, size); }
+
+// Look up an allocator in the first of libs that loads; RTLD_LOCAL keeps
+// its symbols from interposing on the system malloc. syms names its
+// malloc, free, realloc and calloc.
+inline bool load_backend(std::vector<Backend>& out, const char* name, std::initializer_list<const char*> libs,
+                         const char* const (&syms)[4]) {
+#if BENCH_POSIX
+    for (const char* lib : libs) {
+        void* h = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+        if (!h) continue;
+        auto m = reinterpret_cast<void* (*)(std::size_t)>(dlsym(h, syms[0]));
+        auto f = reinterpret_cast<void (*)(void*)>(dlsym(h, syms[1]));
+        auto r = reinterpret_cast<void* (*)(void*, std::size_t)>(dlsym(h, syms[2]));
+        auto c = reinterpret_cast<void* (*)(std::size_t, std::size_t)>(dlsym(h, syms[3]));
+        if (m && f && r && c) {
+            out.push_back({name, m, f, r, c, nullptr});
+            return true;
+        }
+        dlclose(h);
+    }
+#else
+    (void)out; (void)name; (void)libs; (void)syms;
+#endif
+    return false;
+}
+
+// mini_alloc, the system allocator, and whichever others are installed
+inline std::vector<Backend> backends() {
+    static const char* const je[4] = {"malloc", "free", "realloc", "calloc"};
+    static const char* const mi[4] = {"mi_malloc", "mi_free", "mi_realloc", "mi_calloc"};
+    std::vector<Backend> v;
+    v.push_back({"mini_alloc", mini_malloc, mini_free, mini_realloc, mini_calloc, mini_setup});
+    v.push_back({"system", sys_malloc, sys_free, sys_realloc, sys_calloc, nullptr});
+    load_backend(v, "jemalloc", {"libjemalloc.so.2", "libjemalloc.so", "libjemalloc.dylib"}, je);
+    load_backend(v, "mimalloc", {"libmimalloc.so.2", "libmimalloc.so", "libmimalloc.dylib"}, mi);
+    return v;
+}
+
+// Write to the first and last byte so the memory is really used
+inline void touch(void* p, std::size_t n) {
+    if (!p || !n) return;
+    static_cast<volatile char*>(p)[0] = 1;
+    static_cast<volatile char*>(p)[n - 1] = 1;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+
+using mini_alloc::ReplayOp;
+using mini_alloc::ReplayTrace;
+using mini_alloc::load_trace;
+
+inline void replay_op(const Backend& be, const ReplayOp& op, std::vector<void*>& ptr) {
+    switch (op.kind) {
+    case ReplayOp::Malloc:
+        ptr[op.slot] = be.malloc(op.size);
+        touch(ptr[op.slot], op.size);
+        break;
+    case ReplayOp::Calloc:
+        ptr[op.slot] = be.calloc(1, op.size);
+        break;
+    case ReplayOp::Free:
+        be.free(ptr[op.slot]);
+        ptr[op.slot] = nullptr;
+        break;
+    case ReplayOp::Realloc:
+        ptr[op.slot] = be.realloc(ptr[op.slot], op.size);
+        touch(ptr[op.slot], op.size);
+        break;
+    }
+}
+
+inline std::uint64_t replay(const Backend& be, const ReplayTrace& trace) {
+    std::vector<void*> ptr(trace.slots, nullptr);
+    for (const ReplayOp& op : trace.ops) replay_op(be, op, ptr);
+    return trace.ops.size();
+}
@@ -0,0 +1,211 @@
+// Latency distribution of single malloc and free calls on a fragmented
+// heap: mini_alloc under each placement policy and in real-time mode,
+// against the system allocator.
+//
+//   bench_latency [--live N] [--ops N] [--max-size BYTES]
+//
+// Each configuration fills a heap with N live blocks of log-uniform sizes,
+// then replaces a random one per step (a free, then a malloc), timing every
+// call with the cycle counter where there is one (steady_clock ns
+// elsewhere). It prints percentiles and a log2 histogram of the call
+// times. Without --live it runs at 1000 and at 50000 live blocks: a bound
+// that holds shows as a tail that does not grow with the heap. The max
+// includes interrupts and preemption; p99.99 is the figure to compare.
+//
+// On POSIX every configuration runs in a forked child, as in
+// bench_allocator, so they never share a heap.
+
+#include "bench_common.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#if BENCH_POSIX
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TSC 1
+#endif
+
+static std::uint64_t ticks() {
+#if BENCH_TSC
+    _mm_lfence();
+    std::uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+static const char* const TICK_UNIT =
+#if BENCH_TSC
+    "TSC cycles";
+#else
+    "ns";
+#endif
+
+struct Options {
+    std::vector<std::size_t> live = {1000, 50000};
+    std::size_t ops = 1000000;
+    std::size_t max_size = 8192;
+};
+
+// ---------------------------------------------------------------------------
+// Configurations
+// ---------------------------------------------------------------------------
+
+// Heap mini_alloc starts with, sized for the run so real-time mode never
+// has to grow it; set before each configuration is forked
+static std::size_t heap_bytes = 16 * 1024 * 1024;
+
+static void setup_placement(mini_alloc::Placement policy) {
+    mini_alloc::set_placement(policy);
+    mini_alloc::init_allocator(heap_bytes);
+}
+
+static void setup_best(unsigned) { setup_placement(mini_alloc::Placement::BestFit); }
+static void setup_first(unsigned) { setup_placement(mini_alloc::Placement::FirstFit); }
+static void setup_next(unsigned) { setup_placement(mini_alloc::Placement::NextFit); }
+static void setup_good(unsigned) { setup_placement(mini_alloc::Placement::GoodFit); }
+
+static void setup_realtime(unsigned) {
+    mini_alloc::set_realtime(true);
+    mini_alloc::init_allocator(heap_bytes);
+}
+
+static std::vector<Backend> configurations() {
+    struct Config {
+        const char* name;
+        void (*setup)(unsigned);
+    };
+    static const Config configs[] = {{"mini_alloc/best", setup_best},   {"mini_alloc/first", setup_first},
+                                     {"mini_alloc/next", setup_next},   {"mini_alloc/good", setup_good},
+                                     {"mini_alloc/realtime", setup_realtime}};
+    std::vector<Backend> v;
+    for (const Config& c : configs) v.push_back({c.name, mini_malloc, mini_free, mini_realloc, mini_calloc, c.setup});
+    v.push_back({"system", sys_malloc, sys_free, sys_realloc, sys_calloc, nullptr});
+    return v;
+}
+
+// ---------------------------------------------------------------------------
+// Measurement
+// ---------------------------------------------------------------------------
+
+// Sizes spread evenly over powers of two in [lo, hi]
+static std::size_t log_uniform(std::mt19937_64& rng, std::size_t lo, std::size_t hi) {
+    std::uniform_real_distribution<double> d(std::log2(double(lo)), std::log2(double(hi)));
+    return static_cast<std::size_t>(std::exp2(d(rng)));
+}
+
+static void print_percentiles(const char* op, std::vector<std::uint32_t>& t) {
+    std::sort(t.begin(), t.end());
+    auto pct = [&](double p) { return t[std::min(t.size() - 1, static_cast<std::size_t>(p * double(t.size())))]; };
+    std::printf("  %-8s %8u %8u %8u %8u %8u %10u\n", op, pct(0.5), pct(0.9), pct(0.99), pct(0.999), pct(0.9999),
+                t.back());
+}
+
+// Both vectors sorted
+static void print_histogram(const std::vector<std::uint32_t>& m, const std::vector<std::uint32_t>& f) {
+    std::size_t hm[33] = {}, hf[33] = {};
+    for (std::uint32_t v : m) ++hm[std::bit_width(v)];
+    for (std::uint32_t v : f) ++hf[std::bit_width(v)];
+    std::printf("  %-20s %10s %10s\n", TICK_UNIT, "malloc", "free");
+    for (int k = 0; k < 33; ++k) {
+        if (!hm[k] && !hf[k]) continue;
+        unsigned long lo = k ? 1ul << (k - 1) : 0, hi = 1ul << k;
+        std::printf("  [%7lu, %7lu)    %10zu %10zu\n", lo, hi, hm[k], hf[k]);
+    }
+}
+
+static void run(const Backend& be, std::size_t live, const Options& opt) {
+    if (be.setup) be.setup(1);
+    std::mt19937_64 rng(42);
+    std::vector<void*> blocks(live);
+    for (void*& p : blocks) {
+        std::size_t n = log_uniform(rng, 16, opt.max_size);
+        p = be.malloc(n);
+        touch(p, n);
+    }
+    std::vector<std::uint32_t> tm, tf;
+    tm.reserve(opt.ops);
+    tf.reserve(opt.ops);
+    for (std::size_t i = 0; i < opt.ops; ++i) {
+        void*& slot = blocks[rng() % live];
+        std::size_t n = log_uniform(rng, 16, opt.max_size);
+        std::uint64_t t0 = ticks();
+        be.free(slot);
+        std::uint64_t t1 = ticks();
+        slot = be.malloc(n);
+        std::uint64_t t2 = ticks();
+        touch(slot, n);
+        tf.push_back(static_cast<std::uint32_t>(std::min<std::uint64_t>(t1 - t0, UINT32_MAX)));
+        tm.push_back(static_cast<std::uint32_t>(std::min<std::uint64_t>(t2 - t1, UINT32_MAX)));
+    }
+    for (void* p : blocks) be.free(p);
+
+    std::printf("%s, %zu live blocks of 16..%zu bytes, %zu replacements (%s):\n", be.name.c_str(), live,
+                opt.max_size, opt.ops, TICK_UNIT);
+    std::printf("  %-8s %8s %8s %8s %8s %8s %10s\n", "op", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    print_percentiles("malloc", tm);
+    print_percentiles("free", tf);
+    print_histogram(tm, tf);
+    std::printf("\n");
+}
+
+static void run_isolated(const Backend& be, std::size_t live, const Options& opt) {
+#if BENCH_POSIX
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        run(be, live, opt);
+        std::fflush(stdout);
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::printf("%s, %zu live blocks: failed\n\n", be.name.c_str(), live);
+    }
+#else
+    run(be, live, opt);
+#endif
+}
+
+static void usage() {
+    std::puts("usage: bench_latency [--live N] [--ops N] [--max-size BYTES]");
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--live" && has_value) opt.live = {std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10))};
+        else if (arg == "--ops" && has_value) opt.ops = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        else if (arg == "--max-size" && has_value) opt.max_size = std::max<std::size_t>(16, std::strtoull(argv[++i], nullptr, 10));
+        else {
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    std::vector<Backend> bes = configurations();
+    for (std::size_t live : opt.live) {
+        // mean of the log-uniform sizes, with room for fragmentation
+        double mean = double(opt.max_size - 16) / std::log(double(opt.max_size) / 16.0);
+        heap_bytes = std::max<std::size_t>(16u << 20, static_cast<std::size_t>(3.0 * mean * double(live)));
+        for (const Backend& be : bes) run_isolated(be, live, opt);
+    }
+    return 0;
+}
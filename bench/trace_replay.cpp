@@ -0,0 +1,108 @@
+// Replays an allocation trace recorded with mini_alloc::trace_start (or
+// MINI_ALLOC_TRACE=file) against one allocator backend, timing every call.
+//
+//   trace_replay TRACE [--backend NAME]
+//
+// NAME is mini_alloc (default), system, jemalloc or mimalloc. The threads of
+// the trace are replayed as one sequence in timestamp order. For mini_alloc
+// the heap shape is printed as it stood at the end of the trace, before the
+// objects still live then are freed.
+
+#include "bench_common.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if BENCH_POSIX
+#include <sys/resource.h>
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+static const char* const KIND_NAMES[] = {"malloc", "calloc", "free", "realloc"};
+
+static void print_latencies(const char* name, std::vector<std::uint32_t>& ns) {
+    if (ns.empty()) return;
+    std::sort(ns.begin(), ns.end());
+    double sum = 0;
+    for (std::uint32_t v : ns) sum += v;
+    auto pct = [&](double p) { return ns[std::min(ns.size() - 1, static_cast<std::size_t>(p * double(ns.size())))]; };
+    std::printf("%-8s %10zu %10.1f %8u %8u %8u %8u %10u\n", name, ns.size(), sum / double(ns.size()),
+                pct(0.5), pct(0.9), pct(0.99), pct(0.999), ns.back());
+}
+
+static void print_mini_alloc_state() {
+    mini_alloc::Stats st = mini_alloc::get_stats();
+    mini_alloc::HeapReport r = mini_alloc::heap_report();
+    std::printf("\nmini_alloc at end of trace:\n");
+    std::printf("  allocated %zu bytes, committed %zu (peak %zu)\n", st.bytes_allocated, st.bytes_committed,
+                st.peak_committed);
+    std::printf("  free %zu bytes in %zu blocks, largest %zu, external fragmentation %.3f\n", r.free_bytes,
+                r.free_blocks, r.largest_free_block, r.external_fragmentation);
+    std::printf("  header overhead %.2f%%, slabs %zu bytes (%zu free)\n", r.header_overhead_percent, r.slab_bytes,
+                r.slab_free_bytes);
+}
+
+int main(int argc, char** argv) {
+    const char* path = nullptr;
+    std::string backend = "mini_alloc";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--backend" && i + 1 < argc) backend = argv[++i];
+        else if (!path && arg[0] != '-') path = argv[i];
+        else path = nullptr, i = argc;
+    }
+    if (!path) {
+        std::puts("usage: trace_replay TRACE [--backend mini_alloc|system|jemalloc|mimalloc]");
+        return 1;
+    }
+
+    ReplayTrace trace;
+    std::string error;
+    if (!load_trace(path, trace, error)) {
+        std::fprintf(stderr, "trace_replay: %s\n", error.c_str());
+        return 1;
+    }
+    std::vector<Backend> bes = backends();
+    auto be = std::find_if(bes.begin(), bes.end(), [&](const Backend& b) { return b.name == backend; });
+    if (be == bes.end()) {
+        std::fprintf(stderr, "trace_replay: backend %s is not available\n", backend.c_str());
+        return 1;
+    }
+    if (be->setup) be->setup(1);
+    std::printf("%s: %zu operations on up to %u live objects (%zu records about earlier objects skipped)\n",
+                path, trace.ops.size(), trace.slots, trace.skipped);
+
+    // cost of the timer itself, to read the latencies against
+    auto c0 = Clock::now();
+    for (int i = 0; i < 1000; ++i) (void)Clock::now();
+    double timer_ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - c0).count()) / 1000.0;
+
+    std::vector<void*> ptr(trace.slots, nullptr);
+    std::vector<std::uint32_t> ns[4];
+    std::size_t end = std::min(trace.cleanup_from, trace.ops.size());
+    auto t0 = Clock::now();
+    for (std::size_t i = 0; i < end; ++i) {
+        const ReplayOp& op = trace.ops[i];
+        auto s = Clock::now();
+        replay_op(*be, op, ptr);
+        auto e = Clock::now();
+        ns[op.kind].push_back(static_cast<std::uint32_t>(
+            std::min<std::int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(e - s).count(), UINT32_MAX)));
+    }
+    double total_ms = double(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count()) / 1e3;
+
+    std::printf("backend %s: %.2f ms, timer overhead ~%.0f ns per call\n\n", be->name.c_str(), total_ms, timer_ns);
+    std::printf("%-8s %10s %10s %8s %8s %8s %8s %10s\n", "op", "count", "mean ns", "p50", "p90", "p99", "p99.9", "max");
+    for (int k = 0; k < 4; ++k) print_latencies(KIND_NAMES[k], ns[k]);
+    if (be->name == "mini_alloc") print_mini_alloc_state();
+
+    for (std::size_t i = end; i < trace.ops.size(); ++i) replay_op(*be, trace.ops[i], ptr);
+#if BENCH_POSIX
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    std::printf("\npeak RSS %.1f MiB\n", double(ru.ru_maxrss) / 1024.0);
+#endif
+    return 0;
+}
@@ -25,19 +25,313 @@
 
 #pragma once
 #include <cstddef>
+#include <cstdio>
 
 namespace mini_alloc {
 
-// Initialize the allocator (optional, called automatically on first use)
-void init_allocator(std::size_t heap_size = 16 * 1024 * 1024); // default 16 MiB
+// Initialize the allocator (optional, called automatically on first use).
+// The heap grows on demand in OS-mapped chunks of at least heap_size bytes.
+// With arenas > 1, threads are assigned round-robin to that many independent
+// heaps; arenas after the first map their first chunk lazily.
+void init_allocator(std::size_t heap_size = 16 * 1024 * 1024, // default 16 MiB
+                    std::size_t arenas = 1);
 
 // Allocation API (names avoid colliding with std::malloc)
+// Thread-safe; requests up to 256 bytes come from header-less slab slots
+// and small blocks are served from per-thread caches.
 void* malloc(std::size_t size);
 void free(void* ptr);
 void* realloc(void* ptr, std::size_t new_size);
 void* calloc(std::size_t nmemb, std::size_t size);
 
+// Usable size of allocation ptr: at least what was asked for, often more
+// (size rounding, split thresholds), and all of it may be written. In
+// hardened mode, once asked, only the canary after it is checked for
+// overflows. 0 for nullptr.
+std::size_t malloc_usable_size(void* ptr);
+
+// realloc for containers that grow geometrically: when ptr has to grow or
+// move it gets capacity_hint bytes if it can (new_size at least), so later
+// growth fits in place. *usable, if given, receives the result's
+// malloc_usable_size, the capacity to grow into without calling back.
+void* realloc_hint(void* ptr, std::size_t new_size, std::size_t capacity_hint, std::size_t* usable = nullptr);
+
+// NUMA: on a machine with several nodes each node gets its own arenas (the
+// arenas count is rounded up to a multiple of the node count), whose memory
+// is bound to that node, and a thread allocates from the node it first
+// allocates on. malloc_on_node takes memory from node's arenas whichever
+// thread asks, for workers pinned elsewhere; free it as usual. nullptr for
+// a node that doesn't exist (only node 0 without NUMA, which is plain
+// malloc). MINI_ALLOC_NUMA=0 in the environment turns NUMA mode off.
+void* malloc_on_node(std::size_t size, int node);
+
+// free for callers that know the size they asked for (as sized operator
+// delete does); size must be the one passed to malloc/calloc/realloc
+void free_sized(void* ptr, std::size_t size);
+
+// Batch interface for many allocations of one size: malloc_batch stores up
+// to count pointers in out, carving them from as few free spans as it can,
+// and returns how many it allocated (fewer only when memory runs out).
+// free_batch frees them all, sorting ptrs in place so neighbouring blocks
+// are coalesced in one sweep.
+std::size_t malloc_batch(std::size_t size, std::size_t count, void** out);
+void free_batch(void** ptrs, std::size_t count);
+
+// Aligned allocation; alignment must be a power of two. The result is
+// released with free like any other block. posix_memalign also requires a
+// multiple of sizeof(void*) and returns EINVAL or ENOMEM on failure.
+void* aligned_alloc(std::size_t alignment, std::size_t size);
+int posix_memalign(void** memptr, std::size_t alignment, std::size_t size);
+
+// Flags of malloc_flags
+constexpr unsigned MINI_ALLOC_CACHELINE = 1; // payload has its cache lines to itself
+
+// malloc with placement flags. Small objects of different threads already
+// come from separate spans; MINI_ALLOC_CACHELINE further aligns the payload
+// to a 64-byte cache line and rounds it up to whole lines, so no other
+// allocation or allocator metadata shares a line with it (for counters and
+// locks that threads write concurrently). A realloc drops the guarantee.
+void* malloc_flags(std::size_t size, unsigned flags);
+
+// Returning memory to the OS: the page-aligned interiors of large free
+// blocks are purged once they have stayed free for decay_ms (checked from
+// free); a negative value disables automatic purging. Default: 10 s.
+void set_purge_decay(long decay_ms);
+void purge(); // purge all large free blocks now, regardless of decay
+
+// Requests of at least bytes get a mapping of their own; realloc resizes
+// those with mremap where available instead of copying. Default: 2 MiB.
+void set_huge_threshold(std::size_t bytes);
+
+// Backing the heap with 2 MiB pages, for large heaps that miss in the TLB:
+// Transparent asks for transparent huge pages (madvise MADV_HUGEPAGE) and
+// Explicit maps reserved hugetlbfs pages (MAP_HUGETLB), falling back to
+// transparent ones when too few are reserved. Block chunks and huge
+// allocations mapped afterwards are aligned to 2 MiB, and block chunks are
+// committed and purged only in whole huge pages; slab chunks keep base
+// pages. MINI_ALLOC_HUGE_PAGES=thp|explicit|off at initialization also
+// sets it. Default: Off.
+enum class HugePages { Off, Transparent, Explicit };
+void set_huge_pages(HugePages pages);
+
+// Where blocks above 1 KiB are carved from. BestFit takes the smallest
+// large enough block, the lowest-addressed among equals, from a balanced
+// tree in O(log n), which keeps fragmentation lowest over long runs;
+// FirstFit takes the lowest-addressed large enough block of the first size
+// class that has one, at the cost of scanning that whole class; NextFit
+// resumes each class where its last search stopped, spreading reuse over
+// the class; GoodFit is Two-Level Segregated Fit, O(1) at the cost of up
+// to 1/16 of a block unused (see set_realtime). Smaller requests always get
+// an exact fit. MINI_ALLOC_PLACEMENT=first|next|best|good at
+// initialization also sets it. Default: BestFit.
+enum class Placement { BestFit, FirstFit, NextFit, GoodFit };
+void set_placement(Placement policy);
+
+// Real-time mode, for callers that care about the worst case of malloc and
+// free rather than the mean: GoodFit placement, no purging from free, and
+// chunks that are committed and faulted in when mapped. Block allocation
+// and free then take a bounded number of steps (two bitmap scans and a
+// handful of list updates, no loop over the heap's blocks) as long as the
+// heap needn't grow and the arena lock is uncontended; size init_allocator's
+// heap_size for the peak and call this before it. A thread's first malloc
+// after other threads freed its blocks also drains those frees. The bound
+// is on steps, not time: cache misses, interrupts and preemption still add
+// to a call. bench/bench_latency measured p99.99 on one x86-64 core, with
+// 1000 and with 50000 live blocks:
+//   malloc  900-1400 TSC cycles, 2100-2800 (BestFit: 3800-12800, 8600-9900)
+//   free    800-1300 TSC cycles, 2300-6100 (BestFit: 1300-12900, 2600-3800)
+// Its max column is not bounded by any of this. MINI_ALLOC_REALTIME=1 at
+// initialization also sets it; off again restores BestFit.
+void set_realtime(bool on);
+
+// Hardened mode, for running checked builds in production: every block and
+// slab slot gets a trailing canary (which also covers its header) checked
+// on free, frees are validated in O(1) against a bitmap of live
+// allocations, and, if set_quarantine_size gives it room, freed memory sits
+// in a per-thread quarantine before reuse. Errors that are otherwise reported and ignored abort the
+// process. The mode is fixed when the heap initializes: set_hardened only
+// works before that and returns false if it came too late. Also enabled by
+// MINI_ALLOC_HARDENED=1 in the environment, or by default when built with
+// the MINI_ALLOC_HARDENED CMake option.
+bool set_hardened(bool on);
+
+// Bytes of freed memory each thread holds in quarantine in hardened mode
+// (at most 128 frees; MINI_ALLOC_QUARANTINE=bytes at initialization).
+// Quarantined memory is poisoned, and a write to it is caught when it is
+// released for reuse. The quarantine is the costliest check. Measured by
+// bench_allocator on one core against the plain heap (88 ns per op in
+// replay/synthetic, 22 ns per pair/64 malloc and free):
+//   0 (off)   canaries and the live bitmap only: replay +25-40%, pair/64 x2.4
+//   4 KiB     replay +50%, pair/64 x3
+//   256 KiB   replay +40-50%, pair/64 x3, peak RSS +1.5 MiB
+// Poisoning and checking each free dominates, so past a few KiB the size
+// costs memory rather than time. Default: 0.
+void set_quarantine_size(std::size_t bytes);
+
+// Region allocator: bump-pointer allocation out of regions taken from the
+// main heap, with everything dropped at once by reset() or release().
+// save()/restore() roll back to an earlier point, so regions nest (Scope
+// does it for a C++ scope). Individual allocations are never freed and no
+// destructors run. Not thread-safe; use one Arena per thread.
+class Arena {
+public:
+    struct Marker {
+        void* region;
+        char* ptr;
+    };
+
+    class Scope {
+    public:
+        explicit Scope(Arena& arena) : arena_(arena), mark_(arena.save()) {}
+        ~Scope() { arena_.restore(mark_); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Arena& arena_;
+        Marker mark_;
+    };
+
+    explicit Arena(std::size_t region_size = 64 * 1024);
+    ~Arena();
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(Arena&& other) noexcept;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // alignment must be a power of two; nullptr when the heap is exhausted
+    void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t));
+
+    Marker save() const;
+    void restore(Marker mark); // drops everything allocated since mark
+    void reset();              // drops everything, keeps the regions for reuse
+    void release();            // drops everything and frees the regions
+
+private:
+    struct Region;
+    Region* first_ = nullptr;   // regions in the order they are filled
+    Region* current_ = nullptr; // region being bumped into
+    char* ptr_ = nullptr;
+    char* end_ = nullptr;
+    std::size_t region_size_;
+};
+
+// Statistics. Counters are kept per thread and summed by get_stats(), so
+// the totals are a snapshot rather than an exact instant. Byte counts use
+// usable sizes (what malloc_usable_size would report), not request sizes.
+// Histogram class i covers usable sizes up to (i + 1) * 16 bytes for
+// i < 64 and (2^(i - 54), 2^(i - 53)] above that.
+constexpr std::size_t STATS_SIZE_CLASSES = 118;
+
+struct Stats {
+    std::size_t bytes_allocated; // live, handed out and not yet freed
+    std::size_t bytes_free;      // in free blocks and free slab slots
+    std::size_t bytes_committed; // obtained from the OS, metadata included
+    std::size_t peak_committed;  // high-water mark of bytes_committed
+    std::size_t allocations;     // successful allocations so far
+    std::size_t frees;
+    std::size_t class_allocations[STATS_SIZE_CLASSES]; // allocations per size class
+    std::size_t class_live[STATS_SIZE_CLASSES];        // of those, still allocated
+};
+
+Stats get_stats();
+
+// Allocation tracing (opt-in): between trace_start and trace_stop every
+// malloc, free, realloc and calloc (and the aligned, sized and batch
+// variants) appends a record to a per-thread buffer, written to path in
+// blocks (format in trace_format.h; bench/trace_replay replays it).
+// Setting MINI_ALLOC_TRACE=path starts a trace at initialization that
+// stops at exit. trace_start returns false if the file can't be created or
+// a trace is already running.
+bool trace_start(const char* path);
+void trace_stop();
+
+// Sampling heap profiler (opt-in): between profile_start and profile_stop
+// about one allocation per sample_bytes allocated is sampled. Each thread
+// counts its bytes down from a random distance, so the others cost one
+// subtraction; only a sampled allocation has its stack captured, and it is
+// tracked until freed. profile_dump writes the samples per stack, live and
+// since the first start, as a legacy pprof heap profile
+// (`pprof <binary> path` scales them back to estimated totals). Setting
+// MINI_ALLOC_PROFILE=path (and MINI_ALLOC_PROFILE_RATE=bytes) profiles
+// from initialization on and dumps to path at exit, and on POSIX to path.1,
+// path.2, ... on SIGUSR2 (written by the next sampled allocation).
+// profile_start returns false if profiling is already on.
+bool profile_start(std::size_t sample_bytes = 512 * 1024);
+void profile_stop();
+bool profile_dump(const char* path);
+
+// Heap shape, from one walk over the block chains of every arena (huge
+// chunks are not included). Block sizes include their headers.
+struct HeapReport {
+    std::size_t chunks;             // block chunks
+    std::size_t heap_bytes;         // bytes spanned by their block chains
+    std::size_t used_blocks, used_bytes;
+    std::size_t cached_blocks, cached_bytes; // allocated, parked in thread caches
+    std::size_t free_blocks, free_bytes;
+    std::size_t largest_free_block;
+    std::size_t free_blocks_by_log2[64]; // free blocks of [2^i, 2^(i+1)) bytes
+    std::size_t header_bytes;       // block tags and chunk sentinels
+    double external_fragmentation;  // 1 - largest_free_block / free_bytes
+    double header_overhead_percent; // header_bytes / heap_bytes * 100
+    std::size_t slab_bytes, slab_free_bytes; // runs in use by slabs, and their free slots
+};
+
+HeapReport heap_report();
+
+// The heap map for offline tools: every chunk with its blocks (or slabs).
+// dump_heap_json writes a JSON document; dump_heap_binary a snapshot of
+// native-endian 64-bit words, laid out as described in allocator.cpp.
+void dump_heap_json(std::FILE* out);
+void dump_heap_binary(std::FILE* out);
+
 // Debug / introspection
 void dump_heap(); // prints block list to stdout for debugging
 
+// Walk every arena under its lock and verify the heap's invariants: block
+// chains that tile each chunk up to its sentinel, free blocks coalesced
+// with matching footers and all in the free lists of their class (and in
+// the policy's index), and slab slots all accounted for. Prints the first
+// problem of each arena to stderr and returns false if there was one.
+bool check_heap();
+
+// A heap of its own: chunks of at least chunk_size bytes mapped for it
+// alone (none until the first allocation), its own placement policy and its
+// own stats, next to the default heap the functions above serve. Its memory
+// bypasses the thread caches (and the quarantine in hardened mode) and no
+// request gets a mapping of its own, so the destructor, or release(), drops
+// everything at once by unmapping the chunks: pointers into the Heap are
+// invalid after that, and it must not race with other calls on it.
+// Otherwise thread-safe, with one lock. mini_alloc::free and realloc accept
+// its pointers too; realloc keeps a block in the Heap it came from.
+// get_stats() counts a Heap's allocations and commits along with the rest.
+class Heap {
+public:
+    explicit Heap(std::size_t chunk_size = 1024 * 1024, Placement policy = Placement::BestFit);
+    ~Heap();
+    Heap(Heap&& other) noexcept;
+    Heap& operator=(Heap&& other) noexcept;
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    void* malloc(std::size_t size);
+    void* calloc(std::size_t nmemb, std::size_t size);
+    void* realloc(void* ptr, std::size_t new_size);
+    void* aligned_alloc(std::size_t alignment, std::size_t size);
+    void free(void* ptr);
+
+    bool owns(const void* ptr) const; // ptr is in this Heap's chunks
+    void set_placement(Placement policy);
+    void release(); // frees everything and unmaps the chunks
+
+    // From a walk over the Heap under its lock; frees are the allocations
+    // no longer live, and bytes_committed includes the Heap's bookkeeping
+    Stats stats() const;
+    HeapReport report() const;
+
+private:
+    struct State;
+    State* state_; // nullptr once moved from: allocations then fail
+};
+
 } // namespace mini_alloc
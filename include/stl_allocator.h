@@ -0,0 +1,103 @@
+#pragma once
+// Standard-library adapters for mini_alloc: an allocator for containers
+// and std::pmr memory resources over the heap, a node pool and an Arena.
+#include "allocator.h"
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+namespace mini_alloc {
+
+// Allocator for standard containers; stateless, so all instances compare
+// equal. Deallocation passes the size on to free_sized.
+template <typename T>
+class StlAllocator {
+public:
+    using value_type = T;
+
+    StlAllocator() noexcept = default;
+    template <typename U>
+    StlAllocator(const StlAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+        std::size_t bytes = n ? n * sizeof(T) : 1;
+        void* p = overaligned ? mini_alloc::aligned_alloc(alignof(T), bytes) : mini_alloc::malloc(bytes);
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (overaligned) mini_alloc::free(p);
+        else mini_alloc::free_sized(p, n ? n * sizeof(T) : 1);
+    }
+
+    template <typename U>
+    bool operator==(const StlAllocator<U>&) const noexcept { return true; }
+
+private:
+    static constexpr bool overaligned = alignof(T) > alignof(std::max_align_t);
+};
+
+// std::pmr resource over the heap; all instances are interchangeable
+class memory_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// Process-wide instance of memory_resource
+std::pmr::memory_resource* heap_resource() noexcept;
+
+// Node pool: per size class free lists of header-free nodes (up to
+// max_node_size bytes, ALIGNMENT-aligned) carved from an Arena; larger or
+// over-aligned requests go to the heap. release() drops all pooled nodes
+// at once. Not thread-safe, like std::pmr::unsynchronized_pool_resource.
+class pool_resource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t max_node_size = 1024;
+
+    explicit pool_resource(std::size_t region_size = 64 * 1024) : arena_(region_size) {}
+    pool_resource(const pool_resource&) = delete;
+    pool_resource& operator=(const pool_resource&) = delete;
+
+    void release();
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+private:
+    static constexpr std::size_t granule = alignof(std::max_align_t);
+    struct Node {
+        Node* next;
+    };
+    Arena arena_;
+    Node* free_[max_node_size / granule] = {};
+};
+
+// Monotonic resource over an Arena: deallocation is a no-op and memory comes
+// back with reset() / release(), or through the arena's markers.
+class arena_resource : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(std::size_t region_size = 64 * 1024) : arena_(region_size) {}
+    arena_resource(const arena_resource&) = delete;
+    arena_resource& operator=(const arena_resource&) = delete;
+
+    Arena& arena() noexcept { return arena_; }
+    void reset() { arena_.reset(); }
+    void release() { arena_.release(); }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    Arena arena_;
+};
+
+} // namespace mini_alloc
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+
+// On-disk format of allocation traces (see mini_alloc::trace_start): a
+// TraceFileHeader, then blocks of records, each a TraceBlockHeader followed
+// by count TraceRecords of one thread. Blocks of different threads are
+// interleaved in flush order; sort by time to recover the global order.
+// All fields are native-endian.
+
+namespace mini_alloc {
+
+constexpr char TRACE_MAGIC[8] = {'M', 'A', 'T', 'R', 'A', 'C', 'E', '1'};
+constexpr std::uint32_t TRACE_VERSION = 1;
+
+enum class TraceOp : std::uint8_t {
+    Malloc = 1,       // id = result
+    Free = 2,         // id = pointer freed
+    Realloc = 3,      // id = result, arg = old pointer
+    Calloc = 4,       // id = result, size = nmemb * size
+    AlignedAlloc = 5, // id = result, arg = alignment
+};
+
+enum class TraceClock : std::uint32_t {
+    Nanoseconds = 0, // steady clock
+    Tsc = 1,         // CPU timestamp counter, in cycles
+};
+
+struct TraceFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    TraceClock clock;
+};
+
+struct TraceBlockHeader {
+    std::uint32_t thread; // numbered from 1 in order of first traced call;
+                          // 0 for threads without a cache slot
+    std::uint32_t count;
+};
+
+// Pointers are recorded as their addresses, which identify live objects;
+// a failed allocation has id 0
+struct TraceRecord {
+    std::uint64_t time;
+    std::uint64_t id;
+    std::uint64_t arg;
+    std::uint64_t size_op; // size << 8 | op
+
+    TraceOp op() const { return static_cast<TraceOp>(size_op & 0xff); }
+    std::uint64_t size() const { return size_op >> 8; }
+};
+
+static_assert(sizeof(TraceRecord) == 32, "trace records are 32 bytes");
+
+} // namespace mini_alloc
@@ -0,0 +1,126 @@
+#pragma once
+#include "trace_format.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Reading allocation traces back for replay (see trace_replay and
+// bench_allocator --trace): the records become operations on numbered
+// slots, each standing for one live pointer, so a trace can be replayed
+// against any allocator.
+
+namespace mini_alloc {
+
+// One operation of a replayed trace; slots stand for the pointers
+struct ReplayOp {
+    enum Kind : std::uint8_t { Malloc, Calloc, Free, Realloc } kind;
+    std::uint32_t slot;
+    std::size_t size;
+};
+
+struct ReplayTrace {
+    std::vector<ReplayOp> ops;
+    std::uint32_t slots = 0;        // pointers live at once, at most
+    std::size_t skipped = 0;        // records about objects allocated before the trace
+    std::size_t cleanup_from = -1;  // first of the frees of objects left live
+};
+
+// Read a trace written by mini_alloc::trace_start and turn it into slot
+// operations in timestamp order. Threads are merged into one sequence.
+// Aligned allocations become plain ones. Objects still live at the end are
+// freed, so a replay leaves nothing behind.
+inline bool load_trace(const char* path, ReplayTrace& out, std::string& error) {
+    std::FILE* f = std::fopen(path, "rb");
+    if (!f) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+    TraceFileHeader header{};
+    if (std::fread(&header, sizeof(header), 1, f) != 1 ||
+        std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) {
+        std::fclose(f);
+        error = std::string(path) + " is not a mini_alloc trace";
+        return false;
+    }
+    std::vector<TraceRecord> records;
+    TraceBlockHeader block;
+    while (std::fread(&block, sizeof(block), 1, f) == 1) {
+        std::size_t at = records.size();
+        records.resize(at + block.count);
+        if (std::fread(records.data() + at, sizeof(TraceRecord), block.count, f) != block.count) {
+            records.resize(at); // torn last block
+            break;
+        }
+    }
+    std::fclose(f);
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) { return a.time < b.time; });
+
+    std::unordered_map<std::uint64_t, std::uint32_t> live; // id -> slot
+    std::vector<std::uint32_t> spare;
+    auto emit_free = [&](std::uint64_t id) {
+        auto it = live.find(id);
+        if (it == live.end()) return false;
+        out.ops.push_back({ReplayOp::Free, it->second, 0});
+        spare.push_back(it->second);
+        live.erase(it);
+        return true;
+    };
+    auto emit_alloc = [&](ReplayOp::Kind kind, std::uint64_t id, std::size_t size) {
+        if (!id) return; // failed in the original run
+        emit_free(id);   // address reused before its free was recorded
+        std::uint32_t slot;
+        if (spare.empty()) {
+            slot = out.slots++;
+        } else {
+            slot = spare.back();
+            spare.pop_back();
+        }
+        live[id] = slot;
+        out.ops.push_back({kind, slot, size});
+    };
+
+    for (const TraceRecord& r : records) {
+        switch (r.op()) {
+        case TraceOp::Malloc:
+        case TraceOp::AlignedAlloc:
+            emit_alloc(ReplayOp::Malloc, r.id, r.size());
+            break;
+        case TraceOp::Calloc:
+            emit_alloc(ReplayOp::Calloc, r.id, r.size());
+            break;
+        case TraceOp::Free:
+            if (!emit_free(r.id)) ++out.skipped;
+            break;
+        case TraceOp::Realloc: {
+            auto it = r.arg ? live.find(r.arg) : live.end();
+            if (r.arg && it == live.end()) {
+                ++out.skipped;
+                emit_alloc(ReplayOp::Malloc, r.id, r.size());
+            } else if (!r.arg) {
+                emit_alloc(ReplayOp::Malloc, r.id, r.size());
+            } else if (r.size() == 0) {
+                emit_free(r.arg);
+            } else if (r.id) {
+                std::uint32_t slot = it->second;
+                live.erase(it);
+                emit_free(r.id);
+                live[r.id] = slot;
+                out.ops.push_back({ReplayOp::Realloc, slot, r.size()});
+            }
+            break;
+        }
+        default:
+            ++out.skipped;
+        }
+    }
+    out.cleanup_from = out.ops.size();
+    for (auto& [id, slot] : live) out.ops.push_back({ReplayOp::Free, slot, 0});
+    return true;
+}
+
+} // namespace mini_alloc
@@ -1,228 +1,4160 @@
-
 #include "allocator.h"
+#include "trace_format.h"
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <cerrno>
 #include <cassert>
 #include <new>
 #include <algorithm>
 #include <limits>
+#include <utility>
+#include <functional>
+#include <bit>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define MINI_ALLOC_BACKTRACE 1
+#endif
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#define MINI_ALLOC_NOINLINE __declspec(noinline)
+#else
+#define MINI_ALLOC_NOINLINE __attribute__((noinline))
+#endif
 
 namespace mini_alloc {
 
 constexpr std::size_t DEFAULT_HEAP_SIZE = 16 * 1024 * 1024; // 16 MiB
 constexpr std::size_t ALIGNMENT = alignof(std::max_align_t);
-constexpr std::size_t MIN_BLOCK_SIZE = 32; // minimum payload size
 
 // Align up utility
-static inline std::size_t align_up(std::size_t n, std::size_t a = ALIGNMENT) {
+constexpr std::size_t align_up(std::size_t n, std::size_t a = ALIGNMENT) {
     return (n + (a - 1)) & ~(a - 1);
 }
 
-// Block header
-struct alignas(ALIGNMENT) Block {
-    std::size_t size;   // size of payload
-    bool free;          // is block free?
+// Block header: a single tag word packing the block size (header included,
+// a multiple of ALIGNMENT), two flag bits and the owning thread cache.
+// Payloads start right after the tag, so headers sit at 8 mod 16. Free
+// blocks also repeat their size in a footer (their last word), which lets
+// the next block find them through TAG_PREV_FREE without any list pointers.
+//
+// Tags are only written with the arena lock held; the free fast path reads
+// them without it, hence the relaxed atomic accesses.
+struct Block {
+    std::size_t tag;
+};
+
+constexpr std::size_t HEADER_SIZE = sizeof(Block);
+constexpr std::size_t TAG_FREE = 1;       // block is in the arena free lists
+constexpr std::size_t TAG_PREV_FREE = 2;  // physical predecessor is free
+constexpr std::size_t TAG_SAMPLED = 4;    // allocated block is a live profiler sample
+constexpr std::size_t TAG_ZERO = 8;       // free block: payload is zero but for its metadata and footer
+constexpr std::size_t OWNER_SHIFT = 48;
+constexpr std::size_t TAG_SIZE_MASK = ((std::size_t(1) << OWNER_SHIFT) - 1) & ~(ALIGNMENT - 1);
+
+// Free-list links, stored in the payload of free blocks only
+struct FreeLinks {
+    Block* next;
+    Block* prev;
+};
+
+// Purge bookkeeping, stored after the links of free blocks >= PURGE_MIN_SIZE
+struct SpanInfo {
+    std::uint64_t freed_at; // ms timestamp
+    bool purged;            // interior pages already returned to the OS
+};
+
+// Free blocks above SMALL_CLASS_MAX are also kept in the index of the
+// placement policy, linked through the two words after their span info:
+// a treap ordered by (size, address) for best fit, or a TLSF second-level
+// list for good fit
+struct TreeLinks {
+    Block* left;
+    Block* right;
+};
+
+struct SubLinks {
     Block* next;
     Block* prev;
 };
 
-static char* heap_base = nullptr;
-static std::size_t heap_total_size = 0;
-static Block* head = nullptr;
-static bool initialized = false;
+// Smallest block: header, free-list links and footer
+constexpr std::size_t MIN_BLOCK_SIZE = align_up(HEADER_SIZE + sizeof(FreeLinks) + sizeof(std::size_t));
+
+// Size classes (by block size): exact classes every ALIGNMENT bytes up to
+// SMALL_CLASS_MAX, then one class per power of two above that.
+constexpr std::size_t SMALL_CLASS_MAX = 1024;
+constexpr std::size_t NUM_SMALL_CLASSES = SMALL_CLASS_MAX / ALIGNMENT;
+constexpr std::size_t SMALL_CLASS_SHIFT = 10; // log2(SMALL_CLASS_MAX)
+constexpr std::size_t NUM_CLASSES = NUM_SMALL_CLASSES + (64 - SMALL_CLASS_SHIFT);
+constexpr std::size_t CLASS_BITMAP_WORDS = (NUM_CLASSES + 63) / 64;
+constexpr std::size_t NUM_LARGE_CLASSES = NUM_CLASSES - NUM_SMALL_CLASSES;
+
+// Good fit (TLSF) splits each power-of-two class into TLSF_SUBCLASSES
+// second-level lists of equal width
+constexpr std::size_t TLSF_SUB_SHIFT = 4;
+constexpr std::size_t TLSF_SUBCLASSES = std::size_t(1) << TLSF_SUB_SHIFT;
+
+constexpr std::size_t MAX_ARENAS = 64;
+
+// Requests up to SLAB_MAX_SIZE bytes are served from slabs: SLAB_RUN_SIZE
+// runs of dedicated chunks, carved into equal slots with no per-object header.
+constexpr std::size_t SLAB_MAX_SIZE = 256;
+constexpr std::size_t NUM_SLAB_CLASSES = SLAB_MAX_SIZE / ALIGNMENT;
+
+// Chunks are mapped in multiples of CHUNK_ALIGN, aligned to it, so the chunk
+// owning any address is found with a radix-tree lookup on its upper bits.
+constexpr std::size_t CHUNK_SHIFT = 20;
+constexpr std::size_t CHUNK_ALIGN = std::size_t(1) << CHUNK_SHIFT; // 1 MiB
+constexpr std::size_t ADDRESS_BITS = 48;
+constexpr std::size_t RADIX_BITS = ADDRESS_BITS - CHUNK_SHIFT;
+constexpr std::size_t RADIX_LEAF_BITS = RADIX_BITS / 2;
+constexpr std::size_t RADIX_ROOT_BITS = RADIX_BITS - RADIX_LEAF_BITS;
+
+// Chunks reserve address space up front and commit it in steps of this much
+// as the block frontier advances.
+constexpr std::size_t COMMIT_GRANULE = 64 * 1024;
+
+// Chunks backed by huge pages (see set_huge_pages) are aligned to, sized in
+// and committed and purged in whole huge pages
+constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Free blocks at least this large get their interior pages purged once they
+// have stayed free for the decay time.
+constexpr std::size_t PURGE_MIN_SIZE = 64 * 1024;
+constexpr long DEFAULT_PURGE_DECAY_MS = 10000;
+
+// Freed bytes each thread holds back from reuse in hardened mode: none
+// unless asked for, the quarantine being the costliest check
+constexpr std::size_t DEFAULT_QUARANTINE_BYTES = 0;
+
+// Destructive interference granule: memory written by different threads is
+// kept at least this far apart where it matters
+constexpr std::size_t CACHE_LINE = 64;
+
+constexpr std::size_t SLAB_RUN_SHIFT = 14;
+constexpr std::size_t SLAB_RUN_SIZE = std::size_t(1) << SLAB_RUN_SHIFT; // 16 KiB
+constexpr std::size_t SLAB_RUNS = CHUNK_ALIGN / SLAB_RUN_SIZE;
+static_assert(SLAB_RUNS <= 64, "slab run masks are 64-bit");
+
+struct HeapArena;
+
+// Requests of at least this many bytes bypass the arenas and get a mapping
+// of their own (a huge chunk)
+constexpr std::size_t DEFAULT_HUGE_THRESHOLD = 2 * 1024 * 1024;
+
+enum class ChunkKind : std::uint8_t { Blocks, Slabs, Huge };
+
+// A mapped region of an arena with its own physical block chain. The chain
+// runs from head to a zero-size sentinel header in the last word of the
+// committed prefix; committing more pages moves the sentinel forward.
+struct alignas(ALIGNMENT) Chunk {
+    HeapArena* arena;
+    Chunk* next;                    // arena's chunk list
+    std::size_t size;               // bytes reserved, including this header
+    Block* head;                    // first block of the chain
+    std::atomic<char*> committed;   // end of the committed prefix
+    char* touched;                  // end of the highest payload ever handed out; beyond
+                                    // it only free-block metadata has been written
+    ChunkKind kind = ChunkKind::Blocks; // slab and huge chunks leave the block fields unset
+    bool sampled = false;               // huge chunks: a live profiler sample
+    std::size_t huge_offset = 0;        // huge chunks: payload offset from the chunk
+    HugePages pages = HugePages::Off;   // backing, Explicit only if the huge pages were there
+    std::atomic<std::uint64_t>* live = nullptr; // hardened mode: bit per ALIGNMENT bytes,
+                                                // set where an allocated payload starts
+};
+
+// Link word of a free slab slot, followed by tcache_key while the slot sits
+// in a slab or thread cache free list
+struct SlotLinks {
+    SlotLinks* next;
+    void* key;
+};
+
+// One slab: a run of a slab chunk carved into equal slots
+struct Slab {
+    char* start;             // first slot
+    SlotLinks* free;         // freed slots
+    Slab* next;              // arena's partial list for this class
+    Slab* prev;
+    std::uint64_t freed_at;  // ms timestamp the run became unused
+    std::uint32_t slot_size; // 0 while the run is unused
+    std::uint32_t capacity;  // slots in the run
+    std::uint32_t used;      // slots handed out, including those in thread caches
+    std::uint32_t bump;      // slots [bump, capacity) were never handed out
+    std::uint16_t owner;     // thread cache that alone carves the never-used slots, 0 for any
+    bool partial;            // on the partial list
+    bool purged;             // unused run already returned to the OS
+    std::atomic<std::uint32_t> sampled; // slots that are live profiler samples
+};
+
+// A chunk of SLAB_RUNS runs with their descriptors in its header; run 0
+// starts after the header
+struct SlabChunk : Chunk {
+    std::uint64_t free_runs;      // runs with no slab
+    std::uint64_t committed_runs; // runs ever committed
+    Slab slabs[SLAB_RUNS];
+};
+
+struct HeapInstance;
+
+// One independent heap with its own lock, chunks and free lists
+enum class LargeIndex : std::uint8_t { None, Tree, Tlsf };
+
+struct HeapArena {
+    std::mutex lock;                   // guards everything below
+    std::atomic<bool> ready{false};    // first chunk mapped
+    Chunk* chunks = nullptr;           // newest first; only the newest one grows
+    std::uint64_t next_purge_ms = 0;   // earliest time of the next automatic purge pass
+    // Segregated free lists (free blocks only) and a bitmap of non-empty classes
+    Block* free_lists[NUM_CLASSES] = {};
+    std::uint64_t class_bitmap[CLASS_BITMAP_WORDS] = {};
+    std::size_t free_bytes = 0;        // total size of the blocks in free_lists
+    // Index of the blocks in the classes above SMALL_CLASS_MAX, kept only
+    // while the placement policy uses it
+    LargeIndex large_index = LargeIndex::None;
+    Block* large_tree = nullptr;       // best fit: treap
+    Block* sub_lists[NUM_LARGE_CLASSES][TLSF_SUBCLASSES] = {}; // good fit: second level
+    std::uint16_t sub_bitmap[NUM_LARGE_CLASSES] = {};          // and its non-empty lists
+    Block* rovers[NUM_CLASSES] = {};   // next fit: where the next search of each class starts
+    // Slab chunks and, per slab class, the slabs with a slot left
+    SlabChunk* slab_chunks = nullptr;
+    Slab* slab_partial[NUM_SLAB_CLASSES] = {};
+    int node = -1;                     // NUMA node its chunks are bound to, -1 for none
+    HeapInstance* instance = nullptr;  // set for the arena of a Heap
+};
+
+// What the arena of a Heap keeps besides: its settings and its own counts.
+// A Heap's memory never enters a thread cache or the quarantine, so
+// unmapping its chunks drops all of it.
+struct HeapInstance {
+    std::size_t chunk_size;            // minimum chunk size
+    Placement placement;               // a.lock held
+    std::size_t committed = 0;         // bytes committed for it, metadata included; a.lock held
+    std::size_t peak_committed = 0;
+    std::atomic<std::size_t> allocs{0};
+    std::atomic<std::size_t> class_allocs[NUM_CLASSES]{};
+};
+
+static HeapArena arenas[MAX_ARENAS];
+static std::atomic<long> purge_decay_ms{DEFAULT_PURGE_DECAY_MS};
+static std::atomic<std::size_t> huge_threshold{DEFAULT_HUGE_THRESHOLD};
+static std::atomic<HugePages> huge_pages{HugePages::Off};
+static std::atomic<Placement> placement{Placement::BestFit};
+static std::atomic<bool> realtime{false};
+static std::size_t arena_count = 1;     // fixed by init_allocator
+static std::size_t arena_heap_size = 0; // minimum chunk size
+static std::size_t numa_nodes = 1;      // > 1: arenas are grouped by node, fixed by init_allocator
+static std::size_t numa_per_node = 1;   // arenas per node
+static std::atomic<bool> initialized{false};
+static std::mutex init_lock;
+
+// Bytes obtained from the OS and their high-water mark (see note_commit)
+static std::atomic<std::size_t> committed_bytes{0};
+static std::atomic<std::size_t> peak_committed{0};
+
+// Marks blocks parked in a thread cache (stored in their FreeLinks::prev) and
+// free slab slots (SlotLinks::key); an odd value no pointer can take, picked
+// per process by init_allocator
+static Block* tcache_key = nullptr;
+
+// Hardened mode (see "Hardened mode" below), fixed by init_allocator
+#ifndef MINI_ALLOC_HARDENED
+#define MINI_ALLOC_HARDENED 0
+#endif
+static bool hardened_requested = MINI_ALLOC_HARDENED; // init_lock held
+static bool hardened = false;
+static std::uint64_t canary_secret = 0;
+static std::atomic<std::size_t> quarantine_bytes{DEFAULT_QUARANTINE_BYTES};
+
+// Round-robin thread -> arena assignment
+static std::atomic<std::size_t> next_arena{0};
+static thread_local std::size_t thread_arena = MAX_ARENAS; // MAX_ARENAS = unassigned
+
+// Map size bytes aligned to align (a power of two >= page size). With
+// commit = false the range is only reserved and must be committed with
+// os_commit before use; committed pages always read as zero at first.
+static void* os_map_aligned(std::size_t size, std::size_t align, bool commit = true) {
+#if defined(_WIN32)
+    // reserve an oversized range, release it and claim the aligned part;
+    // retry if another thread grabbed the range in between
+    DWORD type = commit ? (MEM_RESERVE | MEM_COMMIT) : MEM_RESERVE;
+    DWORD prot = commit ? PAGE_READWRITE : PAGE_NOACCESS;
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        void* p = VirtualAlloc(nullptr, size + align, MEM_RESERVE, PAGE_NOACCESS);
+        if (!p) return nullptr;
+        VirtualFree(p, 0, MEM_RELEASE);
+        void* aligned = reinterpret_cast<void*>(align_up(reinterpret_cast<std::uintptr_t>(p), align));
+        if (void* q = VirtualAlloc(aligned, size, type, prot)) return q;
+    }
+    return nullptr;
+#else
+    std::size_t span = size + align;
+    int prot = commit ? (PROT_READ | PROT_WRITE) : PROT_NONE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (commit ? 0 : MAP_NORESERVE);
+    void* p = mmap(nullptr, span, prot, flags, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    // trim the misaligned head and the unused tail
+    auto start = reinterpret_cast<std::uintptr_t>(p);
+    std::uintptr_t aligned = align_up(start, align);
+    if (aligned > start) munmap(p, aligned - start);
+    std::size_t tail = (start + span) - (aligned + size);
+    if (tail) munmap(reinterpret_cast<void*>(aligned + size), tail);
+    return reinterpret_cast<void*>(aligned);
+#endif
+}
+
+// Map size bytes (a multiple of HUGE_PAGE_SIZE) of explicit huge pages,
+// aligned to align (a multiple of it), like os_map_aligned; nullptr where
+// the system has too few of them reserved
+static void* os_map_huge(std::size_t size, std::size_t align, bool commit = true) {
+#if defined(MAP_HUGETLB)
+    // hugetlb mappings start on a huge page, so at most this much is trimmed
+    std::size_t span = size + (align - HUGE_PAGE_SIZE);
+    int prot = commit ? (PROT_READ | PROT_WRITE) : PROT_NONE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#if defined(MAP_HUGE_SHIFT)
+    flags |= 21 << MAP_HUGE_SHIFT; // 2 MiB pages even if the default size differs
+#endif
+    void* p = mmap(nullptr, span, prot, flags, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    auto start = reinterpret_cast<std::uintptr_t>(p);
+    std::uintptr_t aligned = align_up(start, align);
+    if (aligned > start) munmap(p, aligned - start);
+    std::size_t tail = (start + span) - (aligned + size);
+    if (tail) munmap(reinterpret_cast<void*>(aligned + size), tail);
+    return reinterpret_cast<void*>(aligned);
+#else
+    (void)size; (void)align; (void)commit;
+    return nullptr;
+#endif
+}
+
+// Ask for transparent huge pages on a mapping
+static void os_advise_huge(void* p, std::size_t size) {
+#if defined(MADV_HUGEPAGE)
+    madvise(p, size, MADV_HUGEPAGE);
+#else
+    (void)p; (void)size;
+#endif
+}
+
+// Make reserved pages usable
+static bool os_commit(void* p, std::size_t size) {
+#if defined(_WIN32)
+    return VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(p, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// Drop the contents of committed pages; they read back as zero (Linux) or
+// undefined (Windows MEM_RESET) and stay usable without recommitting
+static bool os_purge(void* p, std::size_t size) {
+#if defined(_WIN32)
+    VirtualAlloc(p, size, MEM_RESET, PAGE_READWRITE);
+    return false;
+#elif defined(__linux__)
+    // private anonymous pages come back zero-filled
+    return madvise(p, size, MADV_DONTNEED) == 0;
+#else
+    madvise(p, size, MADV_DONTNEED);
+    return false;
+#endif
+}
+
+static std::size_t os_page_size() {
+#if defined(_WIN32)
+    static const std::size_t page = [] {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<std::size_t>(info.dwPageSize);
+    }();
+#else
+    static const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return page;
+}
+
+// Fault committed pages in now rather than on first touch
+static void os_prefault(void* p, std::size_t size) {
+#if defined(MADV_POPULATE_WRITE)
+    if (madvise(p, size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    // writing zeros keeps the pages reading as zero
+    std::size_t page = os_page_size();
+    for (std::size_t off = 0; off < size; off += page) static_cast<volatile char*>(p)[off] = 0;
+}
+
+// Resize a mapping without copying its pages: in place when dest is null,
+// otherwise onto the reserved range dest (replacing it). Returns the new
+// base, or nullptr if the platform can't; the old mapping is then intact.
+static void* os_remap(void* p, std::size_t old_size, std::size_t new_size, void* dest) {
+#if defined(__linux__)
+    void* q = dest ? mremap(p, old_size, new_size, MREMAP_MAYMOVE | MREMAP_FIXED, dest)
+                   : mremap(p, old_size, new_size, 0);
+    return q == MAP_FAILED ? nullptr : q;
+#else
+    (void)p; (void)old_size; (void)new_size; (void)dest;
+    return nullptr;
+#endif
+}
+
+// NUMA placement through the raw syscalls, so there is no libnuma to link.
+// Node masks cover the first NUMA_MAX_NODES nodes; the kernel reads one bit
+// less than the maxnode it is passed.
+constexpr int NUMA_MAX_NODES = 1024;
+#if defined(__linux__)
+constexpr int NUMA_MPOL_PREFERRED = 1;
+constexpr unsigned long NUMA_MPOL_F_MEMS_ALLOWED = 1ul << 2;
+#endif
+
+// Nodes the process may allocate on (one past the highest), 1 if unknown
+static std::size_t os_numa_nodes() {
+#if defined(__linux__)
+    unsigned long mask[NUMA_MAX_NODES / 64] = {};
+    if (syscall(SYS_get_mempolicy, nullptr, mask, NUMA_MAX_NODES + 1, nullptr, NUMA_MPOL_F_MEMS_ALLOWED) != 0) return 1;
+    for (int w = NUMA_MAX_NODES / 64 - 1; w >= 0; --w) {
+        if (mask[w]) return static_cast<std::size_t>(w * 64 + 64 - std::countl_zero(mask[w]));
+    }
+#endif
+    return 1;
+}
+
+// Node of the CPU the calling thread runs on
+static int os_current_node() {
+#if defined(__linux__)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) return static_cast<int>(node);
+#endif
+    return 0;
+}
+
+// Prefer node for the pages of [p, p + size) not yet faulted in. Preferred
+// rather than bound, so a full node falls back to the others instead of
+// failing the allocation.
+static void os_bind_node(void* p, std::size_t size, int node) {
+#if defined(__linux__)
+    if (node < 0 || node >= NUMA_MAX_NODES) return;
+    unsigned long mask[NUMA_MAX_NODES / 64] = {};
+    mask[node / 64] = 1ul << (node % 64);
+    syscall(SYS_mbind, p, size, NUMA_MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0);
+#else
+    (void)p; (void)size; (void)node;
+#endif
+}
+
+static void os_unmap(void* p, std::size_t size) {
+#if defined(_WIN32)
+    (void)size;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, size);
+#endif
+}
+
+// Files written without going through stdio (which may call malloc)
+static int os_create_file(const char* path) {
+#if defined(_WIN32)
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+}
+
+static bool os_write_all(int fd, const void* data, std::size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size) {
+#if defined(_WIN32)
+        int n = _write(fd, p, static_cast<unsigned>(std::min<std::size_t>(size, 1u << 30)));
+#else
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+static void os_close_file(int fd) {
+#if defined(_WIN32)
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Append the contents of the file at path to fd
+static bool os_copy_file(const char* path, int fd) {
+#if defined(_WIN32)
+    (void)path; (void)fd;
+    return false;
+#else
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    char buf[4096];
+    bool ok = true;
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        if (!(ok = os_write_all(fd, buf, static_cast<std::size_t>(n)))) break;
+    }
+    close(in);
+    return ok;
+#endif
+}
+
+// Return addresses on the calling thread's stack, innermost first, from
+// skip frames above the caller on; the first call may allocate
+MINI_ALLOC_NOINLINE static std::size_t os_backtrace(void** frames, std::size_t max, std::size_t skip) {
+#if defined(_WIN32)
+    return CaptureStackBackTrace(static_cast<DWORD>(skip + 1), static_cast<DWORD>(max), frames, nullptr);
+#elif defined(MINI_ALLOC_BACKTRACE)
+    void* all[128];
+    int n = backtrace(all, static_cast<int>(std::min<std::size_t>(max + skip + 1, 128)));
+    std::size_t from = std::min<std::size_t>(static_cast<std::size_t>(n), skip + 1);
+    std::size_t count = std::min(max, static_cast<std::size_t>(n) - from);
+    std::memcpy(frames, all + from, count * sizeof(void*));
+    return count;
+#else
+    (void)frames; (void)max; (void)skip;
+    return 0;
+#endif
+}
+
+// Account for memory committed (or, with note_decommit, unmapped) by a
+// caller of the functions above; reservations and purges don't count
+static void note_commit(std::size_t n) {
+    std::size_t now = committed_bytes.fetch_add(n, std::memory_order_relaxed) + n;
+    std::size_t peak = peak_committed.load(std::memory_order_relaxed);
+    while (now > peak && !peak_committed.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {}
+}
+
+static void note_decommit(std::size_t n) {
+    committed_bytes.fetch_sub(n, std::memory_order_relaxed);
+}
+
+// note_commit for the chunks of arena a, which a Heap also counts; a.lock held
+static void arena_commit(HeapArena& a, std::size_t n) {
+    note_commit(n);
+    if (HeapInstance* h = a.instance) {
+        h->committed += n;
+        h->peak_committed = std::max(h->peak_committed, h->committed);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Chunk lookup: two-level radix tree indexed by address >> CHUNK_SHIFT.
+// Leaves are mapped on demand; lookups are two lock-free loads.
+// ---------------------------------------------------------------------------
+
+struct RadixLeaf {
+    std::atomic<Chunk*> slots[std::size_t(1) << RADIX_LEAF_BITS];
+};
+
+static std::atomic<RadixLeaf*> radix_root[std::size_t(1) << RADIX_ROOT_BITS];
+static std::mutex radix_lock; // serializes leaf creation
+
+static Chunk* chunk_of(const void* p) {
+    std::uintptr_t key = reinterpret_cast<std::uintptr_t>(p) >> CHUNK_SHIFT;
+    if (key >> RADIX_BITS) return nullptr;
+    RadixLeaf* leaf = radix_root[key >> RADIX_LEAF_BITS].load(std::memory_order_acquire);
+    if (!leaf) return nullptr;
+    return leaf->slots[key & ((std::uintptr_t(1) << RADIX_LEAF_BITS) - 1)].load(std::memory_order_acquire);
+}
+
+// Point every CHUNK_ALIGN granule of [base, base + size) at c (or clear it)
+static bool radix_set(const void* base, std::size_t size, Chunk* c) {
+    std::uintptr_t first = reinterpret_cast<std::uintptr_t>(base) >> CHUNK_SHIFT;
+    std::uintptr_t last = (reinterpret_cast<std::uintptr_t>(base) + size - 1) >> CHUNK_SHIFT;
+    if (last >> RADIX_BITS) return false;
+    for (std::uintptr_t key = first; key <= last; ++key) {
+        std::atomic<RadixLeaf*>& root = radix_root[key >> RADIX_LEAF_BITS];
+        RadixLeaf* leaf = root.load(std::memory_order_acquire);
+        if (!leaf) {
+            std::lock_guard<std::mutex> guard(radix_lock);
+            leaf = root.load(std::memory_order_relaxed);
+            if (!leaf) {
+                leaf = static_cast<RadixLeaf*>(os_map_aligned(sizeof(RadixLeaf), alignof(RadixLeaf)));
+                if (!leaf) return false;
+                note_commit(sizeof(RadixLeaf));
+                root.store(leaf, std::memory_order_release);
+            }
+        }
+        leaf->slots[key & ((std::uintptr_t(1) << RADIX_LEAF_BITS) - 1)].store(c, std::memory_order_release);
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Block tags and physical neighbours
+// ---------------------------------------------------------------------------
+
+static inline std::size_t tag_of(Block* b) {
+    return std::atomic_ref<std::size_t>(b->tag).load(std::memory_order_relaxed);
+}
+
+static inline void set_tag(Block* b, std::size_t tag) {
+    std::atomic_ref<std::size_t>(b->tag).store(tag, std::memory_order_relaxed);
+}
+
+static inline std::size_t block_size(Block* b) { return tag_of(b) & TAG_SIZE_MASK; }
+static inline bool is_free(Block* b) { return tag_of(b) & TAG_FREE; }
+static inline bool is_prev_free(Block* b) { return tag_of(b) & TAG_PREV_FREE; }
+static inline std::uint16_t block_owner(Block* b) {
+    return static_cast<std::uint16_t>(tag_of(b) >> OWNER_SHIFT);
+}
+
+static inline std::size_t payload_size(Block* b) { return block_size(b) - HEADER_SIZE; }
+
+static inline Block* next_block(Block* b) {
+    return reinterpret_cast<Block*>(reinterpret_cast<char*>(b) + block_size(b));
+}
+
+// Physical predecessor; only valid when b has TAG_PREV_FREE
+static inline Block* prev_block(Block* b) {
+    std::size_t prev_size = reinterpret_cast<std::size_t*>(b)[-1];
+    return reinterpret_cast<Block*>(reinterpret_cast<char*>(b) - prev_size);
+}
 
-void init_allocator(std::size_t heap_size) {
-    if (initialized) return;
-    heap_total_size = align_up(heap_size);
-    heap_base = static_cast<char*>(std::malloc(heap_total_size));
-    if (!heap_base) throw std::bad_alloc();
-    std::memset(heap_base, 0, heap_total_size);
+static inline std::size_t* footer(Block* b) {
+    return reinterpret_cast<std::size_t*>(reinterpret_cast<char*>(b) + block_size(b)) - 1;
+}
+
+static inline void set_prev_free(Block* b, bool prev_free) {
+    std::size_t tag = tag_of(b);
+    set_tag(b, prev_free ? (tag | TAG_PREV_FREE) : (tag & ~TAG_PREV_FREE));
+}
+
+static inline void set_owner(Block* b, std::uint16_t owner) {
+    std::size_t tag = tag_of(b) & ((std::size_t(1) << OWNER_SHIFT) - 1);
+    set_tag(b, tag | (std::size_t(owner) << OWNER_SHIFT));
+}
 
-    head = reinterpret_cast<Block*>(heap_base);
-    std::size_t hdr_sz = align_up(sizeof(Block));
-    std::size_t initial_payload = heap_total_size - hdr_sz;
-    head->size = initial_payload;
-    head->free = true;
-    head->next = nullptr;
-    head->prev = nullptr;
+// Write a free block's tag and footer
+static inline void mark_free(Block* b, std::size_t size, bool prev_free, bool zero = false) {
+    set_tag(b, size | TAG_FREE | (prev_free ? TAG_PREV_FREE : 0) | (zero ? TAG_ZERO : 0));
+    *footer(b) = size;
+}
 
-    initialized = true;
+// Write an allocated block's tag (no owner)
+static inline void mark_used(Block* b, std::size_t size, bool prev_free) {
+    set_tag(b, size | (prev_free ? TAG_PREV_FREE : 0));
 }
 
 static inline Block* payload_to_block(void* payload) {
     if (!payload) return nullptr;
-    return reinterpret_cast<Block*>(
-        reinterpret_cast<char*>(payload) - align_up(sizeof(Block))
-    );
+    return reinterpret_cast<Block*>(static_cast<char*>(payload) - HEADER_SIZE);
 }
 
 static inline void* block_to_payload(Block* b) {
     if (!b) return nullptr;
-    return reinterpret_cast<void*>(reinterpret_cast<char*>(b) + align_up(sizeof(Block)));
+    return reinterpret_cast<char*>(b) + HEADER_SIZE;
 }
 
-static inline bool pointer_in_heap(void* p) {
-    if (!p || !initialized) return false;
-    auto pc = reinterpret_cast<char*>(p);
-    return pc >= heap_base && pc < (heap_base + static_cast<std::ptrdiff_t>(heap_total_size));
+static inline FreeLinks* links(Block* b) {
+    return reinterpret_cast<FreeLinks*>(block_to_payload(b));
 }
 
-static Block* find_fit(std::size_t asize) {
-    for (Block* b = head; b; b = b->next) {
-        if (b->free && b->size >= asize) return b;
-    }
-    return nullptr;
+static inline SpanInfo* span_info(Block* b) {
+    return reinterpret_cast<SpanInfo*>(links(b) + 1);
 }
 
-static void split_block(Block* b, std::size_t asize) {
-    std::size_t hdr_sz = align_up(sizeof(Block));
-    if (!b->free) return;
+static inline TreeLinks* tree_links(Block* b) {
+    return reinterpret_cast<TreeLinks*>(span_info(b) + 1);
+}
+
+static inline SubLinks* sub_links(Block* b) {
+    return reinterpret_cast<SubLinks*>(span_info(b) + 1);
+}
+
+// Block size needed for a payload of n bytes, 0 on overflow
+static inline std::size_t block_size_for(std::size_t n) {
+    if (n > std::numeric_limits<std::size_t>::max() - HEADER_SIZE - ALIGNMENT) return 0;
+    return std::max(align_up(n + HEADER_SIZE), MIN_BLOCK_SIZE);
+}
+
+static inline Block* chunk_sentinel(Chunk* c) {
+    return reinterpret_cast<Block*>(c->committed.load(std::memory_order_relaxed) - HEADER_SIZE);
+}
+
+// Map a block size to its size class
+static inline std::size_t size_class(std::size_t size) {
+    if (size <= SMALL_CLASS_MAX) return size / ALIGNMENT - 1;
+    std::size_t log2 = std::bit_width(size) - 1;
+    return NUM_SMALL_CLASSES + (log2 - SMALL_CLASS_SHIFT);
+}
+
+static inline std::uint64_t now_ms() {
+    using namespace std::chrono;
+    return static_cast<std::uint64_t>(
+        duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+// ---------------------------------------------------------------------------
+// Large block treap
+//
+// Keyed by (size, address), so the leftmost block of at least a size is the
+// address-ordered best fit. Priorities are a hash of the address, so the
+// tree needs no field for them and its shape doesn't depend on the order
+// blocks come and go. Expected O(log n) per operation, all iterative. An
+// arena keeps it only while the placement policy is best fit.
+// ---------------------------------------------------------------------------
 
-    if (b->size >= asize + hdr_sz + MIN_BLOCK_SIZE) {
-        char* block_addr = reinterpret_cast<char*>(b);
-        std::size_t remaining_payload = b->size - asize - hdr_sz;
+static inline bool tree_before(Block* x, Block* y) {
+    std::size_t sx = block_size(x), sy = block_size(y);
+    return sx < sy || (sx == sy && x < y);
+}
+
+static inline std::uint64_t tree_priority(Block* b) {
+    return reinterpret_cast<std::uintptr_t>(b) * 0x9E3779B97F4A7C15ull;
+}
 
-        Block* newb = reinterpret_cast<Block*>(block_addr + hdr_sz + asize);
-        newb->size = remaining_payload;
-        newb->free = true;
-        newb->prev = b;
-        newb->next = b->next;
-        if (b->next) b->next->prev = newb;
-        b->next = newb;
-        b->size = asize;
+// Split the treap t into the blocks before b (*l) and the rest (*r)
+static void tree_split(Block* t, Block* b, Block** l, Block** r) {
+    while (t) {
+        if (tree_before(t, b)) {
+            *l = t;
+            l = &tree_links(t)->right;
+            t = *l;
+        } else {
+            *r = t;
+            r = &tree_links(t)->left;
+            t = *r;
+        }
     }
-    b->free = false;
+    *l = *r = nullptr;
 }
 
-static Block* coalesce(Block* b) {
-    std::size_t hdr_sz = align_up(sizeof(Block));
-    if (b->next && b->next->free) {
-        Block* nxt = b->next;
-        b->size += hdr_sz + nxt->size;
-        b->next = nxt->next;
-        if (nxt->next) nxt->next->prev = b;
+static void tree_insert(HeapArena& a, Block* b) {
+    Block** at = &a.large_tree;
+    std::uint64_t priority = tree_priority(b);
+    while (*at && tree_priority(*at) > priority) {
+        at = tree_before(b, *at) ? &tree_links(*at)->left : &tree_links(*at)->right;
     }
-    if (b->prev && b->prev->free) {
-        Block* pv = b->prev;
-        pv->size += hdr_sz + b->size;
-        pv->next = b->next;
-        if (b->next) b->next->prev = pv;
-        b = pv;
+    TreeLinks* t = tree_links(b);
+    tree_split(*at, b, &t->left, &t->right);
+    *at = b;
+}
+
+// b must still have the size it was inserted with
+static void tree_remove(HeapArena& a, Block* b) {
+    Block** at = &a.large_tree;
+    while (*at != b) at = tree_before(b, *at) ? &tree_links(*at)->left : &tree_links(*at)->right;
+    // merge the subtrees in their place
+    Block* l = tree_links(b)->left;
+    Block* r = tree_links(b)->right;
+    while (l && r) {
+        if (tree_priority(l) > tree_priority(r)) {
+            *at = l;
+            at = &tree_links(l)->right;
+            l = *at;
+        } else {
+            *at = r;
+            at = &tree_links(r)->left;
+            r = *at;
+        }
     }
-    return b;
+    *at = l ? l : r;
 }
 
-void* malloc(std::size_t size) {
-    if (size == 0) return nullptr;
-    if (!initialized) init_allocator(DEFAULT_HEAP_SIZE);
+// Smallest large free block of at least asize bytes, lowest address first
+static Block* tree_best_fit(const HeapArena& a, std::size_t asize) {
+    Block* best = nullptr;
+    for (Block* t = a.large_tree; t;) {
+        if (block_size(t) >= asize) {
+            best = t;
+            t = tree_links(t)->left;
+        } else {
+            t = tree_links(t)->right;
+        }
+    }
+    return best;
+}
 
-    std::size_t asize = align_up(size);
-    if (asize < MIN_BLOCK_SIZE) asize = MIN_BLOCK_SIZE;
+// ---------------------------------------------------------------------------
+// Good fit: Two-Level Segregated Fit
+//
+// The power-of-two classes are the first level (their bit in class_bitmap)
+// and each is split into TLSF_SUBCLASSES lists of equal width, with a
+// bitmap of the non-empty ones. A request is rounded up to the next list
+// boundary, so the head of the first non-empty list at or above it always
+// fits: malloc is two find-first-set steps over class_bitmap (two words),
+// one over a sub_bitmap and a constant number of list updates, and free
+// adds only O(1) coalescing; no loop depends on how many blocks the heap
+// holds. The price is up to 1/16 of a block left unused when the rounding
+// passes over an exact fit, which the head of the request's own list gets
+// one look for.
+// ---------------------------------------------------------------------------
 
-    Block* b = find_fit(asize);
-    if (!b) return nullptr;
+// Second-level list of a size in large class cls
+static inline std::size_t tlsf_sub(std::size_t size, std::size_t cls) {
+    std::size_t log2 = cls - NUM_SMALL_CLASSES + SMALL_CLASS_SHIFT;
+    return (size >> (log2 - TLSF_SUB_SHIFT)) & (TLSF_SUBCLASSES - 1);
+}
 
-    split_block(b, asize);
-    return block_to_payload(b);
+static void sub_insert(HeapArena& a, Block* b, std::size_t cls) {
+    std::size_t sub = tlsf_sub(block_size(b), cls);
+    Block*& head = a.sub_lists[cls - NUM_SMALL_CLASSES][sub];
+    SubLinks* l = sub_links(b);
+    l->prev = nullptr;
+    l->next = head;
+    if (head) sub_links(head)->prev = b;
+    head = b;
+    a.sub_bitmap[cls - NUM_SMALL_CLASSES] |= static_cast<std::uint16_t>(1u << sub);
 }
 
-void free(void* ptr) {
-    // 1) free(nullptr) must be safe
-    if (!ptr) return;
+static void sub_remove(HeapArena& a, Block* b, std::size_t cls) {
+    std::size_t sub = tlsf_sub(block_size(b), cls);
+    Block*& head = a.sub_lists[cls - NUM_SMALL_CLASSES][sub];
+    SubLinks* l = sub_links(b);
+    if (l->prev) sub_links(l->prev)->next = l->next;
+    else head = l->next;
+    if (l->next) sub_links(l->next)->prev = l->prev;
+    if (!head) a.sub_bitmap[cls - NUM_SMALL_CLASSES] &= static_cast<std::uint16_t>(~(1u << sub));
+}
 
-    // 2) check if pointer is inside our managed heap
-    if (ptr < heap_base || ptr >= (heap_base + heap_total_size)) {
-        std::fprintf(stderr, "[mini_alloc] free: pointer %p not from heap\n", ptr);
-        return;
+// Start keeping the index policy needs from the class lists, dropping the
+// other one; a.lock held
+static void index_rebuild(HeapArena& a, LargeIndex index) {
+    a.large_index = index;
+    a.large_tree = nullptr;
+    std::memset(a.sub_lists, 0, sizeof(a.sub_lists));
+    std::memset(a.sub_bitmap, 0, sizeof(a.sub_bitmap));
+    if (index == LargeIndex::None) return;
+    for (std::size_t cls = NUM_SMALL_CLASSES; cls < NUM_CLASSES; ++cls) {
+        for (Block* b = a.free_lists[cls]; b; b = links(b)->next) {
+            if (index == LargeIndex::Tree) tree_insert(a, b);
+            else sub_insert(a, b, cls);
+        }
     }
+}
 
-    // 3) payload -> block header
-    Block* b = payload_to_block(ptr);
+static void free_list_insert(HeapArena& a, Block* b) {
+    std::size_t size = block_size(b);
+    std::size_t cls = size_class(size);
+    FreeLinks* l = links(b);
+    if (size >= PURGE_MIN_SIZE) {
+        span_info(b)->freed_at = now_ms();
+        span_info(b)->purged = false;
+    }
+    l->prev = nullptr;
+    l->next = a.free_lists[cls];
+    if (l->next) links(l->next)->prev = b;
+    a.free_lists[cls] = b;
+    a.class_bitmap[cls / 64] |= std::uint64_t(1) << (cls % 64);
+    a.free_bytes += size;
+    if (cls >= NUM_SMALL_CLASSES) {
+        if (a.large_index == LargeIndex::Tree) tree_insert(a, b);
+        else if (a.large_index == LargeIndex::Tlsf) sub_insert(a, b, cls);
+    }
+}
 
-    // 4) sanity check: header must lie inside heap
-    if ((char*)b < heap_base || (char*)b >= (heap_base + heap_total_size)) {
-        std::fprintf(stderr, "[mini_alloc] free: invalid block header for %p\n", ptr);
-        return;
+static void free_list_remove(HeapArena& a, Block* b) {
+    std::size_t size = block_size(b);
+    std::size_t cls = size_class(size);
+    FreeLinks* l = links(b);
+    if (l->prev) links(l->prev)->next = l->next;
+    else a.free_lists[cls] = l->next;
+    if (l->next) links(l->next)->prev = l->prev;
+    if (!a.free_lists[cls]) a.class_bitmap[cls / 64] &= ~(std::uint64_t(1) << (cls % 64));
+    a.free_bytes -= size;
+    if (cls >= NUM_SMALL_CLASSES) {
+        if (a.large_index == LargeIndex::Tree) tree_remove(a, b);
+        else if (a.large_index == LargeIndex::Tlsf) sub_remove(a, b, cls);
+        if (a.rovers[cls] == b) a.rovers[cls] = l->next;
     }
+}
 
-    // 5) detect double free
-    if (b->free) {
-        std::fprintf(stderr, "[mini_alloc] warning: double free of %p\n", ptr);
-        return;
+// First non-empty class >= cls, or NUM_CLASSES if there is none
+static std::size_t next_nonempty_class(const HeapArena& a, std::size_t cls) {
+    std::size_t word = cls / 64;
+    std::uint64_t bits = a.class_bitmap[word] & (~std::uint64_t(0) << (cls % 64));
+    while (true) {
+        if (bits) return word * 64 + std::countr_zero(bits);
+        if (++word == CLASS_BITMAP_WORDS) return NUM_CLASSES;
+        bits = a.class_bitmap[word];
+    }
+}
+
+// Good fit for a request above SMALL_CLASS_MAX (see "Good fit" above)
+static Block* tlsf_fit(HeapArena& a, std::size_t asize) {
+    std::size_t cls = size_class(asize);
+    std::size_t sub = tlsf_sub(asize, cls);
+    std::size_t large = cls - NUM_SMALL_CLASSES;
+    // an exact fit at the head of the request's own list
+    Block* b = a.sub_lists[large][sub];
+    if (b && block_size(b) >= asize) return b;
+    // every list above it holds only blocks that fit
+    std::uint32_t above = a.sub_bitmap[large] & (~std::uint32_t(0) << (sub + 1));
+    if (!above) {
+        cls = next_nonempty_class(a, cls + 1);
+        if (cls >= NUM_CLASSES) return nullptr;
+        large = cls - NUM_SMALL_CLASSES;
+        above = a.sub_bitmap[large];
     }
+    return a.sub_lists[large][std::countr_zero(above)];
+}
 
-    // 6) mark free and coalesce
-    b->free = true;
-    coalesce(b);
+// Next fit within class cls: the first block of at least asize bytes from
+// where the last search of the class stopped, wrapping around once
+static Block* next_fit(HeapArena& a, std::size_t cls, std::size_t asize) {
+    Block* start = a.rovers[cls] ? a.rovers[cls] : a.free_lists[cls];
+    Block* b = start;
+    while (b && block_size(b) < asize) {
+        b = links(b)->next;
+        if (!b) b = a.free_lists[cls];
+        if (b == start) b = nullptr;
+    }
+    if (b) a.rovers[cls] = links(b)->next;
+    return b;
 }
 
+// First fit within class cls: the lowest-addressed block of at least asize
+// bytes. The lists are LIFO, so this scans the whole class.
+static Block* first_fit(const HeapArena& a, std::size_t cls, std::size_t asize) {
+    Block* fit = nullptr;
+    for (Block* b = a.free_lists[cls]; b; b = links(b)->next) {
+        if (block_size(b) >= asize && (!fit || b < fit)) fit = b;
+    }
+    return fit;
+}
 
-void* realloc(void* ptr, std::size_t new_size) {
-    if (!ptr) return malloc(new_size);
-    if (new_size == 0) {
-        free(ptr);
+// Free block of at least asize bytes by the placement policy. Small classes
+// are exact, so the policies differ only where a block comes from the
+// power-of-two classes, which may hold blocks smaller than the class.
+static Block* find_fit(HeapArena& a, std::size_t asize) {
+    std::size_t cls = size_class(asize);
+    Placement policy = a.instance ? a.instance->placement : placement.load(std::memory_order_relaxed);
+    LargeIndex index = policy == Placement::BestFit  ? LargeIndex::Tree
+                       : policy == Placement::GoodFit ? LargeIndex::Tlsf
+                                                      : LargeIndex::None;
+    if (index != a.large_index) index_rebuild(a, index);
+    if (cls >= NUM_SMALL_CLASSES) {
+        if (policy == Placement::BestFit) return tree_best_fit(a, asize);
+        if (policy == Placement::GoodFit) return tlsf_fit(a, asize);
+        Block* b = policy == Placement::NextFit ? next_fit(a, cls, asize) : first_fit(a, cls, asize);
+        if (b) return b;
+        ++cls;
+    }
+    // every block in a higher class is large enough
+    cls = next_nonempty_class(a, cls);
+    if (cls >= NUM_CLASSES) return nullptr;
+    if (cls >= NUM_SMALL_CLASSES) {
+        switch (policy) {
+        case Placement::BestFit:
+            return tree_best_fit(a, asize);
+        case Placement::FirstFit:
+            return first_fit(a, cls, asize);
+        case Placement::NextFit:
+            return next_fit(a, cls, asize);
+        case Placement::GoodFit:
+            break;
+        }
+    }
+    return a.free_lists[cls];
+}
+
+// Map the live bitmap of chunk c when running hardened
+static bool map_live_bits(Chunk* c) {
+    if (!hardened) return true;
+    std::size_t bytes = align_up(c->size / ALIGNMENT / 8, os_page_size());
+    void* bits = os_map_aligned(bytes, os_page_size());
+    if (!bits) return false;
+    arena_commit(*c->arena, bytes);
+    c->live = static_cast<std::atomic<std::uint64_t>*>(bits);
+    return true;
+}
+
+// Undo map_live_bits for a chunk that failed to register
+static void unmap_live_bits(Chunk* c) {
+    if (!c->live) return;
+    std::size_t bytes = align_up(c->size / ALIGNMENT / 8, os_page_size());
+    os_unmap(c->live, bytes);
+    c->live = nullptr;
+    note_decommit(bytes);
+    if (HeapInstance* h = c->arena->instance) h->committed -= bytes;
+}
+
+// Steps in which a chunk is committed, and purged: huge pages are never split
+static inline std::size_t commit_granule(const Chunk* c) {
+    return c->pages == HugePages::Off ? COMMIT_GRANULE : HUGE_PAGE_SIZE;
+}
+
+static inline std::size_t purge_granule(const Chunk* c) {
+    return c->pages == HugePages::Off ? os_page_size() : HUGE_PAGE_SIZE;
+}
+
+// Reserve size bytes aligned to align (both multiples of HUGE_PAGE_SIZE
+// unless pages is Off) with the backing pages asks for; explicit huge pages
+// fall back to transparent ones when there are not enough of them
+static void* map_chunk(std::size_t size, std::size_t align, HugePages& pages, bool commit) {
+    if (pages == HugePages::Explicit) {
+        if (void* mem = os_map_huge(size, align, commit)) return mem;
+        pages = HugePages::Transparent;
+    }
+    void* mem = os_map_aligned(size, align, commit);
+    if (mem && pages == HugePages::Transparent) os_advise_huge(mem, size);
+    return mem;
+}
+
+// Map a new chunk able to hold a block of at least asize bytes and add its
+// single free block to the arena; a.lock held
+static Chunk* arena_add_chunk(HeapArena& a, std::size_t asize) {
+    HugePages pages = huge_pages.load(std::memory_order_relaxed);
+    std::size_t align = pages == HugePages::Off ? CHUNK_ALIGN : HUGE_PAGE_SIZE;
+    std::size_t granule = pages == HugePages::Off ? COMMIT_GRANULE : HUGE_PAGE_SIZE;
+    // chunk header, padding so payloads are aligned, and the sentinel
+    std::size_t overhead = align_up(sizeof(Chunk)) + 2 * HEADER_SIZE;
+    if (asize > std::numeric_limits<std::size_t>::max() - overhead - align) return nullptr;
+    std::size_t min_size = a.instance ? a.instance->chunk_size : arena_heap_size;
+    std::size_t size = align_up(std::max(min_size, asize + overhead), align);
+    // real-time mode commits and faults in everything up front
+    bool prefault = realtime.load(std::memory_order_relaxed);
+    std::size_t commit = prefault ? size : std::min(align_up(asize + overhead, granule), size);
+
+    // reserve the whole chunk but commit only what the first block needs
+    void* mem = map_chunk(size, align, pages, false);
+    if (!mem) return nullptr;
+    os_bind_node(mem, size, a.node);
+    if (!os_commit(mem, commit)) {
+        os_unmap(mem, size);
         return nullptr;
     }
-    if (!pointer_in_heap(ptr)) {
-        std::fprintf(stderr, "[mini_alloc] realloc: pointer %p not from heap\n", ptr);
+    if (prefault) os_prefault(mem, commit);
+    char* base = static_cast<char*>(mem);
+    Block* b = reinterpret_cast<Block*>(base + align_up(sizeof(Chunk)) + HEADER_SIZE);
+    Chunk* c = new (mem) Chunk{&a, a.chunks, size, b, {base + commit}, reinterpret_cast<char*>(b)};
+    c->pages = pages;
+
+    // committed pages are already zeroed, so only the tags need writing
+    mark_free(b, static_cast<std::size_t>(reinterpret_cast<char*>(chunk_sentinel(c)) - reinterpret_cast<char*>(b)), false);
+    set_tag(chunk_sentinel(c), TAG_PREV_FREE);
+
+    if (!map_live_bits(c) || !radix_set(mem, size, c)) {
+        unmap_live_bits(c);
+        radix_set(mem, size, nullptr);
+        os_unmap(mem, size);
         return nullptr;
     }
-    Block* b = payload_to_block(ptr);
-    std::size_t asize = align_up(new_size);
-    if (asize < MIN_BLOCK_SIZE) asize = MIN_BLOCK_SIZE;
-
-    if (b->size >= asize) {
-        split_block(b, asize);
-        return ptr;
-    } else if (b->next && b->next->free) {
-        std::size_t hdr_sz = align_up(sizeof(Block));
-        std::size_t combined = b->size + hdr_sz + b->next->size;
-        if (combined >= asize) {
-            Block* nxt = b->next;
-            b->size = combined;
-            b->next = nxt->next;
-            if (nxt->next) nxt->next->prev = b;
-            split_block(b, asize);
-            b->free = false;
-            return ptr;
+    arena_commit(a, commit);
+    a.chunks = c;
+    free_list_insert(a, b);
+    return c;
+}
+
+// Advance the frontier of chunk c so its last free block holds at least
+// asize bytes; returns that block or nullptr if the reservation is used up.
+// a.lock held.
+static Block* chunk_extend(HeapArena& a, Chunk* c, std::size_t asize) {
+    Block* sentinel = chunk_sentinel(c);
+    Block* last = is_prev_free(sentinel) ? prev_block(sentinel) : nullptr;
+    std::size_t have = last ? block_size(last) : 0;
+
+    char* old_end = c->committed.load(std::memory_order_relaxed);
+    char* limit = reinterpret_cast<char*>(c) + c->size;
+    std::size_t need = asize > have ? asize - have : 0;
+    if (need > static_cast<std::size_t>(limit - old_end)) return nullptr;
+    char* new_end = old_end + std::min(align_up(need, commit_granule(c)),
+                                       static_cast<std::size_t>(limit - old_end));
+    if (!os_commit(old_end, static_cast<std::size_t>(new_end - old_end))) return nullptr;
+    arena_commit(a, static_cast<std::size_t>(new_end - old_end));
+
+    // the old sentinel either grows the last free block or becomes the
+    // header of a new one; clear stale metadata so fresh memory stays zero
+    Block* b;
+    bool prev_free;
+    if (last) {
+        free_list_remove(a, last);
+        *footer(last) = 0;
+        set_tag(sentinel, 0);
+        b = last;
+        prev_free = is_prev_free(last);
+    } else {
+        b = sentinel;
+        prev_free = false;
+    }
+    c->committed.store(new_end, std::memory_order_relaxed);
+    std::size_t size = static_cast<std::size_t>(reinterpret_cast<char*>(chunk_sentinel(c)) -
+                                                reinterpret_cast<char*>(b));
+    mark_free(b, size, prev_free);
+    set_tag(chunk_sentinel(c), TAG_PREV_FREE);
+    free_list_insert(a, b);
+    return b;
+}
+
+// Map an arena's first chunk on first use; a.lock held
+static bool arena_setup(HeapArena& a) {
+    if (a.ready.load(std::memory_order_relaxed)) return true;
+    if (!arena_add_chunk(a, 0)) return false;
+    a.ready.store(true, std::memory_order_release);
+    return true;
+}
+
+static void profile_from_env();
+
+void init_allocator(std::size_t heap_size, std::size_t arenas_wanted) {
+    std::lock_guard<std::mutex> guard(init_lock);
+    if (initialized.load(std::memory_order_relaxed)) return;
+    arena_heap_size = align_up(heap_size);
+    arena_count = std::clamp<std::size_t>(arenas_wanted, 1, MAX_ARENAS);
+    auto seed = reinterpret_cast<std::uintptr_t>(&guard) ^ static_cast<std::uintptr_t>(now_ms());
+    tcache_key = reinterpret_cast<Block*>((seed * 0x9E3779B97F4A7C15ull) | 1);
+    canary_secret = std::rotl(seed * 0xBF58476D1CE4E5B9ull, 31);
+    hardened = hardened_requested;
+    if (const char* env = std::getenv("MINI_ALLOC_HARDENED")) hardened = env[0] && env[0] != '0';
+    if (const char* env = std::getenv("MINI_ALLOC_QUARANTINE")) set_quarantine_size(std::strtoull(env, nullptr, 10));
+    if (const char* env = std::getenv("MINI_ALLOC_HUGE_PAGES")) {
+        if (!std::strcmp(env, "thp")) set_huge_pages(HugePages::Transparent);
+        else if (!std::strcmp(env, "explicit")) set_huge_pages(HugePages::Explicit);
+        else if (!std::strcmp(env, "off")) set_huge_pages(HugePages::Off);
+    }
+    if (const char* env = std::getenv("MINI_ALLOC_PLACEMENT")) {
+        if (!std::strcmp(env, "first")) set_placement(Placement::FirstFit);
+        else if (!std::strcmp(env, "next")) set_placement(Placement::NextFit);
+        else if (!std::strcmp(env, "best")) set_placement(Placement::BestFit);
+        else if (!std::strcmp(env, "good")) set_placement(Placement::GoodFit);
+    }
+    if (const char* env = std::getenv("MINI_ALLOC_REALTIME")) {
+        if (env[0] && env[0] != '0') set_realtime(true);
+    }
+
+    // on a NUMA machine every node gets an equal share of the arenas (at
+    // least one), whose chunks are bound to it; MINI_ALLOC_NUMA=0 opts out
+    const char* numa_env = std::getenv("MINI_ALLOC_NUMA");
+    std::size_t nodes = numa_env && numa_env[0] == '0' ? 1 : os_numa_nodes();
+    std::size_t per_node = (arena_count + nodes - 1) / nodes;
+    if (nodes > 1 && nodes * per_node <= MAX_ARENAS) {
+        numa_nodes = nodes;
+        numa_per_node = per_node;
+        arena_count = nodes * per_node;
+        for (std::size_t i = 0; i < arena_count; ++i) arenas[i].node = static_cast<int>(i / per_node);
+    }
+
+    // the first arena is set up eagerly, the others when a thread lands on them
+    {
+        std::lock_guard<std::mutex> arena_guard(arenas[0].lock);
+        if (!arena_setup(arenas[0])) throw std::bad_alloc();
+    }
+    initialized.store(true, std::memory_order_release);
+
+    // tracing for programs that can't call trace_start (LD_PRELOAD)
+    if (const char* path = std::getenv("MINI_ALLOC_TRACE")) {
+        if (trace_start(path)) std::atexit([] { trace_stop(); });
+    }
+    profile_from_env();
+}
+
+static inline std::size_t arena_index(const HeapArena& a) {
+    return static_cast<std::size_t>(&a - arenas);
+}
+
+// Threads are spread round-robin over the arenas, or over those of the node
+// they first allocate on in NUMA mode
+static HeapArena& home_arena() {
+    std::size_t i = thread_arena;
+    if (i == MAX_ARENAS) {
+        std::size_t k = next_arena.fetch_add(1, std::memory_order_relaxed);
+        if (numa_nodes > 1) {
+            std::size_t node = static_cast<std::size_t>(os_current_node()) % numa_nodes;
+            i = node * numa_per_node + k % numa_per_node;
+        } else {
+            i = k % arena_count;
         }
+        thread_arena = i;
     }
+    return arenas[i];
+}
 
-    void* newp = malloc(new_size);
-    if (!newp) return nullptr;
-    std::memcpy(newp, ptr, std::min(b->size, asize));
-    free(ptr);
-    return newp;
+// Node the calling thread's memory comes from, -1 outside NUMA mode
+static inline int home_node() { return numa_nodes > 1 ? home_arena().node : -1; }
+
+// Whether memory of arena a is local to the calling thread
+static inline bool node_local(const HeapArena& a) { return numa_nodes == 1 || a.node == home_node(); }
+
+// Arena owning p, or nullptr if p is not from our heap
+static HeapArena* arena_of(const void* p) {
+    Chunk* c = chunk_of(p);
+    return c ? c->arena : nullptr;
 }
 
-void* calloc(std::size_t nmemb, std::size_t size) {
-    if (nmemb == 0 || size == 0) return nullptr;
-    if (nmemb > std::numeric_limits<std::size_t>::max() / size) return nullptr;
-    std::size_t total = nmemb * size;
-    void* p = malloc(total);
-    if (p) std::memset(p, 0, total);
-    return p;
+// Carve asize bytes off the front of free block b, returning the rest to
+// the free lists if it can form a block of its own
+static void split_block(HeapArena& a, Block* b, std::size_t asize) {
+    if (!is_free(b)) return;
+    free_list_remove(a, b);
+
+    std::size_t size = block_size(b);
+    bool prev_free = is_prev_free(b);
+    if (size >= asize + MIN_BLOCK_SIZE) {
+        Block* newb = reinterpret_cast<Block*>(reinterpret_cast<char*>(b) + asize);
+        mark_free(newb, size - asize, false, tag_of(b) & TAG_ZERO);
+        free_list_insert(a, newb);
+        size = asize;
+    } else {
+        set_prev_free(next_block(b), false);
+    }
+    mark_used(b, size, prev_free);
 }
 
-void dump_heap() {
-    if (!initialized) {
-        std::puts("[mini_alloc] heap not initialized");
-        return;
+// Merge free block b (not yet in the lists) with free physical neighbours,
+// found through its own size and the predecessor's footer
+static Block* coalesce(HeapArena& a, Block* b) {
+    std::size_t size = block_size(b);
+    Block* nxt = next_block(b);
+    if (is_free(nxt)) {
+        free_list_remove(a, nxt);
+        size += block_size(nxt);
+    }
+    if (is_prev_free(b)) {
+        Block* pv = prev_block(b);
+        free_list_remove(a, pv);
+        size += block_size(pv);
+        b = pv;
+    }
+    mark_free(b, size, is_prev_free(b));
+    set_prev_free(next_block(b), true);
+    free_list_insert(a, b);
+    return b;
+}
+
+// Return the page-aligned interior of a large free block to the OS, keeping
+// its header, links, span info, tree links and footer; a.lock held. If the
+// pages come back zero, the bytes around them are cleared as well and the
+// block is marked TAG_ZERO (not on huge pages, where they could be
+// megabytes).
+static void purge_block(Block* b) {
+    std::size_t page = purge_granule(chunk_of(b));
+    auto meta_end = reinterpret_cast<std::uintptr_t>(tree_links(b) + 1);
+    auto end = reinterpret_cast<std::uintptr_t>(footer(b));
+    std::uintptr_t first = align_up(meta_end, page);
+    std::uintptr_t last = end & ~(page - 1);
+    if (last > first && os_purge(reinterpret_cast<void*>(first), last - first) && page == os_page_size()) {
+        std::memset(reinterpret_cast<void*>(meta_end), 0, first - meta_end);
+        std::memset(reinterpret_cast<void*>(last), 0, end - last);
+        set_tag(b, tag_of(b) | TAG_ZERO);
     }
-    std::printf("mini_alloc: heap_base=%p total=%zu bytes\n", (void*)heap_base, heap_total_size);
-    std::size_t idx = 0;
-    for (Block* b = head; b; b = b->next, ++idx) {
-        std::printf(" block[%zu] hdr=%p payload=%p size=%zu free=%s prev=%p next=%p\n",
-                    idx,
-                    (void*)b,
-                    block_to_payload(b),
-                    b->size,
-                    b->free ? "YES" : "NO",
-                    (void*)(b->prev),
-                    (void*)(b->next));
+    span_info(b)->purged = true;
+}
+
+// Return the pages of an unused slab run to the OS; a.lock held
+static void purge_run(SlabChunk* sc, std::size_t i) {
+    std::size_t page = os_page_size();
+    Slab& s = sc->slabs[i];
+    auto first = align_up(reinterpret_cast<std::uintptr_t>(sc) + (i ? i * SLAB_RUN_SIZE : sizeof(SlabChunk)), page);
+    auto last = reinterpret_cast<std::uintptr_t>(sc) + (i + 1) * SLAB_RUN_SIZE;
+    if (last > first) os_purge(reinterpret_cast<void*>(first), last - first);
+    s.purged = true;
+}
+
+// Purge every large free block and unused slab run that has been free for
+// at least decay_ms; a.lock held
+static void arena_purge(HeapArena& a, std::uint64_t now, std::uint64_t decay_ms) {
+    for (std::size_t cls = size_class(PURGE_MIN_SIZE); cls < NUM_CLASSES; ++cls) {
+        for (Block* b = a.free_lists[cls]; b; b = links(b)->next) {
+            if (block_size(b) < PURGE_MIN_SIZE) continue;
+            SpanInfo* info = span_info(b);
+            if (!info->purged && now - info->freed_at >= decay_ms) purge_block(b);
+        }
     }
+    for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+        for (std::uint64_t runs = sc->free_runs & sc->committed_runs; runs; runs &= runs - 1) {
+            std::size_t i = std::countr_zero(runs);
+            Slab& s = sc->slabs[i];
+            if (!s.purged && now - s.freed_at >= decay_ms) purge_run(sc, i);
+        }
+    }
+}
+
+// Threshold trigger: after a large free or a slab going unused, run a purge
+// pass at most once per half decay period; a.lock held
+static void arena_maybe_purge(HeapArena& a) {
+    long decay = purge_decay_ms.load(std::memory_order_relaxed);
+    if (decay < 0 || realtime.load(std::memory_order_relaxed)) return;
+    std::uint64_t now = now_ms();
+    if (now < a.next_purge_ms) return;
+    arena_purge(a, now, static_cast<std::uint64_t>(decay));
+    a.next_purge_ms = now + static_cast<std::uint64_t>(decay) / 2;
+}
+
+// Hand an allocated (or cached) block back to the free lists; a.lock held
+static void release_block(HeapArena& a, Block* b) {
+    set_tag(b, block_size(b) | TAG_FREE | (tag_of(b) & TAG_PREV_FREE));
+    Block* merged = coalesce(a, b);
+    if (block_size(merged) >= PURGE_MIN_SIZE) arena_maybe_purge(a);
+}
+
+// Give the tail of allocated block b beyond asize back to the free lists,
+// merged with a free right neighbour, if it can form a block of its own;
+// a.lock held
+static void shrink_block(HeapArena& a, Block* b, std::size_t asize) {
+    std::size_t size = block_size(b);
+    if (size < asize + MIN_BLOCK_SIZE) return;
+    set_tag(b, (tag_of(b) & ~TAG_SIZE_MASK) | asize);
+    Block* rest = next_block(b);
+    set_tag(rest, size - asize);
+    release_block(a, rest);
+}
+
+// Resize allocated block b of chunk c in place to asize bytes: shrink it,
+// or grow it into a free right neighbour (extending the chunk frontier if
+// that is where it ends), then into a free left neighbour, moving the
+// payload down. Returns the block, or nullptr if it can't grow; a.lock held.
+static Block* resize_block(HeapArena& a, Chunk* c, Block* b, std::size_t asize) {
+    std::size_t size = block_size(b);
+    if (size >= asize) {
+        shrink_block(a, b, asize);
+        return b;
+    }
+
+    Block* nxt = next_block(b);
+    std::size_t right = is_free(nxt) ? block_size(nxt) : 0;
+    if (size + right < asize) {
+        // b, or its free right neighbour, is the last block before the
+        // sentinel: commit more of the chunk behind it
+        Block* last = right ? next_block(nxt) : nxt;
+        if (last == chunk_sentinel(c) && chunk_extend(a, c, asize - size)) {
+            nxt = next_block(b);
+            right = block_size(nxt);
+        }
+    }
+    std::size_t left = is_prev_free(b) ? block_size(prev_block(b)) : 0;
+    if (size + right + left < asize) return nullptr;
+
+    std::size_t payload = payload_size(b);
+    std::size_t tag = tag_of(b) & ~TAG_SIZE_MASK;
+    if (right) {
+        free_list_remove(a, nxt);
+        size += right;
+    }
+    if (size < asize) {
+        Block* pv = prev_block(b);
+        free_list_remove(a, pv);
+        size += left;
+        tag = (tag & ~TAG_PREV_FREE) | (tag_of(pv) & TAG_PREV_FREE);
+        std::memmove(block_to_payload(pv), block_to_payload(b), payload);
+        b = pv;
+    }
+    set_tag(b, tag | size);
+    set_prev_free(next_block(b), false);
+    shrink_block(a, b, asize);
+    c->touched = std::max(c->touched, reinterpret_cast<char*>(next_block(b)));
+    return b;
+}
+
+// Return a chain of blocks (linked through FreeLinks::next) to their arenas,
+// taking each arena lock once per run of blocks from the same arena
+static void release_chain(Block* list) {
+    HeapArena* locked = nullptr;
+    while (list) {
+        Block* next = links(list)->next;
+        HeapArena* a = arena_of(list);
+        if (a != locked) {
+            if (locked) locked->lock.unlock();
+            a->lock.lock();
+            locked = a;
+        }
+        release_block(*a, list);
+        list = next;
+    }
+    if (locked) locked->lock.unlock();
+}
+
+// Parts of a freshly carved payload that may hold stale bytes
+struct DirtyRange {
+    std::size_t prefix; // leading bytes
+    std::size_t tail;   // trailing bytes (an old footer)
+};
+
+// Past c->touched only free-block metadata was ever written: the header,
+// links, span info and tree links of the block just above the mark, those
+// of b, and the footer of the free block b was carved from if b took all of
+// it. A block carved from a TAG_ZERO span (zero) has only its own metadata
+// and that footer to clear, wherever it lies.
+static DirtyRange dirty_range(Chunk* c, Block* b, bool took_whole, bool zero) {
+    constexpr std::size_t meta = sizeof(FreeLinks) + sizeof(SpanInfo) + sizeof(TreeLinks);
+    char* p = static_cast<char*>(block_to_payload(b));
+    char* dirty_end = zero ? p + meta : std::max(c->touched + HEADER_SIZE + meta, p + meta);
+    std::size_t size = payload_size(b);
+    return {std::min(size, static_cast<std::size_t>(dirty_end - p)),
+            took_whole ? sizeof(std::size_t) : 0};
+}
+
+// Free block of at least asize bytes from one arena, setting it up on first
+// use and growing it (first the newest chunk's frontier, then a new chunk)
+// when none fits; a.lock held
+static Block* arena_find_free(HeapArena& a, std::size_t asize) {
+    if (!arena_setup(a)) return nullptr;
+    Block* b = find_fit(a, asize);
+    if (!b) b = chunk_extend(a, a.chunks, asize);
+    if (!b) {
+        if (!arena_add_chunk(a, asize)) return nullptr;
+        b = find_fit(a, asize);
+    }
+    return b;
+}
+
+// Allocate a block of asize bytes from one arena; a.lock held. If dirty is
+// given it receives which payload bytes may be non-zero.
+static Block* arena_alloc(HeapArena& a, std::size_t asize, DirtyRange* dirty = nullptr) {
+    Block* b = arena_find_free(a, asize);
+    if (!b) return nullptr;
+
+    bool took_whole = block_size(b) < asize + MIN_BLOCK_SIZE;
+    bool zero = tag_of(b) & TAG_ZERO;
+    split_block(a, b, asize);
+    Chunk* c = chunk_of(b);
+    if (dirty) *dirty = dirty_range(c, b, took_whole, zero);
+    c->touched = std::max(c->touched, reinterpret_cast<char*>(next_block(b)));
+    return b;
+}
+
+// Carve up to count blocks of asize bytes, laid out back to back, from a
+// single free span and store their payloads in out; returns how many were
+// carved (0 only if the arena can't grow). With line_end the last block
+// takes the padding up to where the next payload starts a cache line, so a
+// span carved after this one shares no line with it. a.lock held.
+static std::size_t arena_carve(HeapArena& a, std::size_t asize, std::size_t count, void** out,
+                               bool line_end = false) {
+    std::size_t n = std::min(count, std::numeric_limits<std::size_t>::max() / asize);
+    Block* span = arena_find_free(a, n * asize);
+    if (!span) {
+        // no room for all of them: settle for what the best fit holds
+        span = arena_find_free(a, asize);
+        if (!span) return 0;
+    }
+    std::size_t size = block_size(span);
+    n = std::min(n, size / asize);
+    bool prev_free = is_prev_free(span);
+    bool zero = tag_of(span) & TAG_ZERO;
+    free_list_remove(a, span);
+
+    std::size_t rest = size - n * asize;
+    std::size_t pad = 0;
+    if (line_end) {
+        std::size_t next = reinterpret_cast<std::uintptr_t>(span) + n * asize + HEADER_SIZE;
+        pad = (CACHE_LINE - next % CACHE_LINE) % CACHE_LINE;
+        if (rest < pad + MIN_BLOCK_SIZE) pad = 0;
+        rest -= pad;
+    }
+    char* p = reinterpret_cast<char*>(span);
+    for (std::size_t i = 0; i < n; ++i) {
+        Block* b = reinterpret_cast<Block*>(p);
+        std::size_t bsize = asize;
+        if (i == n - 1) bsize += pad + (rest < MIN_BLOCK_SIZE ? rest : 0); // a rest too small to stand alone
+        mark_used(b, bsize, i == 0 && prev_free);
+        out[i] = block_to_payload(b);
+        p += bsize;
+    }
+    if (rest >= MIN_BLOCK_SIZE) {
+        Block* tail = reinterpret_cast<Block*>(p);
+        mark_free(tail, rest, false, zero);
+        free_list_insert(a, tail);
+    } else {
+        set_prev_free(reinterpret_cast<Block*>(p), false);
+    }
+    Chunk* c = chunk_of(span);
+    c->touched = std::max(c->touched, p);
+    return n;
+}
+
+// Allocate a block of asize bytes whose payload is aligned to alignment
+// (a power of two above ALIGNMENT). The bytes in front of the aligned
+// header are split off as a free block of their own; a.lock held.
+static Block* arena_alloc_aligned(HeapArena& a, std::size_t asize, std::size_t alignment) {
+    if (asize > std::numeric_limits<std::size_t>::max() - alignment - MIN_BLOCK_SIZE) return nullptr;
+    Block* b = arena_find_free(a, asize + alignment + MIN_BLOCK_SIZE);
+    if (!b) return nullptr;
+
+    auto payload = reinterpret_cast<std::uintptr_t>(block_to_payload(b));
+    std::uintptr_t aligned = align_up(payload, alignment);
+    if (aligned != payload) {
+        // the leading gap must hold a block of its own
+        while (aligned - payload < MIN_BLOCK_SIZE) aligned += alignment;
+        std::size_t lead = aligned - payload;
+        std::size_t size = block_size(b);
+        bool zero = tag_of(b) & TAG_ZERO;
+        free_list_remove(a, b);
+        mark_free(b, lead, is_prev_free(b), zero);
+        free_list_insert(a, b);
+        b = payload_to_block(reinterpret_cast<void*>(aligned));
+        mark_free(b, size - lead, true, zero);
+        free_list_insert(a, b);
+    }
+
+    split_block(a, b, asize);
+    Chunk* c = chunk_of(b);
+    c->touched = std::max(c->touched, reinterpret_cast<char*>(next_block(b)));
+    return b;
+}
+
+// Try the calling thread's arena first, then spill into the other live ones
+template <typename Fn>
+static auto with_arenas(Fn&& fn) -> decltype(fn(arenas[0])) {
+    std::size_t home = arena_index(home_arena());
+    for (std::size_t k = 0; k < arena_count; ++k) {
+        HeapArena& a = arenas[(home + k) % arena_count];
+        if (k && !a.ready.load(std::memory_order_acquire)) continue;
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (auto r = fn(a)) return r;
+    }
+    return {};
+}
+
+// ---------------------------------------------------------------------------
+// Slabs
+//
+// Requests up to SLAB_MAX_SIZE bytes take a slot of a slab instead of a
+// block: no header, and free finds the slab from the chunk header through
+// the run index of the pointer. A slab's free slots form an intrusive list;
+// slots past its bump index were never handed out, so a new slab costs no
+// initialization. Slab state is guarded by the owning arena's lock.
+// ---------------------------------------------------------------------------
+
+static inline std::size_t slab_class(std::size_t size) { return (size - 1) / ALIGNMENT; }
+
+static inline SlabChunk* slab_chunk_of(Slab* s) {
+    return static_cast<SlabChunk*>(chunk_of(s));
+}
+
+static void slab_link(HeapArena& a, Slab* s) {
+    Slab*& head = a.slab_partial[slab_class(s->slot_size)];
+    s->prev = nullptr;
+    s->next = head;
+    if (head) head->prev = s;
+    head = s;
+    s->partial = true;
+}
+
+static void slab_unlink(HeapArena& a, Slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else a.slab_partial[slab_class(s->slot_size)] = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->partial = false;
+}
+
+// Map a new slab chunk; only its header is committed. a.lock held
+static SlabChunk* arena_add_slab_chunk(HeapArena& a) {
+    void* mem = os_map_aligned(CHUNK_ALIGN, CHUNK_ALIGN, false);
+    if (!mem) return nullptr;
+    os_bind_node(mem, CHUNK_ALIGN, a.node);
+    // real-time mode commits and faults in every run up front
+    bool prefault = realtime.load(std::memory_order_relaxed);
+    std::size_t commit = prefault ? CHUNK_ALIGN : align_up(sizeof(SlabChunk), os_page_size());
+    if (!os_commit(mem, commit)) {
+        os_unmap(mem, CHUNK_ALIGN);
+        return nullptr;
+    }
+    if (prefault) os_prefault(mem, commit);
+    SlabChunk* sc = new (mem) SlabChunk{};
+    sc->arena = &a;
+    sc->next = a.slab_chunks;
+    sc->size = CHUNK_ALIGN;
+    sc->kind = ChunkKind::Slabs;
+    sc->free_runs = SLAB_RUNS == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << SLAB_RUNS) - 1;
+    if (prefault) sc->committed_runs = sc->free_runs;
+
+    if (!map_live_bits(sc) || !radix_set(mem, CHUNK_ALIGN, sc)) {
+        unmap_live_bits(sc);
+        radix_set(mem, CHUNK_ALIGN, nullptr);
+        os_unmap(mem, CHUNK_ALIGN);
+        return nullptr;
+    }
+    arena_commit(a, commit);
+    a.slab_chunks = sc;
+    return sc;
+}
+
+// Start a slab for class cls in an unused run; a.lock held
+static Slab* slab_new(HeapArena& a, std::size_t cls) {
+    SlabChunk* sc = a.slab_chunks;
+    while (sc && !sc->free_runs) sc = static_cast<SlabChunk*>(sc->next);
+    if (!sc && !(sc = arena_add_slab_chunk(a))) return nullptr;
+
+    std::size_t i = std::countr_zero(sc->free_runs);
+    std::uint64_t bit = std::uint64_t(1) << i;
+    char* run = reinterpret_cast<char*>(sc) + i * SLAB_RUN_SIZE;
+    if (!(sc->committed_runs & bit)) {
+        if (!os_commit(run, SLAB_RUN_SIZE)) return nullptr;
+        arena_commit(a, SLAB_RUN_SIZE);
+        sc->committed_runs |= bit;
+    }
+    sc->free_runs &= ~bit;
+
+    Slab& s = sc->slabs[i];
+    s.start = i ? run : reinterpret_cast<char*>(sc) + align_up(sizeof(SlabChunk), CACHE_LINE);
+    s.free = nullptr;
+    s.slot_size = static_cast<std::uint32_t>((cls + 1) * ALIGNMENT);
+    s.capacity = static_cast<std::uint32_t>((run + SLAB_RUN_SIZE - s.start) / s.slot_size);
+    s.used = 0;
+    s.bump = 0;
+    s.owner = 0;
+    slab_link(a, &s);
+    return &s;
+}
+
+// Hand the run of an emptied slab back to its chunk; a.lock held
+static void slab_retire(HeapArena& a, Slab* s) {
+    SlabChunk* sc = slab_chunk_of(s);
+    if (s->partial) slab_unlink(a, s);
+    s->slot_size = 0;
+    s->owner = 0;
+    s->freed_at = now_ms();
+    s->purged = false;
+    sc->free_runs |= std::uint64_t(1) << (s - sc->slabs);
+    arena_maybe_purge(a);
+}
+
+// Descriptor of the run holding p
+static inline Slab* slab_at(SlabChunk* sc, const void* p) {
+    auto off = static_cast<std::size_t>(static_cast<const char*>(p) - reinterpret_cast<char*>(sc));
+    return &sc->slabs[off >> SLAB_RUN_SHIFT];
+}
+
+// Slab holding p, or nullptr if p is not the start of one of its slots
+static Slab* slab_lookup(SlabChunk* sc, const void* p) {
+    Slab& s = *slab_at(sc, p);
+    if (!s.slot_size) return nullptr;
+    auto slot = static_cast<std::size_t>(static_cast<const char*>(p) - s.start);
+    if (slot % s.slot_size || slot / s.slot_size >= s.capacity) return nullptr;
+    return &s;
+}
+
+// Let go of the never-used slots of s, putting it back on the partial list
+// if it has some; a.lock held
+static void slab_disown(HeapArena& a, Slab* s) {
+    s->owner = 0;
+    if (!s->partial && s->bump < s->capacity) slab_link(a, s);
+}
+
+// The run whose never-used slots thread cache owner carves for class cls:
+// *run while it has a slot left, else a run on the partial list nobody
+// carves, else a new one; a.lock held. Owned runs leave the partial list
+// while they have no freed slots.
+static Slab* slab_carving(HeapArena& a, std::size_t cls, std::uint16_t owner, Slab** run) {
+    Slab* s = run ? *run : nullptr;
+    // chunks never change arenas, and owner is only read under this arena's lock
+    if (s && slab_chunk_of(s)->arena == &a && s->owner == owner && s->slot_size == (cls + 1) * ALIGNMENT) {
+        if (s->free || s->bump < s->capacity) return s;
+        slab_disown(a, s);
+    }
+    s = a.slab_partial[cls];
+    if (!s || s->owner) s = slab_new(a, cls);
+    if (s && run) {
+        s->owner = owner;
+        *run = s;
+    }
+    return s;
+}
+
+// Detach up to n slots of class cls from arena a, linked through
+// SlotLinks::next and still carrying tcache_key; a.lock held. Freed slots
+// come from any slab, never-used ones only from a run of the caller's: with
+// owner (the calling thread's cache id) from *run, so that the neighbouring
+// slots of a thread's fresh objects are its own.
+static SlotLinks* arena_slab_refill(HeapArena& a, std::size_t cls, std::uint32_t n, std::uint32_t& got,
+                                    std::uint16_t owner = 0, Slab** run = nullptr) {
+    SlotLinks* chain = nullptr;
+    got = 0;
+    while (got < n) {
+        Slab* s = a.slab_partial[cls];
+        if (!s || (!s->free && s->owner != owner)) s = slab_carving(a, cls, owner, run);
+        if (!s) break;
+        while (got < n && (s->free || (s->bump < s->capacity && s->owner == owner))) {
+            SlotLinks* slot = s->free;
+            if (slot) {
+                s->free = slot->next;
+            } else {
+                slot = reinterpret_cast<SlotLinks*>(s->start + std::size_t(s->bump++) * s->slot_size);
+                slot->key = tcache_key;
+            }
+            ++s->used;
+            slot->next = chain;
+            chain = slot;
+            ++got;
+        }
+        if (s->partial && !s->free && (s->bump == s->capacity || s->owner)) slab_unlink(a, s);
+    }
+    return chain;
+}
+
+// Put a slot back on its slab; a.lock held
+static void slab_release(HeapArena& a, Slab* s, SlotLinks* slot) {
+    slot->key = tcache_key;
+    slot->next = s->free;
+    s->free = slot;
+    if (!s->partial) slab_link(a, s);
+    if (--s->used == 0) slab_retire(a, s);
+}
+
+// Return a chain of slots to their slabs, taking each arena lock once per
+// run of slots from the same arena
+static void release_slots(SlotLinks* list) {
+    HeapArena* locked = nullptr;
+    while (list) {
+        SlotLinks* next = list->next;
+        auto* sc = static_cast<SlabChunk*>(chunk_of(list));
+        if (sc->arena != locked) {
+            if (locked) locked->lock.unlock();
+            sc->arena->lock.lock();
+            locked = sc->arena;
+        }
+        slab_release(*locked, slab_at(sc, list), list);
+        list = next;
+    }
+    if (locked) locked->lock.unlock();
+}
+
+// ---------------------------------------------------------------------------
+// Huge chunks
+//
+// A request of at least huge_threshold bytes gets a CHUNK_ALIGN-aligned
+// mapping of its own: a Chunk header followed by the payload, at huge_offset. It never
+// touches an arena, and free unmaps it. Growing one moves its pages with
+// mremap, into a fresh aligned reservation when it can't grow in place.
+// ---------------------------------------------------------------------------
+
+constexpr std::size_t HUGE_HEADER_SIZE = align_up(sizeof(Chunk));
+
+static inline void* huge_payload(Chunk* c) {
+    return reinterpret_cast<char*>(c) + c->huge_offset;
+}
+
+static inline std::size_t huge_usable_size(Chunk* c) { return c->size - c->huge_offset; }
+
+// Mapping size for a huge payload of n bytes at offset, 0 on overflow.
+// Explicit huge pages come whole; transparent ones cover what they can.
+static inline std::size_t huge_map_size(std::size_t n, std::size_t offset, HugePages pages) {
+    std::size_t page = pages == HugePages::Explicit ? HUGE_PAGE_SIZE : os_page_size();
+    if (n > std::numeric_limits<std::size_t>::max() - offset - page) return 0;
+    return align_up(offset + n, page);
+}
+
+// Alignment of huge chunk mappings, so huge pages can back them
+static inline std::size_t huge_map_align(HugePages pages) {
+    return pages == HugePages::Off ? CHUNK_ALIGN : HUGE_PAGE_SIZE;
+}
+
+// Map a huge chunk, bound to node; payloads sit right after the header
+// unless a larger alignment asks for more (the gap is never touched, so it
+// costs no memory)
+static void* huge_alloc(std::size_t size, std::size_t alignment = ALIGNMENT, int node = home_node()) {
+    HugePages wanted = huge_pages.load(std::memory_order_relaxed), pages = wanted;
+    std::size_t offset = align_up(HUGE_HEADER_SIZE, alignment);
+    std::size_t map = huge_map_size(size, offset, pages);
+    if (!map) return nullptr;
+    void* mem = map_chunk(map, std::max(huge_map_align(pages), alignment), pages, true);
+    if (!mem) return nullptr;
+    // the fallback from explicit pages may need less
+    if (pages != wanted) {
+        std::size_t fit = huge_map_size(size, offset, pages);
+        os_unmap(static_cast<char*>(mem) + fit, map - fit);
+        map = fit;
+    }
+    os_bind_node(mem, map, node);
+    Chunk* c = new (mem) Chunk{};
+    c->size = map;
+    c->kind = ChunkKind::Huge;
+    c->huge_offset = offset;
+    c->pages = pages;
+    if (!radix_set(mem, map, c)) {
+        radix_set(mem, map, nullptr);
+        os_unmap(mem, map);
+        return nullptr;
+    }
+    note_commit(map);
+    return huge_payload(c);
+}
+
+static void huge_free(Chunk* c) {
+    note_decommit(c->size);
+    radix_set(c, c->size, nullptr);
+    os_unmap(c, c->size);
+}
+
+// Record a huge mapping changing from old_map to map bytes
+static void note_huge_resize(std::size_t old_map, std::size_t map) {
+    if (map > old_map) note_commit(map - old_map);
+    else note_decommit(old_map - map);
+}
+
+// Resize a huge chunk without copying; nullptr if that isn't possible, in
+// which case c is left as it was
+static void* huge_resize(Chunk* c, std::size_t new_size) {
+    std::size_t old_map = c->size;
+    std::size_t map = huge_map_size(new_size, c->huge_offset, c->pages);
+    if (!map) return nullptr;
+    if (map == old_map) return huge_payload(c);
+
+    char* base = reinterpret_cast<char*>(c);
+    if (os_remap(base, old_map, map, nullptr)) {
+        if (map > old_map && !radix_set(base, map, c)) {
+            os_remap(base, map, old_map, nullptr);
+            return nullptr;
+        }
+        // drop the radix entries of granules no longer covered
+        char* keep = base + align_up(map, CHUNK_ALIGN);
+        if (base + old_map > keep) radix_set(keep, static_cast<std::size_t>(base + old_map - keep), nullptr);
+        c->size = map;
+        note_huge_resize(old_map, map);
+        return huge_payload(c);
+    }
+
+    // move the pages into a new aligned reservation; creating its radix
+    // leaves first means registering it afterwards cannot fail
+    void* dest = os_map_aligned(map, huge_map_align(c->pages), false);
+    if (!dest) return nullptr;
+    if (!radix_set(dest, map, nullptr) || !os_remap(base, old_map, map, dest)) {
+        os_unmap(dest, map);
+        return nullptr;
+    }
+    radix_set(base, old_map, nullptr);
+    Chunk* moved = static_cast<Chunk*>(dest);
+    moved->size = map;
+    radix_set(dest, map, moved);
+    note_huge_resize(old_map, map);
+    return huge_payload(moved);
+}
+
+// ---------------------------------------------------------------------------
+// Per-thread caches
+//
+// Small blocks are served from per-thread bins, one per small size class.
+// Cached blocks stay allocated as far as the backend is concerned; bins
+// refill from it and flush to it in batches, so an arena lock is taken about
+// once per TCACHE_BATCH operations. A block's tag records the cache that
+// handed it out, and a free from another thread is pushed onto that cache's
+// slot: a lock-free stack with many producers and the owner as its only
+// consumer, which takes the whole stack with one exchange on its next malloc.
+// Cached blocks carry tcache_key in their links so double frees are caught
+// without touching the tag. The slot also holds the thread's statistics.
+//
+// Slab slots have separate bins. They are not tied to a cache: any thread
+// may cache a slot it frees, and flushing returns it to its own slab.
+// ---------------------------------------------------------------------------
+
+constexpr std::size_t TCACHE_MAX_SIZE = SMALL_CLASS_MAX;
+constexpr std::uint32_t TCACHE_BATCH = 16;     // blocks moved per refill / flush
+constexpr std::uint32_t TCACHE_BIN_LIMIT = 64; // flush once a bin grows past this
+constexpr std::size_t MAX_THREAD_CACHES = 1024;
+constexpr std::uint32_t QUARANTINE_SLOTS = 128; // hardened mode: frees held back per thread
+
+struct CacheBin {
+    Block* head;
+    std::uint32_t count;
+};
+
+struct SlotBin {
+    SlotLinks* head;
+    std::uint32_t count;
+    Slab* run; // where the thread carves never-used slots of this class
+};
+
+// Frees held back from reuse in hardened mode, a FIFO ring
+struct Quarantine {
+    struct Entry {
+        void* ptr;
+        Chunk* chunk;
+        std::size_t usable; // bytes before the canary
+    } entries[QUARANTINE_SLOTS];
+    std::uint32_t head;  // oldest entry
+    std::uint32_t count;
+    std::size_t bytes;   // sum of usable
+};
+
+struct ThreadCache {
+    std::uint16_t id;   // slot index + 1, 0 while unregistered
+    bool dead;          // thread is exiting, or no slot was available
+    std::uint32_t trace_thread; // TraceBlockHeader::thread, 0 until first traced
+    CacheBin bins[NUM_SMALL_CLASSES];
+    SlotBin slab_bins[NUM_SLAB_CLASSES];
+    Quarantine quarantine;
+    ~ThreadCache();
+};
+
+// Allocation counters. A thread's own are written only by that thread, with
+// a plain load and store instead of a read-modify-write; get_stats() sums
+// them under registry_lock.
+struct ThreadStats {
+    std::atomic<std::size_t> alloc_bytes;
+    std::atomic<std::size_t> free_bytes;
+    std::atomic<std::size_t> allocs;
+    std::atomic<std::size_t> frees;
+    std::atomic<std::size_t> class_allocs[NUM_CLASSES];
+    std::atomic<std::size_t> class_frees[NUM_CLASSES];
+};
+
+static_assert(NUM_CLASSES == STATS_SIZE_CLASSES, "Stats histogram follows the size classes");
+
+struct TraceRing;
+
+// Registry slot of one thread cache: blocks freed by other threads, linked
+// through FreeLinks::next. REMOTE_CLOSED marks a slot whose owner has exited;
+// frees then go straight to the arena.
+struct alignas(64) CacheSlot {
+    std::atomic<Block*> remote{nullptr};
+    bool alive = false; // registry_lock held
+    alignas(64) ThreadStats stats; // kept off the line remote frees write
+    std::atomic<TraceRing*> trace{nullptr}; // mapped on first traced call, kept for reuse
+};
+
+static Block* const REMOTE_CLOSED = reinterpret_cast<Block*>(std::uintptr_t(1));
+
+static CacheSlot cache_slots[MAX_THREAD_CACHES];
+static std::mutex registry_lock; // taken only when a thread registers
+// Counts of exited threads, and of threads without a cache (which update
+// them with atomic adds)
+static ThreadStats retired_stats;
+static thread_local ThreadCache tcache;
+
+static inline bool is_cached(Block* b) { return links(b)->prev == tcache_key; }
+
+static void trace_flush(CacheSlot& slot);
+static void quarantine_flush(Quarantine& q);
+
+static ThreadCache* get_tcache() {
+    ThreadCache* tc = &tcache;
+    if (tc->id) return tc;
+    if (tc->dead) return nullptr;
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (std::size_t i = 0; i < MAX_THREAD_CACHES; ++i) {
+        CacheSlot& slot = cache_slots[i];
+        if (slot.alive) continue;
+        slot.alive = true;
+        slot.remote.store(nullptr, std::memory_order_relaxed);
+        tc->id = static_cast<std::uint16_t>(i + 1);
+        return tc;
+    }
+    tc->dead = true; // out of slots: this thread uses the backend directly
+    return nullptr;
+}
+
+// Histogram class of an allocation with usable bytes: the small classes,
+// then one per power of two (see Stats)
+static inline std::size_t stats_class(std::size_t usable) {
+    if (usable <= SMALL_CLASS_MAX) return align_up(usable) / ALIGNMENT - 1;
+    return NUM_SMALL_CLASSES + (std::bit_width(usable - 1) - 1 - SMALL_CLASS_SHIFT);
+}
+
+static inline void stat_add(std::atomic<std::size_t>& c, std::size_t n, bool shared) {
+    if (shared) c.fetch_add(n, std::memory_order_relaxed);
+    else c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Count n allocations of usable bytes each by the calling thread
+static void count_allocs(std::size_t usable, std::size_t n = 1) {
+    ThreadCache* tc = get_tcache();
+    ThreadStats& st = tc ? cache_slots[tc->id - 1].stats : retired_stats;
+    stat_add(st.alloc_bytes, usable * n, !tc);
+    stat_add(st.allocs, n, !tc);
+    stat_add(st.class_allocs[stats_class(usable)], n, !tc);
+}
+
+static void count_frees(std::size_t usable, std::size_t n = 1) {
+    ThreadCache* tc = get_tcache();
+    ThreadStats& st = tc ? cache_slots[tc->id - 1].stats : retired_stats;
+    stat_add(st.free_bytes, usable * n, !tc);
+    stat_add(st.frees, n, !tc);
+    stat_add(st.class_frees[stats_class(usable)], n, !tc);
+}
+
+// A realloc that kept its block still counts as a free and an allocation
+static void count_realloc(std::size_t old_usable, std::size_t new_usable) {
+    count_frees(old_usable);
+    count_allocs(new_usable);
+}
+
+// Move the counts of an exiting thread into retired_stats; registry_lock held
+static void retire_stats(ThreadStats& st) {
+    auto move = [](std::atomic<std::size_t>& from, std::atomic<std::size_t>& to) {
+        to.fetch_add(from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        from.store(0, std::memory_order_relaxed);
+    };
+    move(st.alloc_bytes, retired_stats.alloc_bytes);
+    move(st.free_bytes, retired_stats.free_bytes);
+    move(st.allocs, retired_stats.allocs);
+    move(st.frees, retired_stats.frees);
+    for (std::size_t i = 0; i < NUM_CLASSES; ++i) {
+        move(st.class_allocs[i], retired_stats.class_allocs[i]);
+        move(st.class_frees[i], retired_stats.class_frees[i]);
+    }
+}
+
+static inline void bin_push(CacheBin& bin, Block* b) {
+    links(b)->next = bin.head;
+    links(b)->prev = tcache_key;
+    bin.head = b;
+    ++bin.count;
+}
+
+static inline Block* bin_pop(CacheBin& bin) {
+    Block* b = bin.head;
+    if (b) {
+        bin.head = links(b)->next;
+        links(b)->prev = nullptr;
+        --bin.count;
+    }
+    return b;
+}
+
+// Return up to n blocks of a bin to the backend in one batch
+static void tcache_flush(CacheBin& bin, std::uint32_t n) {
+    Block* chain = nullptr;
+    while (n-- && bin.head) {
+        Block* b = bin_pop(bin);
+        links(b)->next = chain;
+        chain = b;
+    }
+    release_chain(chain);
+}
+
+// Carve a batch of blocks for class cls from arena a: returns the first,
+// caches the rest; a.lock held. The batch is one span cut back to back, so
+// a thread's small blocks neighbour each other rather than another
+// thread's.
+static Block* arena_refill(HeapArena& a, ThreadCache* tc, std::size_t cls) {
+    std::size_t asize = (cls + 1) * ALIGNMENT;
+    Block* first = nullptr;
+    void* batch[TCACHE_BATCH];
+    std::size_t n = arena_carve(a, asize, TCACHE_BATCH, batch, true);
+
+    for (std::size_t i = 0; i < n; ++i) {
+        Block* b = payload_to_block(batch[i]);
+        set_owner(b, tc->id);
+        if (!first) {
+            first = b;
+        } else if (block_size(b) <= TCACHE_MAX_SIZE) {
+            bin_push(tc->bins[size_class(block_size(b))], b);
+        } else {
+            release_block(a, b); // unsplittable tail, too big for the bins
+        }
+    }
+    return first;
+}
+
+static Block* tcache_refill(ThreadCache* tc, std::size_t cls) {
+    return with_arenas([&](HeapArena& a) { return arena_refill(a, tc, cls); });
+}
+
+// Move blocks freed by other threads into our own bins
+static void tcache_drain_remote(ThreadCache* tc) {
+    Block* list = cache_slots[tc->id - 1].remote.exchange(nullptr, std::memory_order_acquire);
+    while (list) {
+        Block* next = links(list)->next;
+        CacheBin& bin = tc->bins[size_class(block_size(list))];
+        bin_push(bin, list);
+        if (bin.count > TCACHE_BIN_LIMIT) tcache_flush(bin, TCACHE_BATCH);
+        list = next;
+    }
+}
+
+static void* tcache_malloc(ThreadCache* tc, std::size_t asize) {
+    std::size_t cls = size_class(asize);
+    CacheBin& bin = tc->bins[cls];
+    if (cache_slots[tc->id - 1].remote.load(std::memory_order_relaxed)) tcache_drain_remote(tc);
+
+    Block* b = bin_pop(bin);
+    if (!b) b = tcache_refill(tc, cls);
+    return block_to_payload(b); // nullptr when the backend is exhausted
+}
+
+static void tcache_free(ThreadCache* tc, Block* b, std::size_t size) {
+    CacheBin& bin = tc->bins[size_class(size)];
+    bin_push(bin, b);
+    if (bin.count > TCACHE_BIN_LIMIT) tcache_flush(bin, TCACHE_BATCH);
+}
+
+// Return up to n slots of a slab bin to their slabs in one batch
+static void slab_flush(SlotBin& bin, std::uint32_t n) {
+    SlotLinks* chain = nullptr;
+    while (n-- && bin.head) {
+        SlotLinks* slot = bin.head;
+        bin.head = slot->next;
+        --bin.count;
+        slot->next = chain;
+        chain = slot;
+    }
+    release_slots(chain);
+}
+
+static void* slab_malloc(std::size_t size) {
+    std::size_t cls = slab_class(size);
+    SlotLinks* slot;
+    if (ThreadCache* tc = get_tcache()) {
+        SlotBin& bin = tc->slab_bins[cls];
+        if (!bin.head) {
+            bin.head = with_arenas([&](HeapArena& a) {
+                return arena_slab_refill(a, cls, TCACHE_BATCH, bin.count, tc->id, &bin.run);
+            });
+        }
+        slot = bin.head;
+        if (!slot) return nullptr;
+        bin.head = slot->next;
+        --bin.count;
+    } else {
+        std::uint32_t got;
+        slot = with_arenas([&](HeapArena& a) { return arena_slab_refill(a, cls, 1, got); });
+        if (!slot) return nullptr;
+    }
+    slot->key = nullptr;
+    return slot;
+}
+
+// Cache a freed slot in the bin of class cls, which every caller passes as
+// the slot's own class: slab_malloc then hands out only slots of exactly
+// the requested class, which counted_slot relies on to size them
+static void slab_cache_push(ThreadCache* tc, std::size_t cls, SlotLinks* slot) {
+    SlotBin& bin = tc->slab_bins[cls];
+    slot->key = tcache_key;
+    slot->next = bin.head;
+    bin.head = slot;
+    if (++bin.count > TCACHE_BIN_LIMIT) slab_flush(bin, TCACHE_BATCH);
+}
+
+// Slots of another node's arena, or of a Heap, go straight back to their
+// slab rather than into this thread's bins
+static void slab_free(HeapArena& a, Slab* s, SlotLinks* slot) {
+    ThreadCache* tc = !a.instance && node_local(a) ? get_tcache() : nullptr;
+    if (tc) {
+        slab_cache_push(tc, slab_class(s->slot_size), slot);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(a.lock);
+    slab_release(a, s, slot);
+}
+
+// Free of a block owned by another thread's cache
+static void remote_free(Block* b, std::uint16_t owner) {
+    std::atomic<Block*>& remote = cache_slots[owner - 1].remote;
+    links(b)->prev = tcache_key;
+    Block* head = remote.load(std::memory_order_relaxed);
+    do {
+        if (head == REMOTE_CLOSED) {
+            // owner has exited
+            links(b)->next = nullptr;
+            release_chain(b);
+            return;
+        }
+        links(b)->next = head;
+    } while (!remote.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Free allocated block b of arena a: cached blocks go back to the cache
+// that handed them out, the rest are marked free and coalesced
+static void free_block(HeapArena& a, Block* b) {
+    std::uint16_t owner = block_owner(b);
+    std::size_t size = block_size(b);
+    if (owner && size <= TCACHE_MAX_SIZE) {
+        ThreadCache* tc = get_tcache();
+        if (tc && tc->id == owner) tcache_free(tc, b, size);
+        else remote_free(b, owner);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(a.lock);
+    release_block(a, b);
+}
+
+ThreadCache::~ThreadCache() {
+    dead = true;
+    if (!id) return;
+    quarantine_flush(quarantine); // into the bins flushed below
+
+    CacheSlot& slot = cache_slots[id - 1];
+    Block* list = slot.remote.exchange(REMOTE_CLOSED, std::memory_order_acquire);
+    for (CacheBin& bin : bins) {
+        while (bin.head) {
+            Block* b = bin_pop(bin);
+            links(b)->next = list;
+            list = b;
+        }
+    }
+    release_chain(list);
+    for (SlotBin& bin : slab_bins) {
+        slab_flush(bin, bin.count);
+        if (!bin.run) continue;
+        HeapArena& a = *slab_chunk_of(bin.run)->arena;
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (bin.run->owner == id) slab_disown(a, bin.run);
+    }
+    trace_flush(slot);
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        retire_stats(slot.stats);
+        slot.alive = false;
+    }
+    id = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Allocation tracing
+//
+// Between trace_start() and trace_stop() the public entry points append a
+// TraceRecord (see trace_format.h) to a ring owned by the caller's cache
+// slot. Appending is lock-free; rings are drained into the trace file under
+// trace_lock, by their owner when one fills up and by trace_stop() and
+// thread exit for the rest. Rings are mapped directly and the file written
+// with write(), so tracing never calls back into malloc.
+// ---------------------------------------------------------------------------
+
+constexpr std::uint32_t TRACE_RING_SIZE = 4096; // records; a power of two
+
+struct TraceRing {
+    std::atomic<std::uint32_t> head{0};   // written by the owning thread
+    std::atomic<std::uint32_t> tail{0};   // written while draining
+    std::atomic<std::uint32_t> thread{0}; // trace_thread of the owner
+    TraceRecord records[TRACE_RING_SIZE];
+};
+
+static std::atomic<bool> tracing{false};
+static std::mutex trace_lock; // guards trace_fd and the draining of rings
+static int trace_fd = -1;
+static std::atomic<std::uint32_t> next_trace_thread{1};
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+constexpr TraceClock TRACE_CLOCK = TraceClock::Tsc;
+static inline std::uint64_t trace_clock() { return __rdtsc(); }
+#else
+constexpr TraceClock TRACE_CLOCK = TraceClock::Nanoseconds;
+static inline std::uint64_t trace_clock() {
+    using namespace std::chrono;
+    return static_cast<std::uint64_t>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+#endif
+
+// Append count records of one thread as a block; dropped while no trace
+// file is open. trace_lock held
+static void trace_write(std::uint32_t thread, const TraceRecord* records, std::uint32_t count) {
+    if (trace_fd < 0 || !count) return;
+    TraceBlockHeader header{thread, count};
+    os_write_all(trace_fd, &header, sizeof(header));
+    os_write_all(trace_fd, records, count * sizeof(TraceRecord));
+}
+
+// Empty a ring into the trace file; trace_lock held
+static void trace_drain(TraceRing* r) {
+    std::uint32_t tail = r->tail.load(std::memory_order_relaxed);
+    std::uint32_t head = r->head.load(std::memory_order_acquire);
+    std::uint32_t thread = r->thread.load(std::memory_order_relaxed);
+    while (tail != head) {
+        std::uint32_t at = tail % TRACE_RING_SIZE;
+        std::uint32_t n = std::min(head - tail, TRACE_RING_SIZE - at);
+        trace_write(thread, r->records + at, n);
+        tail += n;
+    }
+    r->tail.store(tail, std::memory_order_release);
+}
+
+static void trace_flush(CacheSlot& slot) {
+    TraceRing* r = slot.trace.load(std::memory_order_acquire);
+    if (!r) return;
+    std::lock_guard<std::mutex> guard(trace_lock);
+    trace_drain(r);
+}
+
+static void trace_record(TraceOp op, const void* id, std::uint64_t arg, std::uint64_t size) {
+    TraceRecord rec{trace_clock(), reinterpret_cast<std::uintptr_t>(id), arg,
+                    size << 8 | static_cast<std::uint64_t>(op)};
+    ThreadCache* tc = get_tcache();
+    if (!tc) {
+        // no slot to hang a ring on: write the record by itself
+        std::lock_guard<std::mutex> guard(trace_lock);
+        trace_write(0, &rec, 1);
+        return;
+    }
+    CacheSlot& slot = cache_slots[tc->id - 1];
+    TraceRing* r = slot.trace.load(std::memory_order_relaxed);
+    if (!tc->trace_thread) {
+        // a ring left by an earlier owner of the slot was drained when it exited
+        if (!r) {
+            std::size_t size = align_up(sizeof(TraceRing), os_page_size());
+            void* mem = os_map_aligned(size, os_page_size());
+            if (!mem) return;
+            note_commit(size);
+            r = new (mem) TraceRing{};
+            slot.trace.store(r, std::memory_order_release);
+        }
+        tc->trace_thread = next_trace_thread.fetch_add(1, std::memory_order_relaxed);
+        r->thread.store(tc->trace_thread, std::memory_order_relaxed);
+    }
+    std::uint32_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        trace_drain(r);
+    }
+    r->records[head % TRACE_RING_SIZE] = rec;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+static inline bool trace_on() { return tracing.load(std::memory_order_relaxed); }
+
+bool trace_start(const char* path) {
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (trace_fd >= 0) return false;
+    int fd = os_create_file(path);
+    if (fd < 0) return false;
+    TraceFileHeader header{};
+    std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.clock = TRACE_CLOCK;
+    if (!os_write_all(fd, &header, sizeof(header))) {
+        os_close_file(fd);
+        return false;
+    }
+    // drop records that raced with an earlier trace_stop
+    for (CacheSlot& slot : cache_slots) {
+        if (TraceRing* r = slot.trace.load(std::memory_order_acquire)) trace_drain(r);
+    }
+    trace_fd = fd;
+    tracing.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void trace_stop() {
+    tracing.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (trace_fd < 0) return;
+    for (CacheSlot& slot : cache_slots) {
+        if (TraceRing* r = slot.trace.load(std::memory_order_acquire)) trace_drain(r);
+    }
+    os_close_file(trace_fd);
+    trace_fd = -1;
+}
+
+// ---------------------------------------------------------------------------
+// Heap profiling
+//
+// Each thread counts the bytes it allocates down from a random distance,
+// drawn from an exponential distribution with mean profile_rate, and the
+// allocation that crosses zero is sampled: a block of n bytes is picked
+// with probability 1 - exp(-n / rate), which is what pprof's heap_v2
+// scaling undoes. Only a sampled allocation has its stack captured. The
+// stack is interned in a table of stacks, the block entered in a table of
+// live samples, and the allocation marked: TAG_SAMPLED in a block's tag, a
+// count in its slab run, a flag in a huge chunk's header. Free looks in the
+// table only where it finds a mark. The tables are mapped by the first
+// profile_start and kept, so the profiler itself never allocates.
+// ---------------------------------------------------------------------------
+
+constexpr std::size_t DEFAULT_PROFILE_RATE = 512 * 1024;
+constexpr std::size_t PROFILE_DEPTH = 32;                 // frames kept per stack
+constexpr std::size_t PROFILE_STACKS = std::size_t(1) << 14;  // distinct stacks; a power of two
+constexpr std::size_t PROFILE_SAMPLES = std::size_t(1) << 16; // live samples; a power of two
+constexpr std::uint32_t NO_STACK = ~std::uint32_t(0);
+
+struct ProfileStack {
+    std::uint64_t hash; // 0 while unused
+    std::uint32_t depth;
+    void* frames[PROFILE_DEPTH];
+    std::size_t allocs, alloc_bytes; // samples taken here
+    std::size_t live, live_bytes;    // of those, not yet freed
+};
+
+struct ProfileSample {
+    void* ptr;        // nullptr while unused
+    std::size_t size; // bytes requested
+    std::uint32_t stack;
+};
+
+// Sampling state of a thread
+struct SampleState {
+    std::int64_t countdown; // bytes left to allocate before the next sample
+    std::uint64_t rng;      // 0 until the first draw
+    bool busy;              // inside the profiler, whose own allocations aren't sampled
+};
+
+static std::atomic<bool> profiling{false};
+static std::atomic<std::size_t> profile_rate{DEFAULT_PROFILE_RATE};
+static std::mutex profile_lock; // guards everything below
+static ProfileStack* profile_stacks = nullptr;
+static ProfileSample* profile_samples = nullptr;
+static std::size_t profile_stack_count = 0;
+static std::size_t profile_live = 0;    // entries in profile_samples
+static std::size_t profile_dropped = 0; // samples lost to full tables
+// MINI_ALLOC_PROFILE: where dumps asked for by a signal go
+static const char* profile_path = nullptr;
+static std::atomic<bool> profile_dump_requested{false};
+static std::atomic<unsigned> profile_dumps{0};
+static thread_local SampleState sample_state;
+
+static inline bool profile_on() { return profiling.load(std::memory_order_relaxed); }
+
+static inline std::size_t sample_slot(const void* p) {
+    return static_cast<std::size_t>((reinterpret_cast<std::uintptr_t>(p) >> 4) * 0x9E3779B97F4A7C15ull >> 16) &
+           (PROFILE_SAMPLES - 1);
+}
+
+// Live sample of p, linear probing; profile_lock held
+static ProfileSample* sample_find(const void* p) {
+    for (std::size_t i = sample_slot(p);; i = (i + 1) & (PROFILE_SAMPLES - 1)) {
+        ProfileSample& e = profile_samples[i];
+        if (!e.ptr) return nullptr;
+        if (e.ptr == p) return &e;
+    }
+}
+
+// profile_lock held; fails when the table is three quarters full
+static bool sample_insert(void* p, std::size_t size, std::uint32_t stack) {
+    if (profile_live >= PROFILE_SAMPLES / 4 * 3) return false;
+    std::size_t i = sample_slot(p);
+    while (profile_samples[i].ptr) i = (i + 1) & (PROFILE_SAMPLES - 1);
+    profile_samples[i] = {p, size, stack};
+    ++profile_live;
+    ProfileStack& s = profile_stacks[stack];
+    ++s.live;
+    s.live_bytes += size;
+    return true;
+}
+
+// Remove e, shifting later entries of its probe run back into the hole;
+// profile_lock held
+static void sample_erase(ProfileSample* e) {
+    ProfileStack& s = profile_stacks[e->stack];
+    --s.live;
+    s.live_bytes -= e->size;
+    --profile_live;
+    std::size_t hole = static_cast<std::size_t>(e - profile_samples);
+    for (std::size_t j = (hole + 1) & (PROFILE_SAMPLES - 1); profile_samples[j].ptr; j = (j + 1) & (PROFILE_SAMPLES - 1)) {
+        // an entry may fill the hole unless its home slot lies after it
+        std::size_t home = sample_slot(profile_samples[j].ptr);
+        if (((j - home) & (PROFILE_SAMPLES - 1)) >= ((j - hole) & (PROFILE_SAMPLES - 1))) {
+            profile_samples[hole] = profile_samples[j];
+            hole = j;
+        }
+    }
+    profile_samples[hole].ptr = nullptr;
+}
+
+// Index of the stack of frames, added if new; NO_STACK once the table is
+// three quarters full. profile_lock held.
+static std::uint32_t stack_intern(void* const* frames, std::size_t depth) {
+    std::uint64_t hash = depth;
+    for (std::size_t i = 0; i < depth; ++i) {
+        hash = (hash ^ reinterpret_cast<std::uintptr_t>(frames[i])) * 0x100000001B3ull;
+    }
+    hash |= 1;
+    for (std::size_t i = hash >> 20;; ++i) {
+        ProfileStack& s = profile_stacks[i & (PROFILE_STACKS - 1)];
+        if (!s.hash) {
+            if (profile_stack_count >= PROFILE_STACKS / 4 * 3) return NO_STACK;
+            ++profile_stack_count;
+            s.hash = hash;
+            s.depth = static_cast<std::uint32_t>(depth);
+            std::memcpy(s.frames, frames, depth * sizeof(void*));
+            return static_cast<std::uint32_t>(i & (PROFILE_STACKS - 1));
+        }
+        if (s.hash == hash && s.depth == depth && !std::memcmp(s.frames, frames, depth * sizeof(void*))) {
+            return static_cast<std::uint32_t>(i & (PROFILE_STACKS - 1));
+        }
+    }
+}
+
+// Set or clear the sample mark of allocation p of chunk c. Block tags also
+// change when a neighbour is freed, so they are written under the arena lock.
+static void set_sample_mark(Chunk* c, void* p, bool on) {
+    switch (c->kind) {
+    case ChunkKind::Huge:
+        c->sampled = on;
+        break;
+    case ChunkKind::Slabs:
+        if (on) slab_at(static_cast<SlabChunk*>(c), p)->sampled.fetch_add(1, std::memory_order_relaxed);
+        else slab_at(static_cast<SlabChunk*>(c), p)->sampled.fetch_sub(1, std::memory_order_relaxed);
+        break;
+    case ChunkKind::Blocks: {
+        std::lock_guard<std::mutex> guard(c->arena->lock);
+        Block* b = payload_to_block(p);
+        set_tag(b, on ? tag_of(b) | TAG_SAMPLED : tag_of(b) & ~TAG_SAMPLED);
+        break;
+    }
+    }
+}
+
+// Whether allocation p of chunk c may be a sample (for a slot: whether its
+// run holds one)
+static bool has_sample_mark(Chunk* c, void* p) {
+    switch (c->kind) {
+    case ChunkKind::Huge: return c->sampled;
+    case ChunkKind::Slabs:
+        return slab_at(static_cast<SlabChunk*>(c), p)->sampled.load(std::memory_order_relaxed);
+    default: return tag_of(payload_to_block(p)) & TAG_SAMPLED;
+    }
+}
+
+// Distance in bytes to the next sample
+static std::int64_t sample_distance(SampleState& st) {
+    st.rng ^= st.rng << 13;
+    st.rng ^= st.rng >> 7;
+    st.rng ^= st.rng << 17;
+    double u = double((st.rng >> 11) + 1) * 0x1.0p-53; // (0, 1]
+    return static_cast<std::int64_t>(-std::log(u) * double(profile_rate.load(std::memory_order_relaxed)));
+}
+
+static void profile_dump_requested_now();
+
+// Slow path of profile_alloc: the countdown crossed zero at p
+MINI_ALLOC_NOINLINE static void profile_sample(void* p, std::size_t size) {
+    SampleState& st = sample_state;
+    if (st.busy) return;
+    if (!st.rng) {
+        // first crossing of this thread: start from a random distance instead
+        st.rng = (reinterpret_cast<std::uintptr_t>(&st) ^ now_ms()) * 0x9E3779B97F4A7C15ull | 1;
+        st.countdown = sample_distance(st) - static_cast<std::int64_t>(std::min<std::size_t>(size, INT64_MAX));
+        if (st.countdown >= 0) return;
+    }
+    st.countdown = sample_distance(st);
+    st.busy = true;
+    void* frames[PROFILE_DEPTH];
+    std::size_t depth = os_backtrace(frames, PROFILE_DEPTH, 1); // from the entry point out
+    Chunk* c = chunk_of(p);
+    bool marked = false;
+    {
+        std::lock_guard<std::mutex> guard(profile_lock);
+        // an allocation resized in place keeps the sample it had
+        if (c && !sample_find(p)) {
+            std::uint32_t stack = stack_intern(frames, depth);
+            marked = stack != NO_STACK && sample_insert(p, size, stack);
+            if (marked) {
+                ++profile_stacks[stack].allocs;
+                profile_stacks[stack].alloc_bytes += size;
+            } else {
+                ++profile_dropped;
+            }
+        }
+    }
+    if (marked) set_sample_mark(c, p, true);
+    if (profile_dump_requested.load(std::memory_order_relaxed)) profile_dump_requested_now();
+    st.busy = false;
+}
+
+// Count an allocation of size bytes at p towards the calling thread's next
+// sample and pass it through
+static inline void* profile_alloc(void* p, std::size_t size) {
+    if (p && profile_on()) {
+        SampleState& st = sample_state;
+        st.countdown -= static_cast<std::int64_t>(std::min<std::size_t>(size, INT64_MAX));
+        if (st.countdown < 0) profile_sample(p, size);
+    }
+    return p;
+}
+
+// Free of marked allocation p of chunk c: drop its sample, if it is one
+static void profile_forget(Chunk* c, void* p) {
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> guard(profile_lock);
+        if (ProfileSample* e = profile_samples ? sample_find(p) : nullptr) {
+            sample_erase(e);
+            found = true;
+        }
+    }
+    // a run's count covers all of its slots
+    if (found || c->kind != ChunkKind::Slabs) set_sample_mark(c, p, false);
+}
+
+// A sample resized in place moved from old_p to new_p (its mark moved along)
+static void profile_move(void* old_p, void* new_p) {
+    std::lock_guard<std::mutex> guard(profile_lock);
+    ProfileSample* e = profile_samples ? sample_find(old_p) : nullptr;
+    if (!e) return;
+    ProfileSample moved = *e;
+    sample_erase(e);
+    sample_insert(new_p, moved.size, moved.stack);
+}
+
+// Drop the samples in the chunks of arena a, which are about to be unmapped
+static void profile_forget_arena(const HeapArena* a) {
+    std::lock_guard<std::mutex> guard(profile_lock);
+    if (!profile_live) return;
+    for (std::size_t i = 0; i < PROFILE_SAMPLES;) {
+        ProfileSample& e = profile_samples[i];
+        Chunk* c = e.ptr ? chunk_of(e.ptr) : nullptr;
+        if (c && c->arena == a) sample_erase(&e); // may shift another entry into i
+        else ++i;
+    }
+}
+
+// Text buffered on the stack and written straight to a file
+struct TextWriter {
+    int fd;
+    char buf[8192];
+    std::size_t n;
+    bool ok;
+
+    void put(const char* text) {
+        for (; *text; ++text) {
+            if (n == sizeof(buf)) flush();
+            buf[n++] = *text;
+        }
+    }
+    template <typename... Args>
+    void print(const char* fmt, Args... args) {
+        if (sizeof(buf) - n < 256) flush();
+        int k = std::snprintf(buf + n, sizeof(buf) - n, fmt, args...);
+        if (k > 0) n += std::min(static_cast<std::size_t>(k), sizeof(buf) - n - 1);
+    }
+    void flush() {
+        ok = os_write_all(fd, buf, n) && ok;
+        n = 0;
+    }
+};
+
+bool profile_start(std::size_t sample_bytes) {
+    std::lock_guard<std::mutex> guard(profile_lock);
+    if (profiling.load(std::memory_order_relaxed)) return false;
+    if (!profile_samples) {
+        std::size_t stacks = align_up(sizeof(ProfileStack) * PROFILE_STACKS, os_page_size());
+        std::size_t samples = align_up(sizeof(ProfileSample) * PROFILE_SAMPLES, os_page_size());
+        void* s = os_map_aligned(stacks, os_page_size());
+        void* t = s ? os_map_aligned(samples, os_page_size()) : nullptr;
+        if (!t) {
+            if (s) os_unmap(s, stacks);
+            return false;
+        }
+        note_commit(stacks + samples);
+        profile_stacks = static_cast<ProfileStack*>(s);
+        profile_samples = static_cast<ProfileSample*>(t);
+        // the unwinder may allocate on its first use
+        void* frame;
+        os_backtrace(&frame, 1, 0);
+    }
+    profile_rate.store(std::max<std::size_t>(sample_bytes, 1), std::memory_order_relaxed);
+    profiling.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void profile_stop() {
+    profiling.store(false, std::memory_order_relaxed);
+}
+
+// Legacy pprof heap profile: a header with the totals and the sampling
+// rate, a line per stack ("live: bytes [allocated: bytes] @ addresses"),
+// then the address space map pprof needs to symbolize the addresses
+bool profile_dump(const char* path) {
+    SampleState& st = sample_state;
+    bool busy = st.busy;
+    st.busy = true;
+    int fd = path ? os_create_file(path) : -1;
+    if (fd < 0) {
+        st.busy = busy;
+        return false;
+    }
+    TextWriter w{fd, {}, 0, true};
+    {
+        std::lock_guard<std::mutex> guard(profile_lock);
+        std::size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+        for (std::size_t i = 0; profile_stacks && i < PROFILE_STACKS; ++i) {
+            const ProfileStack& s = profile_stacks[i];
+            live += s.live;
+            live_bytes += s.live_bytes;
+            allocs += s.allocs;
+            alloc_bytes += s.alloc_bytes;
+        }
+        w.print("heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n", live, live_bytes, allocs, alloc_bytes,
+                profile_rate.load(std::memory_order_relaxed));
+        for (std::size_t i = 0; profile_stacks && i < PROFILE_STACKS; ++i) {
+            const ProfileStack& s = profile_stacks[i];
+            if (!s.allocs) continue;
+            w.print("%6zu: %8zu [%6zu: %8zu] @", s.live, s.live_bytes, s.allocs, s.alloc_bytes);
+            for (std::uint32_t k = 0; k < s.depth; ++k) {
+                w.print(" 0x%llx", static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(s.frames[k])));
+            }
+            w.put("\n");
+        }
+        if (profile_dropped) {
+            std::fprintf(stderr, "[mini_alloc] profile: %zu samples dropped, tables full\n", profile_dropped);
+        }
+    }
+    w.put("\nMAPPED_LIBRARIES:\n");
+    w.flush();
+    os_copy_file("/proc/self/maps", fd);
+    os_close_file(fd);
+    st.busy = busy;
+    return w.ok;
+}
+
+// A dump asked for by SIGUSR2, to path.1, path.2, ...
+static void profile_dump_requested_now() {
+    if (!profile_dump_requested.exchange(false, std::memory_order_relaxed) || !profile_path) return;
+    char path[4096];
+    std::snprintf(path, sizeof(path), "%s.%u", profile_path, profile_dumps.fetch_add(1) + 1);
+    profile_dump(path);
+}
+
+// MINI_ALLOC_PROFILE=path: profile from initialization on, dumping at exit
+// and on SIGUSR2 (unless the program handles that signal itself)
+static void profile_from_env() {
+    const char* path = std::getenv("MINI_ALLOC_PROFILE");
+    if (!path || !path[0]) return;
+    const char* rate = std::getenv("MINI_ALLOC_PROFILE_RATE");
+    if (!profile_start(rate ? std::strtoull(rate, nullptr, 10) : DEFAULT_PROFILE_RATE)) return;
+    profile_path = path;
+    std::atexit([] { profile_dump(profile_path); });
+#if !defined(_WIN32)
+    struct sigaction old {};
+    if (sigaction(SIGUSR2, nullptr, &old) == 0 && old.sa_handler == SIG_DFL) {
+        struct sigaction sa {};
+        sa.sa_handler = [](int) { profile_dump_requested.store(true, std::memory_order_relaxed); };
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &sa, nullptr);
+    }
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Hardened mode
+//
+// Chosen before the heap is initialized (set_hardened, MINI_ALLOC_HARDENED)
+// and fixed from then on. Every block and slab slot ends in a canary word
+// derived from its address, its tag (size and owner; the slot size for
+// slots) and a per-process secret, so both a write past the requested size
+// and a rewritten header show up on free. The slack between the requested
+// size and the canary is filled with a known byte, and its length kept in
+// the canary's top byte, so even a one-byte overflow is caught. Block and
+// slab chunks keep a bitmap with one bit per ALIGNMENT bytes, set while an
+// allocated payload starts there: free tests and clears it with one atomic
+// operation, which rejects interior, forged and repeated frees in O(1)
+// before the header is trusted. Freed memory then waits in a per-thread
+// FIFO quarantine with its first bytes poisoned; a poison that changed by
+// the time it is released for reuse means a use after free. Huge chunks are
+// checked by address only. Every error found aborts.
+// ---------------------------------------------------------------------------
+
+constexpr std::size_t CANARY_SIZE = sizeof(std::uint64_t);
+constexpr std::size_t POISON_MAX = 64; // bytes poisoned per quarantined free
+constexpr std::uint64_t POISON = 0xdfdfdfdfdfdfdfdfull;
+constexpr std::uint64_t SLACK_FILL = 0xcbcbcbcbcbcbcbcbull;
+constexpr std::size_t SLACK_MAX = 255; // slack bytes filled, at most
+
+// Bytes to allocate for a request of n: room for the canary when hardened
+static inline std::size_t with_canary(std::size_t n) {
+    if (!hardened) return n;
+    return n > std::numeric_limits<std::size_t>::max() - CANARY_SIZE ? n : n + CANARY_SIZE;
+}
+
+static inline std::uint64_t canary_of(const void* p, std::uint64_t bits) {
+    return (reinterpret_cast<std::uintptr_t>(p) ^ bits ^ canary_secret) * 0x9E3779B97F4A7C15ull;
+}
+
+// Last word of an allocation ending at end
+static inline std::uint64_t* canary_at(void* end) {
+    return reinterpret_cast<std::uint64_t*>(static_cast<char*>(end) - CANARY_SIZE);
+}
+
+static inline std::uint64_t block_canary(Block* b) {
+    return canary_of(b, tag_of(b) & ~(TAG_PREV_FREE | TAG_SAMPLED));
+}
+
+// Bits of a word holding its last n < 8 bytes in memory order
+static inline std::uint64_t tail_mask(std::size_t n) {
+    if (!n) return 0;
+    if constexpr (std::endian::native == std::endian::little) return ~std::uint64_t(0) << (64 - 8 * n);
+    else return ~std::uint64_t(0) >> (64 - 8 * n);
+}
+
+// End the allocation at end with canary, after slack bytes of filler; the
+// top byte of the canary (the last an overflow reaches on little-endian
+// targets) records how many
+static void write_canary(void* end, std::uint64_t canary, std::size_t slack) {
+    slack = std::min(slack, SLACK_MAX);
+    std::uint64_t* w = canary_at(end);
+    *w = canary ^ (std::uint64_t(slack) << 56);
+    std::size_t n = slack;
+    for (; n >= sizeof(std::uint64_t); n -= sizeof(std::uint64_t)) *--w = SLACK_FILL;
+    if (n) w[-1] = (w[-1] & ~tail_mask(n)) | (SLACK_FILL & tail_mask(n));
+}
+
+static bool canary_intact(void* end, std::uint64_t canary) {
+    std::uint64_t x = *canary_at(end) ^ canary;
+    if (x << 8) return false;
+    auto* w = canary_at(end);
+    std::size_t n = x >> 56;
+    for (; n >= sizeof(std::uint64_t); n -= sizeof(std::uint64_t)) {
+        if (*--w != SLACK_FILL) return false;
+    }
+    return !n || !((w[-1] ^ SLACK_FILL) & tail_mask(n));
+}
+
+static inline std::atomic<std::uint64_t>& live_word(Chunk* c, const void* p, std::uint64_t& bit) {
+    auto i = static_cast<std::size_t>(static_cast<const char*>(p) - reinterpret_cast<char*>(c)) / ALIGNMENT;
+    bit = std::uint64_t(1) << (i % 64);
+    return c->live[i / 64];
+}
+
+static inline void live_set(Chunk* c, const void* p) {
+    std::uint64_t bit;
+    live_word(c, p, bit).fetch_or(bit, std::memory_order_relaxed);
+}
+
+static inline bool live_test(Chunk* c, const void* p) {
+    std::uint64_t bit;
+    return live_word(c, p, bit).load(std::memory_order_relaxed) & bit;
+}
+
+// Clear p's bit, returning whether it was set
+static inline bool live_clear(Chunk* c, const void* p) {
+    std::uint64_t bit;
+    return live_word(c, p, bit).fetch_and(~bit, std::memory_order_relaxed) & bit;
+}
+
+// Write the canary and set the live bit of a block payload (arm_slot: a
+// slab slot of slot_size bytes) handed out for size bytes
+static void arm_block(void* p, std::size_t size) {
+    Block* b = payload_to_block(p);
+    write_canary(next_block(b), block_canary(b), payload_size(b) - CANARY_SIZE - size);
+    live_set(chunk_of(p), p);
+}
+
+static void arm_slot(void* p, std::size_t slot_size, std::size_t size) {
+    write_canary(static_cast<char*>(p) + slot_size, canary_of(p, slot_size), slot_size - CANARY_SIZE - size);
+    // slab chunks are a single CHUNK_ALIGN granule
+    live_set(reinterpret_cast<Chunk*>(reinterpret_cast<std::uintptr_t>(p) & ~(CHUNK_ALIGN - 1)), p);
+}
+
+[[noreturn]] static void hardened_abort(const char* what, const void* ptr) {
+    std::fprintf(stderr, "[mini_alloc] hardened: %s %p\n", what, ptr);
+    std::abort();
+}
+
+// Called after reporting a bad pointer: hardened mode stops right there
+static inline void heap_error() {
+    if (hardened) std::abort();
+}
+
+// Check the block or slab slot at ptr of chunk c and return its usable
+// size; with clear, also mark it no longer allocated. Once its live bit is
+// found set, ptr is known to start an allocation.
+static std::size_t hardened_check(Chunk* c, void* ptr, bool clear) {
+    if (!(clear ? live_clear(c, ptr) : live_test(c, ptr))) {
+        hardened_abort("invalid or double free of", ptr);
+    }
+    if (c->kind == ChunkKind::Slabs) {
+        std::size_t slot_size = slab_at(static_cast<SlabChunk*>(c), ptr)->slot_size;
+        if (!canary_intact(static_cast<char*>(ptr) + slot_size, canary_of(ptr, slot_size))) {
+            hardened_abort("overflow past the end of", ptr);
+        }
+        return slot_size - CANARY_SIZE;
+    }
+    Block* b = payload_to_block(ptr);
+    std::size_t size = block_size(b);
+    if (is_free(b) || size < MIN_BLOCK_SIZE ||
+        size > static_cast<std::size_t>(c->committed.load(std::memory_order_relaxed) - (char*)b)) {
+        hardened_abort("corrupted header of", ptr);
+    }
+    if (!canary_intact((char*)b + size, block_canary(b))) hardened_abort("overflow or corrupted header at", ptr);
+    return size - HEADER_SIZE - CANARY_SIZE;
+}
+
+// Hand an allocation that passed hardened_check back for reuse
+static void release_checked(Chunk* c, void* ptr) {
+    if (c->kind == ChunkKind::Slabs) {
+        slab_free(*c->arena, slab_at(static_cast<SlabChunk*>(c), ptr), static_cast<SlotLinks*>(ptr));
+    } else {
+        free_block(*c->arena, payload_to_block(ptr));
+    }
+}
+
+static void quarantine_evict(Quarantine& q) {
+    Quarantine::Entry e = q.entries[q.head];
+    q.head = (q.head + 1) % QUARANTINE_SLOTS;
+    --q.count;
+    q.bytes -= e.usable;
+    auto* words = static_cast<std::uint64_t*>(e.ptr);
+    for (std::size_t i = 0; i < std::min(e.usable, POISON_MAX) / sizeof(std::uint64_t); ++i) {
+        if (words[i] != POISON) hardened_abort("use after free of", e.ptr);
+    }
+    release_checked(e.chunk, e.ptr);
+}
+
+static void quarantine_flush(Quarantine& q) {
+    while (q.count) quarantine_evict(q);
+}
+
+// Poison a checked free and hold it back, releasing the oldest ones once
+// the quarantine is full (a Heap's memory can't wait: the Heap may be gone)
+static void quarantine_push(Chunk* c, void* ptr, std::size_t usable) {
+    ThreadCache* tc = c->arena->instance ? nullptr : get_tcache();
+    if (!tc) {
+        release_checked(c, ptr);
+        return;
+    }
+    Quarantine& q = tc->quarantine;
+    std::size_t limit = quarantine_bytes.load(std::memory_order_relaxed);
+    while (q.count && (q.count == QUARANTINE_SLOTS || q.bytes + usable > limit)) quarantine_evict(q);
+    if (usable > limit) {
+        release_checked(c, ptr);
+        return;
+    }
+    auto* words = static_cast<std::uint64_t*>(ptr);
+    for (std::size_t i = 0; i < std::min(usable, POISON_MAX) / sizeof(std::uint64_t); ++i) words[i] = POISON;
+    q.entries[(q.head + q.count) % QUARANTINE_SLOTS] = {ptr, c, usable};
+    ++q.count;
+    q.bytes += usable;
+}
+
+bool set_hardened(bool on) {
+    std::lock_guard<std::mutex> guard(init_lock);
+    if (initialized.load(std::memory_order_relaxed)) return hardened == on;
+    hardened_requested = on;
+    return true;
+}
+
+void set_quarantine_size(std::size_t bytes) {
+    quarantine_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+
+// Count a fresh allocation (if any) of size bytes, arm it when hardened
+// and pass it through
+static inline void* counted_block(void* p, std::size_t size) {
+    if (p) {
+        count_allocs(payload_size(payload_to_block(p)));
+        if (hardened) arm_block(p, size);
+    }
+    return p;
+}
+
+static inline void* counted_huge(void* p) {
+    if (p) count_allocs(huge_usable_size(chunk_of(p)));
+    return p;
+}
+
+// Slots come from the bin of their own class (see slab_cache_push), so
+// size gives the slot size
+static inline void* counted_slot(void* p, std::size_t size) {
+    if (p) {
+        std::size_t slot_size = (slab_class(with_canary(size)) + 1) * ALIGNMENT;
+        count_allocs(slot_size);
+        if (hardened) arm_slot(p, slot_size, size);
+    }
+    return p;
+}
+
+static void* malloc_impl(std::size_t size) {
+    if (size == 0) return nullptr;
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+    std::size_t need = with_canary(size);
+    if (need <= SLAB_MAX_SIZE) return counted_slot(slab_malloc(need), size);
+    if (size >= huge_threshold.load(std::memory_order_relaxed)) return counted_huge(huge_alloc(size));
+
+    std::size_t asize = block_size_for(need);
+    if (!asize) return nullptr;
+
+    if (asize <= TCACHE_MAX_SIZE) {
+        if (ThreadCache* tc = get_tcache()) return counted_block(tcache_malloc(tc, asize), size);
+    }
+
+    return counted_block(block_to_payload(with_arenas([&](HeapArena& a) { return arena_alloc(a, asize); })), size);
+}
+
+// Allocate from the arenas of node, bypassing the thread caches (whose
+// contents may come from anywhere); NUMA mode only
+static void* node_malloc(std::size_t size, int node) {
+    if (size == 0) return nullptr;
+    std::size_t need = with_canary(size);
+    if (need > SLAB_MAX_SIZE && size >= huge_threshold.load(std::memory_order_relaxed)) {
+        return counted_huge(huge_alloc(size, ALIGNMENT, node));
+    }
+    std::size_t asize = need <= SLAB_MAX_SIZE ? 0 : block_size_for(need);
+    if (need > SLAB_MAX_SIZE && !asize) return nullptr;
+
+    std::size_t first = static_cast<std::size_t>(node) * numa_per_node;
+    for (std::size_t k = 0; k < numa_per_node; ++k) {
+        HeapArena& a = arenas[first + k];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (!asize) {
+            std::uint32_t got;
+            if (SlotLinks* slot = arena_slab_refill(a, slab_class(need), 1, got)) {
+                slot->key = nullptr;
+                return counted_slot(slot, size);
+            }
+        } else if (Block* b = arena_alloc(a, asize)) {
+            return counted_block(block_to_payload(b), size);
+        }
+    }
+    return nullptr;
+}
+
+// Allocate bypassing the thread caches, reporting which payload bytes may
+// be non-zero
+static void* malloc_fresh(std::size_t size, DirtyRange* dirty) {
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+    std::size_t asize = block_size_for(with_canary(size));
+    if (!asize) return nullptr;
+    return counted_block(block_to_payload(with_arenas([&](HeapArena& a) { return arena_alloc(a, asize, dirty); })), size);
+}
+
+// A Heap's own count of an allocation of usable bytes
+static inline void count_instance(HeapInstance& h, std::size_t usable) {
+    h.allocs.fetch_add(1, std::memory_order_relaxed);
+    h.class_allocs[stats_class(usable)].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Allocate from the arena of a Heap: no thread cache and no huge chunks,
+// everything is carved from the Heap's own chunks. If dirty is given and
+// the result is a block, it receives which payload bytes may be non-zero.
+static void* instance_malloc(HeapArena& a, std::size_t size, std::size_t alignment = ALIGNMENT,
+                             DirtyRange* dirty = nullptr) {
+    if (size == 0) return nullptr;
+    std::size_t need = with_canary(size);
+    if (need <= SLAB_MAX_SIZE && alignment <= ALIGNMENT) {
+        std::uint32_t got;
+        std::lock_guard<std::mutex> guard(a.lock);
+        SlotLinks* slot = arena_slab_refill(a, slab_class(need), 1, got);
+        if (!slot) return nullptr;
+        slot->key = nullptr;
+        count_instance(*a.instance, (slab_class(need) + 1) * ALIGNMENT);
+        return counted_slot(slot, size);
+    }
+    std::size_t asize = block_size_for(need);
+    if (!asize) return nullptr;
+    std::lock_guard<std::mutex> guard(a.lock);
+    Block* b = alignment > ALIGNMENT ? arena_alloc_aligned(a, asize, alignment) : arena_alloc(a, asize, dirty);
+    if (!b) return nullptr;
+    count_instance(*a.instance, payload_size(b));
+    return counted_block(block_to_payload(b), size);
+}
+
+// Where a realloc that moves memory of arena a (nullptr for huge chunks)
+// gets the new block: memory of a Heap stays in that Heap. It takes room
+// bytes (the caller's growth hint) if it can, else size.
+static void* realloc_target(HeapArena* a, std::size_t size, std::size_t room) {
+    auto alloc = [a](std::size_t n) { return a && a->instance ? instance_malloc(*a, n) : malloc_impl(n); };
+    void* p = alloc(room);
+    if (!p && room > size) p = alloc(size);
+    return p;
+}
+
+static void free_impl(void* ptr) {
+    // 1) free(nullptr) must be safe
+    if (!ptr) return;
+
+    // 2) check if pointer is inside one of our chunks
+    Chunk* c = chunk_of(ptr);
+    if (!c) {
+        std::fprintf(stderr, "[mini_alloc] free: pointer %p not from heap\n", ptr);
+        heap_error();
+        return;
+    }
+    HeapArena* a = c->arena;
+
+    // 3) huge chunks are unmapped, slab slots go back to their slab
+    if (c->kind == ChunkKind::Huge) {
+        if (ptr != huge_payload(c)) {
+            std::fprintf(stderr, "[mini_alloc] free: invalid huge pointer %p\n", ptr);
+            heap_error();
+            return;
+        }
+        if (c->sampled) profile_forget(c, ptr);
+        count_frees(huge_usable_size(c));
+        huge_free(c);
+        return;
+    }
+    if (hardened) {
+        // the live bitmap stands in for the checks below
+        std::size_t usable = hardened_check(c, ptr, true);
+        if (has_sample_mark(c, ptr)) profile_forget(c, ptr);
+        count_frees(usable + CANARY_SIZE);
+        quarantine_push(c, ptr, usable);
+        return;
+    }
+    if (c->kind == ChunkKind::Slabs) {
+        Slab* s = slab_lookup(static_cast<SlabChunk*>(c), ptr);
+        if (!s) {
+            std::fprintf(stderr, "[mini_alloc] free: invalid slab slot %p\n", ptr);
+            heap_error();
+            return;
+        }
+        auto* slot = static_cast<SlotLinks*>(ptr);
+        if (slot->key == tcache_key) {
+            std::fprintf(stderr, "[mini_alloc] warning: double free of %p\n", ptr);
+            return;
+        }
+        if (s->sampled.load(std::memory_order_relaxed)) profile_forget(c, ptr);
+        count_frees(s->slot_size);
+        slab_free(*a, s, slot);
+        return;
+    }
+
+    // 4) payload -> block header
+    Block* b = payload_to_block(ptr);
+
+    // 5) sanity check: header must lie inside the chunk's block chain
+    if ((char*)b < (char*)c->head || (char*)b >= c->committed.load(std::memory_order_relaxed)) {
+        std::fprintf(stderr, "[mini_alloc] free: invalid block header for %p\n", ptr);
+        heap_error();
+        return;
+    }
+
+    // 6) detect double free
+    if (is_free(b) || is_cached(b)) {
+        std::fprintf(stderr, "[mini_alloc] warning: double free of %p\n", ptr);
+        return;
+    }
+
+    // 7) back to the owning thread cache, or mark free and coalesce
+    if (tag_of(b) & TAG_SAMPLED) profile_forget(c, ptr);
+    count_frees(payload_size(b));
+    free_block(*a, b);
+}
+
+void free_sized(void* ptr, std::size_t size) {
+    // a slab slot of a size the caller vouches for goes straight into the
+    // bin of its own class, skipping the slot checks; the slot may be
+    // larger than size after a shrinking realloc, so size is only a hint
+    // (in hardened mode slots take the full path, as do the runs holding
+    // profiler samples)
+    if (!hardened && ptr && size && size <= SLAB_MAX_SIZE) {
+        Chunk* c = chunk_of(ptr);
+        ThreadCache* tc = c && c->kind == ChunkKind::Slabs && !c->arena->instance && node_local(*c->arena) &&
+                                  !slab_at(static_cast<SlabChunk*>(c), ptr)->sampled.load(std::memory_order_relaxed)
+                              ? get_tcache()
+                              : nullptr;
+        if (tc) {
+            auto* slot = static_cast<SlotLinks*>(ptr);
+            if (slot->key == tcache_key) {
+                std::fprintf(stderr, "[mini_alloc] warning: double free of %p\n", ptr);
+                return;
+            }
+            if (trace_on()) trace_record(TraceOp::Free, ptr, 0, 0);
+            std::size_t slot_size = slab_at(static_cast<SlabChunk*>(c), ptr)->slot_size;
+            count_frees(slot_size);
+            slab_cache_push(tc, slab_class(slot_size), slot);
+            return;
+        }
+    }
+    free(ptr);
+}
+
+static std::size_t malloc_batch_impl(std::size_t size, std::size_t count, void** out) {
+    if (size == 0 || count == 0) return 0;
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+    std::size_t done = 0;
+    std::size_t need = with_canary(size);
+
+    if (need <= SLAB_MAX_SIZE) {
+        // whatever the thread cache holds, then whole runs of slots at once
+        std::size_t cls = slab_class(need);
+        ThreadCache* tc = get_tcache();
+        if (tc) {
+            SlotBin& bin = tc->slab_bins[cls];
+            while (done < count && bin.head) {
+                SlotLinks* slot = bin.head;
+                bin.head = slot->next;
+                --bin.count;
+                slot->key = nullptr;
+                out[done++] = slot;
+            }
+        }
+        while (done < count) {
+            auto want = static_cast<std::uint32_t>(std::min<std::size_t>(count - done, UINT32_MAX));
+            std::uint32_t got = 0;
+            SlotLinks* chain = with_arenas([&](HeapArena& a) {
+                return tc ? arena_slab_refill(a, cls, want, got, tc->id, &tc->slab_bins[cls].run)
+                          : arena_slab_refill(a, cls, want, got);
+            });
+            if (!chain) break;
+            for (; chain; chain = chain->next) {
+                chain->key = nullptr;
+                out[done++] = chain;
+            }
+        }
+        if (done) count_allocs((cls + 1) * ALIGNMENT, done);
+        if (hardened) {
+            for (std::size_t i = 0; i < done; ++i) arm_slot(out[i], (cls + 1) * ALIGNMENT, size);
+        }
+        return done;
+    }
+
+    if (size >= huge_threshold.load(std::memory_order_relaxed)) {
+        for (; done < count; ++done) {
+            if (!(out[done] = counted_huge(huge_alloc(size)))) break;
+        }
+        return done;
+    }
+
+    std::size_t asize = block_size_for(need);
+    if (!asize) return 0;
+    while (done < count) {
+        std::size_t got = 0;
+        with_arenas([&](HeapArena& a) { return got = arena_carve(a, asize, count - done, out + done); });
+        if (!got) break;
+        for (std::size_t i = done; i < done + got; ++i) counted_block(out[i], size);
+        done += got;
+    }
+    return done;
+}
+
+std::size_t malloc_batch(std::size_t size, std::size_t count, void** out) {
+    std::size_t done = malloc_batch_impl(size, count, out);
+    if (trace_on()) {
+        for (std::size_t i = 0; i < done; ++i) trace_record(TraceOp::Malloc, out[i], 0, size);
+    }
+    for (std::size_t i = 0; i < done; ++i) profile_alloc(out[i], size);
+    return done;
+}
+
+void free_batch(void** ptrs, std::size_t count) {
+    // in address order, physically adjacent blocks form runs that are
+    // released (and coalesced) as one block
+    std::sort(ptrs, ptrs + count, std::less<void*>());
+    if (hardened) {
+        // every pointer is checked and quarantined on its own, so a
+        // duplicate aborts like any other double free
+        for (std::size_t i = 0; i < count; ++i) {
+            if (trace_on() && ptrs[i]) trace_record(TraceOp::Free, ptrs[i], 0, 0);
+            free_impl(ptrs[i]);
+        }
+        return;
+    }
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (n && ptrs[i] == ptrs[n - 1]) {
+            std::fprintf(stderr, "[mini_alloc] warning: double free of %p\n", ptrs[i]);
+            continue;
+        }
+        ptrs[n++] = ptrs[i];
+    }
+    count = n;
+    if (trace_on()) {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (ptrs[i]) trace_record(TraceOp::Free, ptrs[i], 0, 0);
+        }
+    }
+
+    HeapArena* locked = nullptr;
+    auto unlock = [&] {
+        if (locked) locked->lock.unlock();
+        locked = nullptr;
+    };
+
+    for (std::size_t i = 0; i < count;) {
+        void* ptr = ptrs[i++];
+        if (!ptr) continue;
+        Chunk* c = chunk_of(ptr);
+        Block* b = payload_to_block(ptr);
+        // slab slots, huge chunks, profiler samples and anything suspicious
+        // take the single path
+        if (!c || c->kind != ChunkKind::Blocks || (char*)b < (char*)c->head ||
+            (char*)b >= c->committed.load(std::memory_order_relaxed) || is_free(b) || is_cached(b) ||
+            (tag_of(b) & TAG_SAMPLED)) {
+            unlock();
+            free_impl(ptr);
+            continue;
+        }
+        if (c->arena != locked) {
+            unlock();
+            c->arena->lock.lock();
+            locked = c->arena;
+        }
+
+        std::size_t size = block_size(b);
+        count_frees(size - HEADER_SIZE);
+        for (Block* nb = next_block(b); i < count && ptrs[i] == block_to_payload(nb); nb = next_block(nb)) {
+            if (is_free(nb) || is_cached(nb) || (tag_of(nb) & TAG_SAMPLED)) break;
+            count_frees(payload_size(nb));
+            size += block_size(nb);
+            ++i;
+        }
+        set_tag(b, size | (tag_of(b) & TAG_PREV_FREE));
+        release_block(*locked, b);
+    }
+    unlock();
+}
+
+void set_purge_decay(long decay_ms) {
+    purge_decay_ms.store(decay_ms, std::memory_order_relaxed);
+}
+
+void set_huge_threshold(std::size_t bytes) {
+    huge_threshold.store(bytes, std::memory_order_relaxed);
+}
+
+void set_huge_pages(HugePages pages) {
+    huge_pages.store(pages, std::memory_order_relaxed);
+}
+
+void set_placement(Placement policy) {
+    placement.store(policy, std::memory_order_relaxed);
+}
+
+void set_realtime(bool on) {
+    realtime.store(on, std::memory_order_relaxed);
+    set_placement(on ? Placement::GoodFit : Placement::BestFit);
+}
+
+void purge() {
+    if (!initialized.load(std::memory_order_acquire)) return;
+    for (std::size_t i = 0; i < arena_count; ++i) {
+        HeapArena& a = arenas[i];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (a.ready.load(std::memory_order_relaxed)) arena_purge(a, now_ms(), 0);
+    }
+}
+
+
+static void* aligned_alloc_impl(std::size_t alignment, std::size_t size) {
+    if (!alignment || !std::has_single_bit(alignment)) return nullptr;
+    if (alignment <= ALIGNMENT) return malloc_impl(size);
+    if (size == 0) return nullptr;
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+
+    // large alignments are cheaper as an offset into a mapping of their own
+    if (size >= huge_threshold.load(std::memory_order_relaxed) ||
+        alignment >= huge_threshold.load(std::memory_order_relaxed)) {
+        return counted_huge(huge_alloc(size, alignment));
+    }
+    std::size_t asize = block_size_for(with_canary(size));
+    if (!asize) return nullptr;
+    return counted_block(block_to_payload(with_arenas([&](HeapArena& a) { return arena_alloc_aligned(a, asize, alignment); })), size);
+}
+
+int posix_memalign(void** memptr, std::size_t alignment, std::size_t size) {
+    if (!std::has_single_bit(alignment) || alignment % sizeof(void*)) return EINVAL;
+    if (size == 0) {
+        *memptr = nullptr;
+        return 0;
+    }
+    void* p = aligned_alloc(alignment, size);
+    if (!p) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+// hint: capacity the caller expects to grow to, reserved when the block has
+// to grow or move anyway
+static void* realloc_impl(void* ptr, std::size_t new_size, std::size_t hint = 0) {
+    std::size_t room = std::max(new_size, hint);
+    if (!ptr) return malloc_impl(room);
+    if (new_size == 0) {
+        free_impl(ptr);
+        return nullptr;
+    }
+    Chunk* c = chunk_of(ptr);
+    if (!c) {
+        std::fprintf(stderr, "[mini_alloc] realloc: pointer %p not from heap\n", ptr);
+        heap_error();
+        return nullptr;
+    }
+    if (c->kind == ChunkKind::Huge) {
+        if (ptr != huge_payload(c)) {
+            std::fprintf(stderr, "[mini_alloc] realloc: invalid huge pointer %p\n", ptr);
+            heap_error();
+            return nullptr;
+        }
+        // stay huge and move pages; below the threshold, copy into the heap
+        std::size_t usable = huge_usable_size(c);
+        if (new_size >= huge_threshold.load(std::memory_order_relaxed)) {
+            bool was_sampled = c->sampled;
+            if (void* q = huge_resize(c, room)) {
+                count_realloc(usable, huge_usable_size(chunk_of(q)));
+                if (was_sampled && q != ptr) profile_move(ptr, q);
+                return q;
+            }
+        }
+        void* newp = realloc_target(c->arena, new_size, room);
+        if (!newp) return nullptr;
+        std::memcpy(newp, ptr, std::min(usable, new_size));
+        free_impl(ptr);
+        return newp;
+    }
+    if (c->kind == ChunkKind::Slabs) {
+        Slab* s = slab_lookup(static_cast<SlabChunk*>(c), ptr);
+        if (!s) {
+            std::fprintf(stderr, "[mini_alloc] realloc: invalid slab slot %p\n", ptr);
+            heap_error();
+            return nullptr;
+        }
+        std::size_t slot_size = s->slot_size;
+        std::size_t usable = hardened ? hardened_check(c, ptr, false) : slot_size;
+        if (new_size <= usable) {
+            count_realloc(slot_size, slot_size);
+            if (c->arena->instance) count_instance(*c->arena->instance, slot_size);
+            if (hardened) arm_slot(ptr, slot_size, new_size);
+            return ptr;
+        }
+        void* newp = realloc_target(c->arena, new_size, room);
+        if (!newp) return nullptr;
+        std::memcpy(newp, ptr, usable);
+        free_impl(ptr);
+        return newp;
+    }
+    HeapArena* a = c->arena;
+    Block* b = payload_to_block(ptr);
+    std::size_t asize = block_size_for(with_canary(new_size));
+    if (!asize) return nullptr;
+
+    std::size_t old_usable = payload_size(b);
+    std::size_t copy = hardened ? hardened_check(c, ptr, false) : old_usable;
+    std::size_t aroom = room > new_size ? block_size_for(with_canary(room)) : asize;
+    std::unique_lock<std::mutex> guard(a->lock);
+    bool was_sampled = tag_of(b) & TAG_SAMPLED;
+    Block* r = aroom > asize && block_size(b) < asize ? resize_block(*a, c, b, aroom) : nullptr;
+    if (!r) r = resize_block(*a, c, b, asize);
+    if (r) {
+        std::size_t new_usable = payload_size(r);
+        if (a->instance) count_instance(*a->instance, new_usable);
+        guard.unlock();
+        if (was_sampled && r != b) profile_move(ptr, block_to_payload(r));
+        count_realloc(old_usable, new_usable);
+        if (hardened) {
+            live_clear(c, ptr);
+            arm_block(block_to_payload(r), new_size);
+        }
+        return block_to_payload(r);
+    }
+    guard.unlock();
+
+    void* newp = realloc_target(a, new_size, room);
+    if (!newp) return nullptr;
+    std::memcpy(newp, ptr, std::min(copy, new_size));
+    free_impl(ptr);
+    return newp;
+}
+
+// Zero the first total bytes of freshly carved block payload p
+static void clear_dirty(void* p, std::size_t total, const DirtyRange& dirty) {
+    char* bytes = static_cast<char*>(p);
+    std::memset(bytes, 0, std::min(dirty.prefix, total));
+    std::size_t usable = payload_size(payload_to_block(p));
+    if (dirty.tail && usable - dirty.tail < total) {
+        std::memset(bytes + usable - dirty.tail, 0, total - (usable - dirty.tail));
+    }
+}
+
+static void* calloc_impl(std::size_t nmemb, std::size_t size) {
+    if (nmemb == 0 || size == 0) return nullptr;
+    if (nmemb > std::numeric_limits<std::size_t>::max() / size) return nullptr;
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+    std::size_t total = nmemb * size;
+
+    // huge chunks are fresh mappings and already zero
+    if (total >= huge_threshold.load(std::memory_order_relaxed) && total > SLAB_MAX_SIZE) {
+        return counted_huge(huge_alloc(total));
+    }
+
+    // small requests come from the thread caches and are cheap to clear
+    if (block_size_for(total) <= TCACHE_MAX_SIZE) {
+        void* p = malloc_impl(total);
+        if (p) std::memset(p, 0, total);
+        return p;
+    }
+
+    // otherwise only clear what may have been written before: memory past
+    // the chunk's touched mark was freshly committed and is still zero
+    DirtyRange dirty{};
+    void* p = malloc_fresh(total, &dirty);
+    if (p) clear_dirty(p, total, dirty);
+    return p;
+}
+
+// Traced and profiled entry points. Frees are recorded before the memory
+// can be reused, allocations once their address is known.
+void* malloc(std::size_t size) {
+    void* p = malloc_impl(size);
+    if (trace_on()) trace_record(TraceOp::Malloc, p, 0, size);
+    return profile_alloc(p, size);
+}
+
+void* malloc_on_node(std::size_t size, int node) {
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+    if (node < 0 || static_cast<std::size_t>(node) >= numa_nodes) return nullptr;
+    void* p = numa_nodes > 1 ? node_malloc(size, node) : malloc_impl(size);
+    if (trace_on()) trace_record(TraceOp::Malloc, p, 0, size);
+    return profile_alloc(p, size);
+}
+
+void free(void* ptr) {
+    if (ptr && trace_on()) trace_record(TraceOp::Free, ptr, 0, 0);
+    free_impl(ptr);
+}
+
+void* realloc(void* ptr, std::size_t new_size) {
+    void* p = realloc_impl(ptr, new_size);
+    if (trace_on()) trace_record(TraceOp::Realloc, p, reinterpret_cast<std::uintptr_t>(ptr), new_size);
+    return profile_alloc(p, new_size);
+}
+
+void* realloc_hint(void* ptr, std::size_t new_size, std::size_t capacity_hint, std::size_t* usable) {
+    void* p = realloc_impl(ptr, new_size, capacity_hint);
+    if (trace_on()) trace_record(TraceOp::Realloc, p, reinterpret_cast<std::uintptr_t>(ptr), new_size);
+    if (usable) *usable = malloc_usable_size(p);
+    return profile_alloc(p, new_size);
+}
+
+void* calloc(std::size_t nmemb, std::size_t size) {
+    void* p = calloc_impl(nmemb, size);
+    if (trace_on()) trace_record(TraceOp::Calloc, p, 0, p ? nmemb * size : 0);
+    return profile_alloc(p, p ? nmemb * size : 0);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size) {
+    void* p = aligned_alloc_impl(alignment, size);
+    if (trace_on()) trace_record(TraceOp::AlignedAlloc, p, alignment, size);
+    return profile_alloc(p, size);
+}
+
+std::size_t malloc_usable_size(void* ptr) {
+    if (!ptr) return 0;
+    Chunk* c = chunk_of(ptr);
+    if (!c || (c->kind == ChunkKind::Huge && ptr != huge_payload(c))) {
+        std::fprintf(stderr, "[mini_alloc] malloc_usable_size: pointer %p not from heap\n", ptr);
+        heap_error();
+        return 0;
+    }
+    if (c->kind == ChunkKind::Huge) return huge_usable_size(c);
+    if (hardened) {
+        // the caller may use all of it from now on: drop the slack filler in
+        // front of the canary
+        std::size_t usable = hardened_check(c, ptr, false);
+        if (c->kind == ChunkKind::Slabs) {
+            std::size_t slot_size = slab_at(static_cast<SlabChunk*>(c), ptr)->slot_size;
+            write_canary(static_cast<char*>(ptr) + slot_size, canary_of(ptr, slot_size), 0);
+        } else {
+            Block* b = payload_to_block(ptr);
+            write_canary(next_block(b), block_canary(b), 0);
+        }
+        return usable;
+    }
+    if (c->kind == ChunkKind::Slabs) {
+        Slab* s = slab_lookup(static_cast<SlabChunk*>(c), ptr);
+        if (!s) {
+            std::fprintf(stderr, "[mini_alloc] malloc_usable_size: invalid slab slot %p\n", ptr);
+            return 0;
+        }
+        return s->slot_size;
+    }
+    return payload_size(payload_to_block(ptr));
+}
+
+void* malloc_flags(std::size_t size, unsigned flags) {
+    if (!(flags & MINI_ALLOC_CACHELINE)) return malloc(size);
+    if (size > std::numeric_limits<std::size_t>::max() - CACHE_LINE) return nullptr;
+    std::size_t lines = align_up(std::max<std::size_t>(size, 1), CACHE_LINE);
+    void* p = aligned_alloc_impl(CACHE_LINE, lines);
+    if (trace_on()) trace_record(TraceOp::AlignedAlloc, p, CACHE_LINE, lines);
+    return profile_alloc(p, lines);
+}
+
+Stats get_stats() {
+    Stats st{};
+    auto add = [](std::size_t& to, const std::atomic<std::size_t>& from) {
+        to += from.load(std::memory_order_relaxed);
+    };
+    std::size_t alloc_bytes = 0, free_bytes = 0;
+    std::size_t class_frees[NUM_CLASSES] = {};
+    auto sum = [&](const ThreadStats& t) {
+        add(alloc_bytes, t.alloc_bytes);
+        add(free_bytes, t.free_bytes);
+        add(st.allocations, t.allocs);
+        add(st.frees, t.frees);
+        for (std::size_t i = 0; i < NUM_CLASSES; ++i) {
+            add(st.class_allocations[i], t.class_allocs[i]);
+            add(class_frees[i], t.class_frees[i]);
+        }
+    };
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        sum(retired_stats);
+        for (const CacheSlot& slot : cache_slots) {
+            if (slot.alive) sum(slot.stats);
+        }
+    }
+    // a thread may free what another allocated, so only the totals balance
+    st.bytes_allocated = alloc_bytes - free_bytes;
+    for (std::size_t i = 0; i < NUM_CLASSES; ++i) st.class_live[i] = st.class_allocations[i] - class_frees[i];
+
+    if (initialized.load(std::memory_order_acquire)) {
+        for (std::size_t i = 0; i < arena_count; ++i) {
+            HeapArena& a = arenas[i];
+            std::lock_guard<std::mutex> guard(a.lock);
+            st.bytes_free += a.free_bytes;
+            for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+                for (const Slab& s : sc->slabs) {
+                    if (s.slot_size) st.bytes_free += std::size_t(s.capacity - s.used) * s.slot_size;
+                }
+            }
+        }
+    }
+    st.bytes_committed = committed_bytes.load(std::memory_order_relaxed);
+    st.peak_committed = peak_committed.load(std::memory_order_relaxed);
+    return st;
+}
+
+void dump_heap() {
+    if (!initialized.load(std::memory_order_acquire)) {
+        std::puts("[mini_alloc] heap not initialized");
+        return;
+    }
+    for (std::size_t i = 0; i < arena_count; ++i) {
+        HeapArena& a = arenas[i];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (!a.ready.load(std::memory_order_relaxed)) continue;
+        for (Chunk* c = a.chunks; c; c = c->next) {
+            std::printf("mini_alloc: arena[%zu] chunk=%p reserved=%zu committed=%zu bytes\n",
+                        i, (void*)c, c->size,
+                        static_cast<std::size_t>(c->committed.load(std::memory_order_relaxed) - (char*)c));
+            std::size_t idx = 0;
+            for (Block* b = c->head; block_size(b); b = next_block(b), ++idx) {
+                std::printf(" block[%zu] hdr=%p payload=%p size=%zu free=%s\n",
+                            idx,
+                            (void*)b,
+                            block_to_payload(b),
+                            payload_size(b),
+                            is_free(b) ? "YES" : (is_cached(b) ? "CACHED" : "NO"));
+            }
+        }
+        for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+            std::printf("mini_alloc: arena[%zu] slab chunk=%p\n", i, (void*)sc);
+            for (std::size_t r = 0; r < SLAB_RUNS; ++r) {
+                const Slab& s = sc->slabs[r];
+                if (!s.slot_size) continue;
+                std::printf(" slab[%zu] start=%p slot=%u used=%u/%u\n",
+                            r, (void*)s.start, static_cast<unsigned>(s.slot_size),
+                            static_cast<unsigned>(s.used), static_cast<unsigned>(s.capacity));
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Heap analysis
+//
+// The walks below hold each arena lock in turn while they write, so the
+// stream must not need to allocate: each function writes its first bytes
+// before taking a lock, which makes stdio set up the stream's buffer.
+// ---------------------------------------------------------------------------
+
+enum class BlockState : std::uint64_t { Used = 0, Free = 1, Cached = 2 };
+
+static BlockState block_state(Block* b) {
+    if (is_free(b)) return BlockState::Free;
+    return is_cached(b) ? BlockState::Cached : BlockState::Used;
+}
+
+static const char* block_state_name(BlockState st) {
+    switch (st) {
+    case BlockState::Free: return "free";
+    case BlockState::Cached: return "cached";
+    default: return "used";
+    }
+}
+
+// Add the chunks of arena a to r; a.lock held
+static void report_arena(HeapArena& a, HeapReport& r) {
+    for (Chunk* c = a.chunks; c; c = c->next) {
+        ++r.chunks;
+        r.heap_bytes += static_cast<std::size_t>(c->committed.load(std::memory_order_relaxed) - (char*)c->head);
+        for (Block* b = c->head;; b = next_block(b)) {
+            std::size_t size = block_size(b);
+            r.header_bytes += HEADER_SIZE;
+            if (!size) break; // sentinel
+            switch (block_state(b)) {
+            case BlockState::Free:
+                ++r.free_blocks;
+                r.free_bytes += size;
+                r.largest_free_block = std::max(r.largest_free_block, size);
+                ++r.free_blocks_by_log2[std::bit_width(size) - 1];
+                break;
+            case BlockState::Cached:
+                ++r.cached_blocks;
+                r.cached_bytes += size;
+                break;
+            case BlockState::Used:
+                ++r.used_blocks;
+                r.used_bytes += size;
+                break;
+            }
+        }
+    }
+    for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+        for (const Slab& s : sc->slabs) {
+            if (!s.slot_size) continue;
+            r.slab_bytes += std::size_t(s.capacity) * s.slot_size;
+            r.slab_free_bytes += std::size_t(s.capacity - s.used) * s.slot_size;
+        }
+    }
+}
+
+static void report_ratios(HeapReport& r) {
+    if (r.free_bytes) r.external_fragmentation = 1.0 - double(r.largest_free_block) / double(r.free_bytes);
+    if (r.heap_bytes) r.header_overhead_percent = 100.0 * double(r.header_bytes) / double(r.heap_bytes);
+}
+
+HeapReport heap_report() {
+    HeapReport r{};
+    if (!initialized.load(std::memory_order_acquire)) return r;
+    for (std::size_t i = 0; i < arena_count; ++i) {
+        HeapArena& a = arenas[i];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (a.ready.load(std::memory_order_relaxed)) report_arena(a, r);
+    }
+    report_ratios(r);
+    return r;
+}
+
+// ---------------------------------------------------------------------------
+// Consistency check
+// ---------------------------------------------------------------------------
+
+static bool check_failed(std::size_t arena, const char* what, const void* where) {
+    std::fprintf(stderr, "[mini_alloc] check_heap: arena %zu: %s at %p\n", arena, what, where);
+    return false;
+}
+
+// Nodes of the treap under t, all large free blocks in (size, address)
+// order strictly between lo and hi; SIZE_MAX if they are not
+static std::size_t check_tree(Block* t, Block* lo, Block* hi, std::size_t depth) {
+    if (!t) return 0;
+    if (depth > 128 || !is_free(t) || size_class(block_size(t)) < NUM_SMALL_CLASSES ||
+        (lo && !tree_before(lo, t)) || (hi && !tree_before(t, hi))) {
+        return SIZE_MAX;
+    }
+    std::size_t l = check_tree(tree_links(t)->left, lo, t, depth + 1);
+    std::size_t r = check_tree(tree_links(t)->right, t, hi, depth + 1);
+    return l == SIZE_MAX || r == SIZE_MAX ? SIZE_MAX : l + r + 1;
+}
+
+// Walk the block chains, free lists and slabs of arena a (index i); a.lock held
+static bool check_arena(HeapArena& a, std::size_t i) {
+    std::size_t free_blocks = 0, free_bytes = 0, large_blocks = 0;
+    for (Chunk* c = a.chunks; c; c = c->next) {
+        if (c->arena != &a || chunk_of(c) != c) return check_failed(i, "chunk not registered", c);
+        Block* sentinel = chunk_sentinel(c);
+        if (reinterpret_cast<char*>(sentinel) >= reinterpret_cast<char*>(c) + c->size) {
+            return check_failed(i, "committed past the reservation", c);
+        }
+        bool prev_free = false;
+        Block* b = c->head;
+        while (b != sentinel) {
+            std::size_t size = block_size(b);
+            if (b > sentinel || size < MIN_BLOCK_SIZE ||
+                size > static_cast<std::size_t>(reinterpret_cast<char*>(sentinel) - reinterpret_cast<char*>(b))) {
+                return check_failed(i, "block size out of range", b);
+            }
+            if (is_prev_free(b) != prev_free) return check_failed(i, "TAG_PREV_FREE disagrees with predecessor", b);
+            if (is_free(b)) {
+                if (prev_free) return check_failed(i, "adjacent free blocks not coalesced", b);
+                if (*footer(b) != size) return check_failed(i, "free block footer mismatch", b);
+                ++free_blocks;
+                free_bytes += size;
+                if (size_class(size) >= NUM_SMALL_CLASSES) ++large_blocks;
+            }
+            prev_free = is_free(b);
+            b = next_block(b);
+        }
+        if (block_size(sentinel) || is_free(sentinel)) return check_failed(i, "chain does not end at the sentinel", b);
+        if (is_prev_free(sentinel) != prev_free) return check_failed(i, "sentinel TAG_PREV_FREE disagrees", sentinel);
+    }
+    if (free_bytes != a.free_bytes) return check_failed(i, "free_bytes disagrees with the chains", &a);
+
+    std::size_t listed = 0;
+    for (std::size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+        bool bit = a.class_bitmap[cls / 64] & (std::uint64_t(1) << (cls % 64));
+        if (bit != (a.free_lists[cls] != nullptr)) return check_failed(i, "class bitmap disagrees", &a.free_lists[cls]);
+        Block* prev = nullptr;
+        for (Block* b = a.free_lists[cls]; b; prev = b, b = links(b)->next) {
+            if (++listed > free_blocks) return check_failed(i, "free lists hold more blocks than the chains", b);
+            if (arena_of(b) != &a || !is_free(b) || size_class(block_size(b)) != cls) {
+                return check_failed(i, "free list entry not a free block of its class", b);
+            }
+            if (links(b)->prev != prev) return check_failed(i, "free list back link broken", b);
+        }
+    }
+    if (listed != free_blocks) return check_failed(i, "free blocks missing from the free lists", &a);
+
+    if (a.large_index == LargeIndex::Tree) {
+        if (check_tree(a.large_tree, nullptr, nullptr, 0) != large_blocks) {
+            return check_failed(i, "large block treap inconsistent", a.large_tree);
+        }
+    } else if (a.large_index == LargeIndex::Tlsf) {
+        std::size_t indexed = 0;
+        for (std::size_t l = 0; l < NUM_LARGE_CLASSES; ++l) {
+            std::size_t cls = NUM_SMALL_CLASSES + l;
+            for (std::size_t sub = 0; sub < TLSF_SUBCLASSES; ++sub) {
+                if (bool(a.sub_bitmap[l] & (1u << sub)) != (a.sub_lists[l][sub] != nullptr)) {
+                    return check_failed(i, "TLSF bitmap disagrees", &a.sub_lists[l][sub]);
+                }
+                for (Block* b = a.sub_lists[l][sub]; b; b = sub_links(b)->next) {
+                    if (++indexed > large_blocks || !is_free(b) || size_class(block_size(b)) != cls ||
+                        tlsf_sub(block_size(b), cls) != sub) {
+                        return check_failed(i, "TLSF list entry misplaced", b);
+                    }
+                }
+            }
+        }
+        if (indexed != large_blocks) return check_failed(i, "free blocks missing from the TLSF lists", &a);
+    }
+
+    std::size_t partial = 0;
+    for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+        if (sc->arena != &a || chunk_of(sc) != sc) return check_failed(i, "slab chunk not registered", sc);
+        for (std::size_t r = 0; r < SLAB_RUNS; ++r) {
+            Slab& s = sc->slabs[r];
+            bool unused = sc->free_runs & (std::uint64_t(1) << r);
+            if (unused != !s.slot_size) return check_failed(i, "slab run mask disagrees", &s);
+            if (!s.slot_size) continue;
+            if (s.slot_size % ALIGNMENT || s.slot_size > SLAB_MAX_SIZE || s.bump > s.capacity || s.used > s.bump) {
+                return check_failed(i, "slab counts out of range", &s);
+            }
+            std::uint32_t freed = 0;
+            for (SlotLinks* slot = s.free; slot; slot = slot->next) {
+                char* p = reinterpret_cast<char*>(slot);
+                auto off = static_cast<std::size_t>(p - s.start);
+                if (p < s.start || off % s.slot_size || off / s.slot_size >= s.bump || slot->key != tcache_key ||
+                    ++freed > s.bump) {
+                    return check_failed(i, "slab free list entry invalid", slot);
+                }
+            }
+            if (freed + s.used != s.bump) return check_failed(i, "slab slots unaccounted for", &s);
+            partial += s.partial;
+        }
+    }
+    std::size_t linked = 0;
+    for (std::size_t cls = 0; cls < NUM_SLAB_CLASSES; ++cls) {
+        Slab* prev = nullptr;
+        for (Slab* s = a.slab_partial[cls]; s; prev = s, s = s->next) {
+            if (++linked > partial || !s->partial || s->slot_size != (cls + 1) * ALIGNMENT || s->prev != prev ||
+                slab_chunk_of(s)->arena != &a) {
+                return check_failed(i, "slab partial list entry invalid", s);
+            }
+        }
+    }
+    if (linked != partial) return check_failed(i, "partial slabs missing from their lists", &a);
+    return true;
+}
+
+bool check_heap() {
+    if (!initialized.load(std::memory_order_acquire)) return true;
+    bool ok = true;
+    for (std::size_t i = 0; i < arena_count; ++i) {
+        HeapArena& a = arenas[i];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (a.ready.load(std::memory_order_relaxed) && !check_arena(a, i)) ok = false;
+    }
+    return ok;
+}
+
+// {"arenas": [{"index", "chunks": [{"address", "reserved", "committed",
+// "blocks": [[offset from chunk, size, state], ...]}], "slab_chunks":
+// [{"address", "slabs": [{"run", "slot_size", "used", "capacity"}]}]}]}
+void dump_heap_json(std::FILE* out) {
+    std::fputs("{\"arenas\":[", out);
+    std::fflush(out);
+    bool first_arena = true;
+    for (std::size_t i = 0; initialized.load(std::memory_order_acquire) && i < arena_count; ++i) {
+        HeapArena& a = arenas[i];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (!a.ready.load(std::memory_order_relaxed)) continue;
+        std::fprintf(out, "%s{\"index\":%zu,\"chunks\":[", first_arena ? "" : ",", i);
+        first_arena = false;
+        for (Chunk* c = a.chunks; c; c = c->next) {
+            std::fprintf(out, "%s{\"address\":\"%p\",\"reserved\":%zu,\"committed\":%zu,\"blocks\":[",
+                         c == a.chunks ? "" : ",", (void*)c, c->size,
+                         static_cast<std::size_t>(c->committed.load(std::memory_order_relaxed) - (char*)c));
+            for (Block* b = c->head; block_size(b); b = next_block(b)) {
+                std::fprintf(out, "%s[%zu,%zu,\"%s\"]", b == c->head ? "" : ",",
+                             static_cast<std::size_t>((char*)b - (char*)c), block_size(b),
+                             block_state_name(block_state(b)));
+            }
+            std::fputs("]}", out);
+        }
+        std::fputs("],\"slab_chunks\":[", out);
+        for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+            std::fprintf(out, "%s{\"address\":\"%p\",\"slabs\":[", sc == a.slab_chunks ? "" : ",", (void*)sc);
+            bool first_slab = true;
+            for (std::size_t r = 0; r < SLAB_RUNS; ++r) {
+                const Slab& s = sc->slabs[r];
+                if (!s.slot_size) continue;
+                std::fprintf(out, "%s{\"run\":%zu,\"slot_size\":%u,\"used\":%u,\"capacity\":%u}",
+                             first_slab ? "" : ",", r, static_cast<unsigned>(s.slot_size),
+                             static_cast<unsigned>(s.used), static_cast<unsigned>(s.capacity));
+                first_slab = false;
+            }
+            std::fputs("]}", out);
+        }
+        std::fputs("]}", out);
+    }
+    std::fputs("]}\n", out);
+}
+
+// Binary snapshot: the bytes "MAHEAP01", then records of 64-bit words, each
+// starting with its kind:
+//   1  block chunk: arena, address, reserved, committed, n, then n words
+//      of block size | state (0 used, 1 free, 2 cached)
+//   2  slab chunk: arena, address, n, then n words, one per run, of
+//      slot_size | used << 16 | capacity << 32 (slot_size 0: unused run)
+//   0  end of snapshot
+constexpr char SNAPSHOT_MAGIC[8] = {'M', 'A', 'H', 'E', 'A', 'P', '0', '1'};
+
+struct WordWriter {
+    static constexpr std::size_t CAPACITY = 512;
+    std::FILE* out;
+    std::uint64_t buf[CAPACITY];
+    std::size_t n = 0;
+
+    void put(std::uint64_t w) {
+        buf[n++] = w;
+        if (n == CAPACITY) flush();
+    }
+    void flush() {
+        std::fwrite(buf, sizeof(std::uint64_t), n, out);
+        n = 0;
+    }
+};
+
+void dump_heap_binary(std::FILE* out) {
+    std::fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), out);
+    std::fflush(out);
+    WordWriter w{out, {}};
+    for (std::size_t i = 0; initialized.load(std::memory_order_acquire) && i < arena_count; ++i) {
+        HeapArena& a = arenas[i];
+        std::lock_guard<std::mutex> guard(a.lock);
+        if (!a.ready.load(std::memory_order_relaxed)) continue;
+        for (Chunk* c = a.chunks; c; c = c->next) {
+            std::uint64_t n = 0;
+            for (Block* b = c->head; block_size(b); b = next_block(b)) ++n;
+            w.put(1);
+            w.put(i);
+            w.put(reinterpret_cast<std::uintptr_t>(c));
+            w.put(c->size);
+            w.put(static_cast<std::uint64_t>(c->committed.load(std::memory_order_relaxed) - (char*)c));
+            w.put(n);
+            for (Block* b = c->head; block_size(b); b = next_block(b)) {
+                w.put(block_size(b) | static_cast<std::uint64_t>(block_state(b)));
+            }
+        }
+        for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+            w.put(2);
+            w.put(i);
+            w.put(reinterpret_cast<std::uintptr_t>(sc));
+            w.put(SLAB_RUNS);
+            for (const Slab& s : sc->slabs) {
+                w.put(std::uint64_t(s.slot_size) | std::uint64_t(s.used) << 16 | std::uint64_t(s.capacity) << 32);
+            }
+        }
+        w.flush();
+    }
+    w.put(0);
+    w.flush();
+}
+
+// ---------------------------------------------------------------------------
+// Heap instances
+//
+// A Heap is one more arena, mapped on its own instead of living in arenas[],
+// that its methods allocate from directly. Its chunks point back to it like
+// those of any arena, so the free functions take its memory as well. None
+// of that memory is ever parked in a thread cache or the quarantine, which
+// makes destroying the Heap a matter of unmapping its chunks.
+// ---------------------------------------------------------------------------
+
+struct Heap::State {
+    HeapArena arena;
+    HeapInstance instance;
+};
+
+// Unmap chunk c and its live bitmap, whatever they hold
+static void unmap_chunk(Chunk* c) {
+    std::size_t size = c->size;
+    if (c->live) os_unmap(c->live, align_up(size / ALIGNMENT / 8, os_page_size()));
+    radix_set(c, size, nullptr);
+    os_unmap(c, size);
+}
+
+// Count what is still allocated in a Heap's arena as freed, its chunks
+// being about to go; a.lock held
+static void count_instance_frees(HeapArena& a) {
+    for (Chunk* c = a.chunks; c; c = c->next) {
+        for (Block* b = c->head; block_size(b); b = next_block(b)) {
+            if (!is_free(b)) count_frees(payload_size(b));
+        }
+    }
+    for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+        for (const Slab& s : sc->slabs) {
+            if (s.slot_size && s.used) count_frees(s.slot_size, s.used);
+        }
+    }
+}
+
+Heap::Heap(std::size_t chunk_size, Placement policy) {
+    if (!initialized.load(std::memory_order_acquire)) init_allocator(DEFAULT_HEAP_SIZE);
+    std::size_t bytes = align_up(sizeof(State), os_page_size());
+    void* mem = os_map_aligned(bytes, os_page_size());
+    if (!mem) throw std::bad_alloc();
+    note_commit(bytes);
+    state_ = new (mem) State{};
+    state_->arena.instance = &state_->instance;
+    state_->instance.chunk_size = align_up(chunk_size);
+    state_->instance.placement = policy;
+    state_->instance.committed = state_->instance.peak_committed = bytes;
+}
+
+Heap::~Heap() {
+    if (!state_) return;
+    release();
+    std::size_t bytes = state_->instance.committed; // only the state itself is left
+    state_->~State();
+    note_decommit(bytes);
+    os_unmap(state_, bytes);
+}
+
+Heap::Heap(Heap&& other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+
+Heap& Heap::operator=(Heap&& other) noexcept {
+    if (this != &other) {
+        Heap old(std::move(*this));
+        state_ = std::exchange(other.state_, nullptr);
+    }
+    return *this;
+}
+
+void* Heap::malloc(std::size_t size) {
+    void* p = state_ ? instance_malloc(state_->arena, size) : nullptr;
+    if (trace_on()) trace_record(TraceOp::Malloc, p, 0, size);
+    return profile_alloc(p, size);
+}
+
+void* Heap::calloc(std::size_t nmemb, std::size_t size) {
+    if (!state_ || nmemb == 0 || size == 0) return nullptr;
+    if (nmemb > std::numeric_limits<std::size_t>::max() / size) return nullptr;
+    std::size_t total = nmemb * size;
+    DirtyRange dirty{};
+    void* p = instance_malloc(state_->arena, total, ALIGNMENT, &dirty);
+    if (p && with_canary(total) <= SLAB_MAX_SIZE) std::memset(p, 0, total);
+    else if (p) clear_dirty(p, total, dirty);
+    if (trace_on()) trace_record(TraceOp::Calloc, p, 0, p ? total : 0);
+    return profile_alloc(p, p ? total : 0);
+}
+
+void* Heap::realloc(void* ptr, std::size_t new_size) {
+    void* p = ptr ? realloc_impl(ptr, new_size) : state_ ? instance_malloc(state_->arena, new_size) : nullptr;
+    if (trace_on()) trace_record(TraceOp::Realloc, p, reinterpret_cast<std::uintptr_t>(ptr), new_size);
+    return profile_alloc(p, new_size);
+}
+
+void* Heap::aligned_alloc(std::size_t alignment, std::size_t size) {
+    void* p = state_ && std::has_single_bit(alignment) ? instance_malloc(state_->arena, size, alignment) : nullptr;
+    if (trace_on()) trace_record(TraceOp::AlignedAlloc, p, alignment, size);
+    return profile_alloc(p, size);
+}
+
+void Heap::free(void* ptr) { mini_alloc::free(ptr); }
+
+bool Heap::owns(const void* ptr) const {
+    Chunk* c = ptr ? chunk_of(ptr) : nullptr;
+    return c && state_ && c->arena == &state_->arena;
+}
+
+void Heap::set_placement(Placement policy) {
+    if (!state_) return;
+    std::lock_guard<std::mutex> guard(state_->arena.lock);
+    state_->instance.placement = policy;
+}
+
+void Heap::release() {
+    if (!state_) return;
+    HeapArena& a = state_->arena;
+    HeapInstance& h = state_->instance;
+    profile_forget_arena(&a);
+    {
+        std::lock_guard<std::mutex> guard(a.lock);
+        count_instance_frees(a);
+    }
+    for (Chunk* c = a.chunks; c;) {
+        Chunk* next = c->next;
+        unmap_chunk(c);
+        c = next;
+    }
+    for (Chunk* c = a.slab_chunks; c;) {
+        Chunk* next = c->next;
+        unmap_chunk(c);
+        c = next;
+    }
+    std::size_t bytes = align_up(sizeof(State), os_page_size());
+    note_decommit(h.committed - bytes);
+    h.committed = bytes;
+    a.~HeapArena();
+    new (&a) HeapArena;
+    a.instance = &h;
+}
+
+Stats Heap::stats() const {
+    Stats st{};
+    if (!state_) return st;
+    HeapArena& a = state_->arena;
+    const HeapInstance& h = state_->instance;
+    std::size_t live = 0;
+    std::lock_guard<std::mutex> guard(a.lock);
+    for (Chunk* c = a.chunks; c; c = c->next) {
+        for (Block* b = c->head; block_size(b); b = next_block(b)) {
+            if (is_free(b)) continue;
+            st.bytes_allocated += payload_size(b);
+            ++st.class_live[stats_class(payload_size(b))];
+            ++live;
+        }
+    }
+    for (SlabChunk* sc = a.slab_chunks; sc; sc = static_cast<SlabChunk*>(sc->next)) {
+        for (const Slab& s : sc->slabs) {
+            if (!s.slot_size) continue;
+            st.bytes_allocated += std::size_t(s.used) * s.slot_size;
+            st.bytes_free += std::size_t(s.capacity - s.used) * s.slot_size;
+            st.class_live[stats_class(s.slot_size)] += s.used;
+            live += s.used;
+        }
+    }
+    st.bytes_free += a.free_bytes;
+    st.bytes_committed = h.committed;
+    st.peak_committed = h.peak_committed;
+    // counted under the lock, so every live allocation has been counted
+    st.allocations = h.allocs.load(std::memory_order_relaxed);
+    st.frees = st.allocations - live;
+    for (std::size_t i = 0; i < NUM_CLASSES; ++i) st.class_allocations[i] = h.class_allocs[i].load(std::memory_order_relaxed);
+    return st;
+}
+
+HeapReport Heap::report() const {
+    HeapReport r{};
+    if (!state_) return r;
+    std::lock_guard<std::mutex> guard(state_->arena.lock);
+    report_arena(state_->arena, r);
+    report_ratios(r);
+    return r;
 }
 
 } // namespace mini_alloc
@@ -0,0 +1,106 @@
+#include "allocator.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+// Arena: bump allocation over a list of regions from mini_alloc::malloc.
+// Regions stay linked in fill order; reset() and restore() only move the
+// bump position back, so the regions past it are reused by later calls.
+
+namespace mini_alloc {
+
+// Region header; the data follows it
+struct alignas(std::max_align_t) Arena::Region {
+    Region* next;
+    std::size_t size; // bytes of data
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+Arena::Arena(std::size_t region_size) : region_size_(std::max<std::size_t>(region_size, 256)) {}
+
+Arena::~Arena() { release(); }
+
+Arena::Arena(Arena&& other) noexcept
+    : first_(std::exchange(other.first_, nullptr)),
+      current_(std::exchange(other.current_, nullptr)),
+      ptr_(std::exchange(other.ptr_, nullptr)),
+      end_(std::exchange(other.end_, nullptr)),
+      region_size_(other.region_size_) {}
+
+Arena& Arena::operator=(Arena&& other) noexcept {
+    if (this != &other) {
+        release();
+        first_ = std::exchange(other.first_, nullptr);
+        current_ = std::exchange(other.current_, nullptr);
+        ptr_ = std::exchange(other.ptr_, nullptr);
+        end_ = std::exchange(other.end_, nullptr);
+        region_size_ = other.region_size_;
+    }
+    return *this;
+}
+
+static inline char* align_ptr(char* p, std::size_t alignment) {
+    auto v = reinterpret_cast<std::uintptr_t>(p);
+    return reinterpret_cast<char*>((v + alignment - 1) & ~(alignment - 1));
+}
+
+void* Arena::allocate(std::size_t size, std::size_t alignment) {
+    if (!alignment || (alignment & (alignment - 1))) return nullptr;
+    if (size == 0) size = 1;
+
+    char* p = align_ptr(ptr_, alignment);
+    if (ptr_ && p <= end_ && size <= static_cast<std::size_t>(end_ - p)) {
+        ptr_ = p + size;
+        return p;
+    }
+
+    // move on to the next region that fits, or put a new one after this one
+    if (size > std::numeric_limits<std::size_t>::max() - alignment - sizeof(Region)) return nullptr;
+    std::size_t need = size + alignment - 1;
+    Region* r = current_ ? current_->next : first_;
+    while (r && r->size < need) r = r->next;
+    if (!r) {
+        std::size_t data = std::max(region_size_ - sizeof(Region), need);
+        r = static_cast<Region*>(mini_alloc::malloc(sizeof(Region) + data));
+        if (!r) return nullptr;
+        r->size = data;
+        if (current_) {
+            r->next = current_->next;
+            current_->next = r;
+        } else {
+            r->next = first_;
+            first_ = r;
+        }
+    }
+    current_ = r;
+    p = align_ptr(r->data(), alignment);
+    ptr_ = p + size;
+    end_ = r->data() + r->size;
+    return p;
+}
+
+Arena::Marker Arena::save() const { return {current_, ptr_}; }
+
+void Arena::restore(Marker mark) {
+    current_ = static_cast<Region*>(mark.region);
+    ptr_ = mark.ptr;
+    end_ = current_ ? current_->data() + current_->size : nullptr;
+}
+
+void Arena::reset() {
+    current_ = nullptr;
+    ptr_ = end_ = nullptr;
+}
+
+void Arena::release() {
+    for (Region* r = first_; r;) {
+        Region* next = r->next;
+        mini_alloc::free(r);
+        r = next;
+    }
+    first_ = current_ = nullptr;
+    ptr_ = end_ = nullptr;
+}
+
+} // namespace mini_alloc
@@ -0,0 +1,87 @@
+#include "stl_allocator.h"
+
+namespace mini_alloc {
+
+static constexpr std::size_t BASE_ALIGNMENT = alignof(std::max_align_t);
+
+// Heap allocation honouring alignment; size 0 still yields a unique pointer
+static void* heap_allocate(std::size_t bytes, std::size_t alignment) {
+    if (bytes == 0) bytes = 1;
+    void* p = alignment <= BASE_ALIGNMENT ? mini_alloc::malloc(bytes) : mini_alloc::aligned_alloc(alignment, bytes);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+static void heap_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+    if (alignment <= BASE_ALIGNMENT) mini_alloc::free_sized(p, bytes ? bytes : 1);
+    else mini_alloc::free(p);
+}
+
+// ---------------------------------------------------------------------------
+// memory_resource
+// ---------------------------------------------------------------------------
+
+void* memory_resource::do_allocate(std::size_t bytes, std::size_t alignment) {
+    return heap_allocate(bytes, alignment);
+}
+
+void memory_resource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+    heap_deallocate(p, bytes, alignment);
+}
+
+bool memory_resource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return dynamic_cast<const memory_resource*>(&other) != nullptr;
+}
+
+std::pmr::memory_resource* heap_resource() noexcept {
+    static memory_resource resource;
+    return &resource;
+}
+
+// ---------------------------------------------------------------------------
+// pool_resource
+// ---------------------------------------------------------------------------
+
+void* pool_resource::do_allocate(std::size_t bytes, std::size_t alignment) {
+    if (bytes > max_node_size || alignment > granule) return heap_allocate(bytes, alignment);
+    std::size_t cls = bytes ? (bytes - 1) / granule : 0;
+    if (Node* n = free_[cls]) {
+        free_[cls] = n->next;
+        return n;
+    }
+    void* p = arena_.allocate((cls + 1) * granule, granule);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void pool_resource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+    if (bytes > max_node_size || alignment > granule) {
+        heap_deallocate(p, bytes, alignment);
+        return;
+    }
+    std::size_t cls = bytes ? (bytes - 1) / granule : 0;
+    Node* n = static_cast<Node*>(p);
+    n->next = free_[cls];
+    free_[cls] = n;
+}
+
+bool pool_resource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+void pool_resource::release() {
+    arena_.release();
+    for (Node*& head : free_) head = nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// arena_resource
+// ---------------------------------------------------------------------------
+
+void* arena_resource::do_allocate(std::size_t bytes, std::size_t alignment) {
+    void* p = arena_.allocate(bytes, alignment);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+} // namespace mini_alloc
@@ -0,0 +1,79 @@
+// Optional replacement of the global operator new / delete with mini_alloc.
+// Link this translation unit (CMake target mini_alloc_new) into a program to
+// route every C++ allocation through the allocator.
+#include "allocator.h"
+#include <cstddef>
+#include <new>
+
+namespace {
+
+// operator new semantics: never return null for size 0, call the new
+// handler until it gives up, then throw
+void* new_impl(std::size_t size) {
+    if (size == 0) size = 1;
+    while (true) {
+        if (void* p = mini_alloc::malloc(size)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void* new_aligned_impl(std::size_t size, std::align_val_t alignment) {
+    if (size == 0) size = 1;
+    while (true) {
+        if (void* p = mini_alloc::aligned_alloc(static_cast<std::size_t>(alignment), size)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void* new_nothrow_impl(std::size_t size) noexcept {
+    try {
+        return new_impl(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* new_aligned_nothrow_impl(std::size_t size, std::align_val_t alignment) noexcept {
+    try {
+        return new_aligned_impl(size, alignment);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+} // namespace
+
+void* operator new(std::size_t size) { return new_impl(size); }
+void* operator new[](std::size_t size) { return new_impl(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return new_nothrow_impl(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return new_nothrow_impl(size); }
+
+void* operator new(std::size_t size, std::align_val_t alignment) { return new_aligned_impl(size, alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return new_aligned_impl(size, alignment); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_aligned_nothrow_impl(size, alignment);
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_aligned_nothrow_impl(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept { mini_alloc::free(ptr); }
+void operator delete[](void* ptr) noexcept { mini_alloc::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { mini_alloc::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { mini_alloc::free(ptr); }
+
+// sized delete: new_impl turned size 0 into 1
+void operator delete(void* ptr, std::size_t size) noexcept { mini_alloc::free_sized(ptr, size ? size : 1); }
+void operator delete[](void* ptr, std::size_t size) noexcept { mini_alloc::free_sized(ptr, size ? size : 1); }
+
+// aligned blocks are ordinary blocks to free
+void operator delete(void* ptr, std::align_val_t) noexcept { mini_alloc::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { mini_alloc::free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { mini_alloc::free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { mini_alloc::free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { mini_alloc::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { mini_alloc::free(ptr); }
@@ -0,0 +1,84 @@
+// C allocation entry points for the LD_PRELOAD library (mini_alloc_preload):
+// replaces malloc and friends process-wide, e.g.
+//   LD_PRELOAD=./libmini_alloc_preload.so ./program
+// Follows glibc's conventions where they differ from mini_alloc's own API:
+// zero-size requests return a unique pointer and failures set errno.
+#include "allocator.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <unistd.h>
+
+namespace {
+
+void* check(void* p) {
+    if (!p) errno = ENOMEM;
+    return p;
+}
+
+} // namespace
+
+extern "C" {
+
+void* malloc(std::size_t size) noexcept { return check(mini_alloc::malloc(size ? size : 1)); }
+
+void free(void* ptr) noexcept { mini_alloc::free(ptr); }
+
+void free_sized(void* ptr, std::size_t size) noexcept { mini_alloc::free_sized(ptr, size ? size : 1); }
+
+void* calloc(std::size_t nmemb, std::size_t size) noexcept {
+    if (nmemb && size > std::numeric_limits<std::size_t>::max() / nmemb) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (nmemb == 0 || size == 0) nmemb = size = 1;
+    return check(mini_alloc::calloc(nmemb, size));
+}
+
+void* realloc(void* ptr, std::size_t size) noexcept {
+    if (ptr && size == 0) {
+        mini_alloc::free(ptr);
+        return nullptr;
+    }
+    return check(mini_alloc::realloc(ptr, size ? size : 1));
+}
+
+std::size_t malloc_usable_size(void* ptr) noexcept { return mini_alloc::malloc_usable_size(ptr); }
+
+void* reallocarray(void* ptr, std::size_t nmemb, std::size_t size) noexcept {
+    if (nmemb && size > std::numeric_limits<std::size_t>::max() / nmemb) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+int posix_memalign(void** memptr, std::size_t alignment, std::size_t size) noexcept {
+    return mini_alloc::posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size) noexcept {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return check(mini_alloc::aligned_alloc(alignment, size ? size : 1));
+}
+
+void* memalign(std::size_t alignment, std::size_t size) noexcept { return aligned_alloc(alignment, size); }
+
+void* valloc(std::size_t size) noexcept {
+    return aligned_alloc(static_cast<std::size_t>(sysconf(_SC_PAGESIZE)), size);
+}
+
+void* pvalloc(std::size_t size) noexcept {
+    auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    if (size > std::numeric_limits<std::size_t>::max() - page) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+} // extern "C"
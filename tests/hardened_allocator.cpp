@@ -0,0 +1,143 @@
+// Hardened mode: the heap errors it must catch, each provoked in a forked
+// child that has to die of SIGABRT with the matching report, after a check
+// that correct use of the same calls passes. POSIX only.
+
+// the checks below are asserts: keep them in release builds
+#undef NDEBUG
+#include "../include/allocator.h"
+#include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+// Run fn in a child process; with report, check that it aborted and that
+// its stderr contains report, without it that it exited normally
+template <typename Fn>
+static void expect(const char* name, const char* report, Fn fn) {
+    std::fflush(stdout);
+    int err[2];
+    int piped = pipe(err);
+    assert(piped == 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        dup2(err[1], STDERR_FILENO);
+        fn();
+        _exit(0); // went unnoticed
+    }
+    close(err[1]);
+    char out[512] = {};
+    std::size_t n = 0;
+    for (ssize_t r; n < sizeof(out) - 1 && (r = read(err[0], out + n, sizeof(out) - 1 - n)) > 0;) n += r;
+    close(err[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    bool aborted = WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+    bool ok = report ? aborted && std::strstr(out, report) : WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    std::printf("%-32s %s\n", name, ok ? (report ? "caught" : "passed") : report ? "NOT CAUGHT" : "FAILED");
+    if (!ok) {
+        std::fputs(out, stdout);
+        ++failures;
+    }
+}
+
+// Free and reuse enough allocations to push everything out of the quarantine
+static void cycle_quarantine() {
+    for (int i = 0; i < 256; ++i) mini_alloc::free(mini_alloc::malloc(64));
+}
+
+// Free a 64-byte allocation, write to it, then free others 64-byte
+// allocations made after it, which queue behind it in the quarantine
+static void write_after_free(int others) {
+    char* victim = static_cast<char*>(mini_alloc::malloc(64));
+    void* ptrs[200];
+    for (int i = 0; i < others; ++i) ptrs[i] = mini_alloc::malloc(64);
+    mini_alloc::free(victim);
+    victim[8] = 1;
+    for (int i = 0; i < others; ++i) mini_alloc::free(ptrs[i]);
+}
+
+int main() {
+    bool on = mini_alloc::set_hardened(true);
+    assert(on);
+    mini_alloc::init_allocator(1024 * 1024);
+    mini_alloc::set_quarantine_size(256 * 1024);
+    std::puts("=== hardened mode test starting ===");
+
+    // correct use passes the checks
+    {
+        void* small = mini_alloc::malloc(100);
+        void* large = mini_alloc::malloc(5000);
+        std::memset(small, 1, 100);
+        std::memset(large, 2, 5000);
+        large = mini_alloc::realloc(large, 9000);
+        void* ptrs[16];
+        std::size_t n = mini_alloc::malloc_batch(200, 16, ptrs);
+        mini_alloc::free_batch(ptrs, n);
+        mini_alloc::free_sized(small, 100);
+        mini_alloc::free(large);
+        cycle_quarantine();
+        assert(mini_alloc::check_heap());
+        std::puts("correct use OK");
+    }
+
+    expect("overflow (slab slot)", "overflow", [] {
+        char* p = static_cast<char*>(mini_alloc::malloc(100));
+        std::memset(p, 0, 104);
+        mini_alloc::free(p);
+    });
+    expect("overflow (block)", "overflow", [] {
+        char* p = static_cast<char*>(mini_alloc::malloc(5000));
+        std::memset(p, 0, 5004);
+        mini_alloc::free(p);
+    });
+    expect("double free", "invalid or double free", [] {
+        void* p = mini_alloc::malloc(100);
+        mini_alloc::free(p);
+        mini_alloc::free(p);
+    });
+    expect("double free (batch)", "invalid or double free", [] {
+        void* p = mini_alloc::malloc(100);
+        void* ptrs[2] = {p, p};
+        mini_alloc::free_batch(ptrs, 2);
+    });
+    expect("interior free", "invalid or double free", [] {
+        char* p = static_cast<char*>(mini_alloc::malloc(5000));
+        mini_alloc::free(p + 64);
+    });
+
+    // a write to a quarantined block is found when the block leaves the
+    // quarantine, which holds at most set_quarantine_size bytes and 128 frees
+    expect("use after free", "use after free", [] {
+        write_after_free(0);
+        cycle_quarantine();
+    });
+    expect("use after free (in quarantine)", nullptr, [] {
+        mini_alloc::set_quarantine_size(1024);
+        write_after_free(5); // 6 frees of at most 80 bytes: all held
+    });
+    expect("use after free (byte cap)", "use after free", [] {
+        mini_alloc::set_quarantine_size(1024);
+        write_after_free(17); // 18 frees of at least 72 bytes: the first is let go
+    });
+    expect("use after free (below slot cap)", nullptr, [] {
+        mini_alloc::set_quarantine_size(1024 * 1024);
+        write_after_free(120);
+    });
+    expect("use after free (slot cap)", "use after free", [] {
+        mini_alloc::set_quarantine_size(1024 * 1024);
+        write_after_free(128);
+    });
+    expect("use after free (no quarantine)", nullptr, [] {
+        mini_alloc::set_quarantine_size(0);
+        write_after_free(0);
+        cycle_quarantine();
+    });
+
+    std::puts(failures ? "=== hardened mode test FAILED ===" : "=== hardened mode test finished ===");
+    return failures ? 1 : 0;
+}
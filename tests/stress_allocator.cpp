@@ -0,0 +1,391 @@
+// Concurrent stress test of mini_alloc, and a throughput-vs-threads report.
+//
+//   stress_allocator [--threads N,N,...] [--ops N] [--max-size BYTES]
+//                    [--arenas N] [--placement best|first|next|good]
+//                    [--seed N] [--hardened]
+//
+// For each thread count (1 to 128 by default) it runs two phases, every
+// thread doing --ops operations in each:
+//
+//   churn   random malloc, calloc, aligned_alloc, realloc and free over a
+//           window of live blocks per thread, log-uniform sizes up to
+//           --max-size with the odd huge one
+//   remote  every thread allocates small blocks for its neighbour, which
+//           frees them; what is left when the threads exit is freed by the
+//           main thread, into the caches of threads that are gone
+//
+// Every block is filled with a pattern of its own, checked before it is
+// freed or reallocated (and calloc memory for zeros), so a block handed
+// out twice or overwritten by the allocator shows up. After each phase all
+// its blocks are gone, so check_heap must pass and the allocation count
+// must be back where it started. The test exits non-zero on any failure.
+//
+// Build the stress_allocator_asan and stress_allocator_tsan variants with
+// -DMINI_ALLOC_SANITIZE=ON to run it under AddressSanitizer and
+// ThreadSanitizer.
+
+#include "../include/allocator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    std::vector<unsigned> threads = {1, 2, 4, 8, 16, 32, 64, 128};
+    std::size_t ops = 100000;
+    std::size_t max_size = 32 * 1024;
+    std::size_t arenas = 4;
+    mini_alloc::Placement placement = mini_alloc::Placement::BestFit;
+    std::uint64_t seed = 1;
+    bool hardened = false;
+};
+
+static std::atomic<bool> failed{false};
+
+static void fail(const char* what, const void* p, std::size_t size) {
+    std::fprintf(stderr, "stress_allocator: %s (%p, %zu bytes)\n", what, p, size);
+    failed.store(true, std::memory_order_relaxed);
+}
+
+// ---------------------------------------------------------------------------
+// Blocks and their patterns
+// ---------------------------------------------------------------------------
+
+// Bytes at each end of a block that carry its pattern (smaller blocks are
+// patterned throughout)
+constexpr std::size_t PATTERN_BYTES = 64;
+// Huge blocks: above the default huge threshold
+constexpr std::size_t HUGE_SIZE = 3 * 1024 * 1024;
+
+struct Rec {
+    unsigned char* p;
+    std::size_t size;
+    unsigned char tag;
+};
+
+static void fill(const Rec& r) {
+    std::size_t head = std::min(r.size, PATTERN_BYTES);
+    for (std::size_t i = 0; i < head; ++i) r.p[i] = static_cast<unsigned char>(r.tag + i);
+    for (std::size_t i = std::max(head, r.size - std::min(r.size, PATTERN_BYTES)); i < r.size; ++i) {
+        r.p[i] = static_cast<unsigned char>(r.tag ^ i);
+    }
+}
+
+// The first n bytes of the head pattern, or the whole pattern
+static bool intact(const Rec& r, std::size_t n = SIZE_MAX) {
+    std::size_t head = std::min({r.size, PATTERN_BYTES, n});
+    for (std::size_t i = 0; i < head; ++i) {
+        if (r.p[i] != static_cast<unsigned char>(r.tag + i)) return false;
+    }
+    if (n < r.size) return true;
+    for (std::size_t i = std::max(head, r.size - std::min(r.size, PATTERN_BYTES)); i < r.size; ++i) {
+        if (r.p[i] != static_cast<unsigned char>(r.tag ^ i)) return false;
+    }
+    return true;
+}
+
+static void release(const Rec& r) {
+    if (!intact(r)) fail("block pattern overwritten", r.p, r.size);
+    mini_alloc::free(r.p);
+}
+
+// Sizes spread evenly over powers of two in [1, max]
+static std::size_t log_uniform(std::mt19937_64& rng, std::size_t max) {
+    std::uniform_real_distribution<double> d(0.0, std::log2(double(max)));
+    return std::max<std::size_t>(1, static_cast<std::size_t>(std::exp2(d(rng))));
+}
+
+// ---------------------------------------------------------------------------
+// Phases
+// ---------------------------------------------------------------------------
+
+constexpr std::size_t CHURN_WINDOW = 128;
+
+static void churn(const Options& opt, std::uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<Rec> live;
+    live.reserve(CHURN_WINDOW);
+    for (std::size_t op = 0; op < opt.ops; ++op) {
+        unsigned r = static_cast<unsigned>(rng() % 16);
+        if (live.size() == CHURN_WINDOW || (r < 5 && !live.empty())) {
+            // free
+            std::size_t i = rng() % live.size();
+            release(live[i]);
+            live[i] = live.back();
+            live.pop_back();
+        } else if (r < 8 && !live.empty()) {
+            // realloc, keeping the head of the pattern
+            Rec& x = live[rng() % live.size()];
+            std::size_t n = log_uniform(rng, opt.max_size);
+            if (!intact(x)) fail("block pattern overwritten", x.p, x.size);
+            auto* p = static_cast<unsigned char*>(mini_alloc::realloc(x.p, n));
+            if (!p) {
+                fail("realloc failed", x.p, n);
+                continue;
+            }
+            x.p = p;
+            if (!intact(x, n)) fail("realloc lost the contents", p, n);
+            x.size = n;
+            x.tag = static_cast<unsigned char>(rng());
+            fill(x);
+        } else {
+            Rec x{nullptr, rng() % 512 == 0 ? HUGE_SIZE : log_uniform(rng, opt.max_size),
+                  static_cast<unsigned char>(rng())};
+            if (r == 8) {
+                x.p = static_cast<unsigned char*>(mini_alloc::calloc(1, x.size));
+                for (std::size_t i = 0; x.p && i < std::min(x.size, opt.max_size); ++i) {
+                    if (x.p[i]) {
+                        fail("calloc memory not zero", x.p, x.size);
+                        break;
+                    }
+                }
+            } else if (r == 9) {
+                std::size_t alignment = std::size_t(32) << (rng() % 8);
+                x.p = static_cast<unsigned char*>(mini_alloc::aligned_alloc(alignment, x.size));
+                if (reinterpret_cast<std::uintptr_t>(x.p) % alignment) fail("misaligned block", x.p, alignment);
+            } else {
+                x.p = static_cast<unsigned char*>(mini_alloc::malloc(x.size));
+            }
+            if (!x.p) {
+                fail("allocation failed", nullptr, x.size);
+                continue;
+            }
+            fill(x);
+            live.push_back(x);
+        }
+    }
+    for (const Rec& x : live) release(x);
+}
+
+// Blocks on their way to a thread; allocated in the sender's arena and
+// thread cache, freed by the receiver
+struct Mailbox {
+    std::mutex lock;
+    std::vector<Rec> recs;
+    bool closed = false; // the receiver is done; the main thread drains what is left
+};
+
+constexpr std::size_t REMOTE_MAX_SIZE = 1024;
+constexpr std::size_t REMOTE_BATCH = 16;
+constexpr std::size_t MAILBOX_LIMIT = 1024; // recs a sender lets pile up before it waits
+
+static void drain(Mailbox& box, std::vector<Rec>& scratch) {
+    scratch.clear();
+    {
+        std::lock_guard<std::mutex> guard(box.lock);
+        scratch.swap(box.recs);
+    }
+    // the receiver's frees, in one batch
+    std::vector<void*> ptrs;
+    ptrs.reserve(scratch.size());
+    for (const Rec& x : scratch) {
+        if (!intact(x)) fail("block pattern overwritten", x.p, x.size);
+        ptrs.push_back(x.p);
+    }
+    mini_alloc::free_batch(ptrs.data(), ptrs.size());
+}
+
+static void remote(const Options& opt, std::uint64_t seed, Mailbox& inbox, Mailbox& outbox) {
+    std::mt19937_64 rng(seed);
+    std::vector<Rec> pending, scratch;
+    void* batch[REMOTE_BATCH];
+    for (std::size_t op = 0; op < opt.ops;) {
+        std::size_t size = log_uniform(rng, REMOTE_MAX_SIZE);
+        if (rng() % 8 == 0) {
+            std::size_t n = mini_alloc::malloc_batch(size, REMOTE_BATCH, batch);
+            for (std::size_t i = 0; i < n; ++i) {
+                pending.push_back({static_cast<unsigned char*>(batch[i]), size, static_cast<unsigned char>(rng())});
+                fill(pending.back());
+            }
+            op += std::max<std::size_t>(n, 1);
+        } else {
+            Rec x{static_cast<unsigned char*>(mini_alloc::malloc(size)), size, static_cast<unsigned char>(rng())};
+            if (x.p) {
+                fill(x);
+                pending.push_back(x);
+            } else {
+                fail("allocation failed", nullptr, size);
+            }
+            ++op;
+        }
+        if (pending.size() < REMOTE_BATCH) continue;
+        while (true) {
+            // keep draining while waiting, or a ring of full mailboxes would never move
+            drain(inbox, scratch);
+            std::lock_guard<std::mutex> guard(outbox.lock);
+            if (outbox.recs.size() < MAILBOX_LIMIT || outbox.closed || &outbox == &inbox) {
+                outbox.recs.insert(outbox.recs.end(), pending.begin(), pending.end());
+                break;
+            }
+            // a slow receiver; let it run (yielding alone would spin once threads outnumber cores)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        pending.clear();
+    }
+    {
+        // no more draining here, so a sender must not wait on us
+        std::lock_guard<std::mutex> guard(inbox.lock);
+        inbox.closed = true;
+    }
+    std::lock_guard<std::mutex> guard(outbox.lock);
+    outbox.recs.insert(outbox.recs.end(), pending.begin(), pending.end());
+}
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+static std::size_t live_allocations() {
+    mini_alloc::Stats st = mini_alloc::get_stats();
+    return st.allocations - st.frees;
+}
+
+// Run body(t) on n threads released together; returns the seconds until
+// the last one finished
+template <typename Fn>
+static double run_threads(unsigned n, Fn body) {
+    std::atomic<unsigned> waiting{n};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    threads.reserve(n);
+    for (unsigned t = 0; t < n; ++t) {
+        threads.emplace_back([&, t] {
+            waiting.fetch_sub(1);
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            body(t);
+        });
+    }
+    while (waiting.load() != 0) std::this_thread::yield();
+    auto t0 = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& th : threads) th.join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+struct Row {
+    const char* phase;
+    unsigned threads;
+    double seconds;
+};
+
+// After a phase every block it allocated is freed again
+static bool check_phase(const char* phase, unsigned threads, std::size_t live_before) {
+    bool ok = true;
+    if (!mini_alloc::check_heap()) {
+        std::fprintf(stderr, "stress_allocator: %s, %u threads: heap inconsistent\n", phase, threads);
+        ok = false;
+    }
+    std::size_t live = live_allocations();
+    if (live != live_before) {
+        std::fprintf(stderr, "stress_allocator: %s, %u threads: %zu allocations live, expected %zu\n", phase, threads,
+                     live, live_before);
+        ok = false;
+    }
+    if (!ok) failed.store(true, std::memory_order_relaxed);
+    return ok;
+}
+
+static void usage() {
+    std::puts("usage: stress_allocator [--threads N,N,...] [--ops N] [--max-size BYTES] [--arenas N]\n"
+              "                        [--placement best|first|next|good] [--seed N] [--hardened]");
+}
+
+static bool parse_threads(const char* s, std::vector<unsigned>& out) {
+    out.clear();
+    while (*s) {
+        char* end;
+        unsigned long n = std::strtoul(s, &end, 10);
+        if (end == s || n == 0 || n > 1024 || (*end && *end != ',')) return false;
+        out.push_back(static_cast<unsigned>(n));
+        s = *end ? end + 1 : end;
+    }
+    return !out.empty();
+}
+
+static bool parse_placement(const std::string& s, mini_alloc::Placement& out) {
+    if (s == "best") out = mini_alloc::Placement::BestFit;
+    else if (s == "first") out = mini_alloc::Placement::FirstFit;
+    else if (s == "next") out = mini_alloc::Placement::NextFit;
+    else if (s == "good") out = mini_alloc::Placement::GoodFit;
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        bool ok = true;
+        if (arg == "--threads" && has_value) ok = parse_threads(argv[++i], opt.threads);
+        else if (arg == "--ops" && has_value) opt.ops = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        else if (arg == "--max-size" && has_value) opt.max_size = std::max<std::size_t>(16, std::strtoull(argv[++i], nullptr, 10));
+        else if (arg == "--arenas" && has_value) opt.arenas = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        else if (arg == "--placement" && has_value) ok = parse_placement(argv[++i], opt.placement);
+        else if (arg == "--seed" && has_value) opt.seed = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--hardened") opt.hardened = true;
+        else ok = false;
+        if (!ok) {
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    if (opt.hardened && !mini_alloc::set_hardened(true)) {
+        std::fputs("stress_allocator: hardened mode unavailable\n", stderr);
+        return 1;
+    }
+    mini_alloc::set_placement(opt.placement);
+    mini_alloc::init_allocator(16 * 1024 * 1024, opt.arenas);
+
+    std::vector<Row> rows;
+    for (unsigned n : opt.threads) {
+        std::size_t live = live_allocations();
+        double s = run_threads(n, [&](unsigned t) { churn(opt, opt.seed * 1000003 + n * 1009 + t); });
+        rows.push_back({"churn", n, s});
+        if (!check_phase("churn", n, live)) break;
+
+        std::vector<Mailbox> boxes(n);
+        s = run_threads(n, [&](unsigned t) {
+            remote(opt, opt.seed * 2000003 + n * 1009 + t, boxes[t], boxes[(t + 1) % n]);
+        });
+        std::vector<Rec> scratch;
+        for (Mailbox& box : boxes) drain(box, scratch);
+        rows.push_back({"remote", n, s});
+        if (!check_phase("remote", n, live)) break;
+    }
+
+    mini_alloc::Stats st = mini_alloc::get_stats();
+    std::printf("%zu ops per thread and phase, %zu arenas%s\n", opt.ops, opt.arenas,
+                opt.hardened ? ", hardened" : "");
+    std::printf("%-8s %8s %12s %10s %10s\n", "phase", "threads", "seconds", "Mops/s", "scaling");
+    for (const Row& r : rows) {
+        double mops = double(opt.ops) * r.threads / r.seconds / 1e6;
+        // against the phase's first (smallest) thread count
+        const Row* base = &r;
+        for (const Row& b : rows) {
+            if (std::strcmp(b.phase, r.phase) == 0) {
+                base = &b;
+                break;
+            }
+        }
+        double base_mops = double(opt.ops) * base->threads / base->seconds / 1e6;
+        std::printf("%-8s %8u %12.3f %10.2f %9.2fx\n", r.phase, r.threads, r.seconds, mops, mops / base_mops);
+    }
+    std::printf("peak committed: %.1f MiB\n", double(st.peak_committed) / (1024.0 * 1024.0));
+    if (failed.load()) {
+        std::puts("stress_allocator: FAILED");
+        return 1;
+    }
+    std::puts("stress_allocator: passed");
+    return 0;
+}
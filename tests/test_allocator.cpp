@@ -1,9 +1,22 @@
+// the checks below are asserts: keep them in release builds
+#undef NDEBUG
 
 #include "../include/allocator.h"
+#include "../include/stl_allocator.h"
+#include "../include/trace_reader.h"
 #include <cstdio>
 #include <cstring>
 #include <cassert>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <list>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 int main() {
     mini_alloc::init_allocator(1024 * 1024); // 1 MiB heap for test
@@ -43,6 +56,7 @@ int main() {
     // free some (only if non-null)
     if (blocks[2]) mini_alloc::free(blocks[2]);
     if (blocks[3]) mini_alloc::free(blocks[3]);
+    blocks[2] = blocks[3] = nullptr;
     std::puts("freed blocks[2], blocks[3]");
     mini_alloc::dump_heap();
 
@@ -65,6 +79,623 @@ int main() {
     mini_alloc::free(b);
     mini_alloc::free(big);
 
+    // huge allocations: mappings of their own, resized with their contents
+    {
+        constexpr std::size_t MiB = 1024 * 1024;
+        std::size_t committed = mini_alloc::get_stats().bytes_committed;
+        char* h1 = static_cast<char*>(mini_alloc::malloc(3 * MiB));
+        char* h2 = static_cast<char*>(mini_alloc::malloc(3 * MiB));
+        assert(h1 && h2 && (h1 + 3 * MiB <= h2 || h2 + 3 * MiB <= h1));
+        assert(mini_alloc::get_stats().bytes_committed >= committed + 6 * MiB);
+        for (std::size_t i = 0; i < 3 * MiB; i += 4096) h1[i] = static_cast<char>(i / 4096);
+        h1 = static_cast<char*>(mini_alloc::realloc(h1, 8 * MiB)); // grows, maybe moving pages
+        assert(h1);
+        for (std::size_t i = 0; i < 3 * MiB; i += 4096) assert(h1[i] == static_cast<char>(i / 4096));
+        h1[8 * MiB - 1] = 1;
+        h1 = static_cast<char*>(mini_alloc::realloc(h1, 5 * MiB / 2)); // shrinks, still huge
+        for (std::size_t i = 0; i < 5 * MiB / 2; i += 4096) assert(h1[i] == static_cast<char>(i / 4096));
+        mini_alloc::free(h1);
+        mini_alloc::free(h2);
+        assert(mini_alloc::get_stats().bytes_committed < committed + MiB); // unmapped
+        std::puts("huge allocation test OK");
+    }
+
+    // aligned_alloc / posix_memalign
+    {
+        for (std::size_t alignment : {std::size_t(16), std::size_t(64), std::size_t(4096), std::size_t(2 * 1024 * 1024)}) {
+            char* p = static_cast<char*>(mini_alloc::aligned_alloc(alignment, 1000));
+            assert(p && reinterpret_cast<std::uintptr_t>(p) % alignment == 0);
+            std::memset(p, 0x3C, 1000);
+            p = static_cast<char*>(mini_alloc::realloc(p, 5000)); // aligned blocks are ordinary blocks
+            assert(p && p[999] == 0x3C);
+            mini_alloc::free(p);
+            void* q = nullptr;
+            assert(mini_alloc::posix_memalign(&q, alignment, 300) == 0);
+            assert(reinterpret_cast<std::uintptr_t>(q) % alignment == 0);
+            mini_alloc::free(q);
+        }
+        void* q = nullptr;
+        assert(mini_alloc::posix_memalign(&q, 24, 100) == EINVAL); // not a power of two
+        assert(mini_alloc::posix_memalign(&q, sizeof(void*) / 2, 100) == EINVAL); // below sizeof(void*)
+        assert(!q);
+        std::puts("aligned allocation test OK");
+    }
+
+    // free_sized with the size that was asked for
+    {
+        for (std::size_t size : {std::size_t(1), std::size_t(24), std::size_t(256), std::size_t(700), std::size_t(5000)}) {
+            void* p = mini_alloc::malloc(size);
+            std::memset(p, 0x11, size);
+            mini_alloc::free_sized(p, size);
+            void* q = mini_alloc::malloc(size);
+            assert(q);
+            mini_alloc::free_sized(q, size);
+        }
+        std::puts("free_sized test OK");
+    }
+
+    // realloc in place: shrinking splits off the tail, growing takes a free
+    // neighbour on the right or, moving the data, on the left, and only
+    // copies when neither is free. Blocks are above the thread cache sizes.
+    {
+        auto fill = [](char* p, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i) p[i] = static_cast<char>(i * 7);
+        };
+        auto intact = [](const char* p, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i) {
+                if (p[i] != static_cast<char>(i * 7)) return false;
+            }
+            return true;
+        };
+        // count blocks of size bytes, each right after the one before;
+        // attempts that landed in holes of the heap are kept until the end
+        std::vector<void*> spilled;
+        auto adjacent = [&](char** out, int count, std::size_t size) {
+            for (int attempt = 0; attempt < 100; ++attempt) {
+                bool ok = true;
+                for (int i = 0; i < count; ++i) {
+                    out[i] = static_cast<char*>(mini_alloc::malloc(size));
+                    if (i && (out[i] < out[i - 1] + size || out[i] >= out[i - 1] + size + 64)) ok = false;
+                }
+                if (ok) return;
+                spilled.insert(spilled.end(), out, out + count);
+            }
+            assert(!"no adjacent blocks");
+        };
+        char* b[4];
+
+        adjacent(b, 2, 40000); // shrink, fenced by b[1]
+        fill(b[0], 10000);
+        assert(mini_alloc::realloc(b[0], 10000) == b[0] && intact(b[0], 10000));
+        char* tail = static_cast<char*>(mini_alloc::malloc(40000 - 10000 - 64)); // the tail's size
+        assert(tail > b[0] + 10000 && tail < b[1]);
+        for (char* p : {b[0], b[1], tail}) mini_alloc::free(p);
+
+        adjacent(b, 3, 20000); // grow into the free right neighbour
+        fill(b[0], 20000);
+        mini_alloc::free(b[1]);
+        assert(mini_alloc::realloc(b[0], 35000) == b[0] && intact(b[0], 20000));
+        mini_alloc::free(b[0]);
+        mini_alloc::free(b[2]);
+
+        adjacent(b, 4, 20000); // grow into the free left neighbour, fenced on both sides
+        fill(b[2], 20000);
+        mini_alloc::free(b[1]);
+        char* moved = static_cast<char*>(mini_alloc::realloc(b[2], 35000));
+        assert(moved == b[1] && intact(moved, 20000));
+        for (char* p : {b[0], moved, b[3]}) mini_alloc::free(p);
+
+        adjacent(b, 3, 20000); // no free neighbour: copied
+        fill(b[1], 20000);
+        char* copied = static_cast<char*>(mini_alloc::realloc(b[1], 60000));
+        assert(copied && copied != b[1] && intact(copied, 20000));
+        for (char* p : {b[0], copied, b[2]}) mini_alloc::free(p);
+
+        for (void* p : spilled) mini_alloc::free(p);
+        std::puts("realloc in place test OK");
+    }
+
+    // malloc_batch / free_batch, of slab slots and of blocks
+    for (std::size_t size : {48, 3000}) {
+        std::size_t live = mini_alloc::get_stats().bytes_allocated;
+        void* ptrs[64];
+        std::size_t n = mini_alloc::malloc_batch(size, 64, ptrs);
+        assert(n == 64);
+        for (std::size_t i = 0; i < n; ++i) {
+            for (std::size_t j = 0; j < i; ++j) assert(ptrs[i] != ptrs[j]);
+            assert(mini_alloc::malloc_usable_size(ptrs[i]) >= size);
+            std::memset(ptrs[i], static_cast<int>(i), size);
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            assert(static_cast<unsigned char*>(ptrs[i])[size - 1] == static_cast<unsigned char>(i));
+        }
+        mini_alloc::free_batch(ptrs, n);
+        assert(mini_alloc::get_stats().bytes_allocated == live);
+        assert(mini_alloc::check_heap());
+    }
+    std::puts("batch test OK");
+
+    // Arena: aligned bumps, markers and scopes, reset reusing the regions
+    {
+        std::size_t live = mini_alloc::get_stats().bytes_allocated;
+        mini_alloc::Arena arena(1024);
+        void* first = arena.allocate(10);
+        void* aligned = arena.allocate(8, 64);
+        assert(first && aligned && reinterpret_cast<std::uintptr_t>(aligned) % 64 == 0);
+        mini_alloc::Arena::Marker mark = arena.save();
+        void* p = arena.allocate(96);
+        arena.restore(mark);
+        assert(arena.allocate(96) == p);
+        {
+            mini_alloc::Arena::Scope scope(arena);
+            for (int i = 0; i < 100; ++i) assert(arena.allocate(100)); // spills into more regions
+        }
+        assert(arena.allocate(96) == static_cast<char*>(p) + 96);
+        std::size_t allocations = mini_alloc::get_stats().allocations;
+        arena.reset();
+        assert(arena.allocate(10) == first);
+        for (int i = 0; i < 100; ++i) arena.allocate(100);
+        assert(mini_alloc::get_stats().allocations == allocations); // regions were reused
+        assert(!arena.allocate(8, 3));
+        arena.release();
+        assert(mini_alloc::get_stats().bytes_allocated == live);
+        std::puts("Arena test OK");
+    }
+
+    // StlAllocator and the std::pmr resources
+    {
+        std::size_t live = mini_alloc::get_stats().bytes_allocated;
+        {
+            std::vector<int, mini_alloc::StlAllocator<int>> v;
+            for (int i = 0; i < 10000; ++i) v.push_back(i);
+            std::list<double, mini_alloc::StlAllocator<double>> l(100, 1.5);
+            struct alignas(64) Line {
+                char bytes[64];
+            };
+            std::vector<Line, mini_alloc::StlAllocator<Line>> lines(3);
+            assert(v[9999] == 9999 && l.size() == 100);
+            assert(reinterpret_cast<std::uintptr_t>(lines.data()) % 64 == 0);
+
+            std::pmr::vector<int> pv(mini_alloc::heap_resource());
+            pv.assign(5000, 7);
+            assert(mini_alloc::heap_resource()->is_equal(mini_alloc::memory_resource()));
+        }
+        assert(mini_alloc::get_stats().bytes_allocated == live);
+
+        mini_alloc::pool_resource pool;
+        void* node = pool.allocate(40);
+        pool.deallocate(node, 40);
+        assert(pool.allocate(33) == node); // same 48-byte class
+        void* large = pool.allocate(4096);
+        assert(mini_alloc::malloc_usable_size(large) >= 4096); // from the heap
+        pool.deallocate(large, 4096);
+        {
+            std::pmr::list<int> pl(&pool);
+            for (int i = 0; i < 1000; ++i) pl.push_back(i);
+        }
+        pool.release();
+
+        mini_alloc::arena_resource monotonic(4096);
+        void* x = monotonic.allocate(100, 32);
+        assert(reinterpret_cast<std::uintptr_t>(x) % 32 == 0);
+        monotonic.deallocate(x, 100, 32);
+        monotonic.reset();
+        assert(monotonic.allocate(100, 32) == x);
+        monotonic.release();
+        assert(mini_alloc::get_stats().bytes_allocated == live);
+        std::puts("STL allocator test OK");
+    }
+
+    // get_stats: counters of other threads, exited ones included, and the
+    // size class histogram
+    {
+        constexpr int N = 100, M = 60;
+        mini_alloc::Stats before = mini_alloc::get_stats();
+        void* ptrs[N];
+        std::thread([&] {
+            for (void*& p : ptrs) p = mini_alloc::malloc(3000);
+        }).join();
+        mini_alloc::Stats st = mini_alloc::get_stats();
+        assert(st.allocations - before.allocations == N && st.frees == before.frees);
+        std::size_t usable = (st.bytes_allocated - before.bytes_allocated) / N;
+        assert(usable >= 3000 && usable * N == st.bytes_allocated - before.bytes_allocated);
+        std::size_t cls = 0;
+        while (cls < mini_alloc::STATS_SIZE_CLASSES && st.class_allocations[cls] == before.class_allocations[cls]) ++cls;
+        assert(cls < mini_alloc::STATS_SIZE_CLASSES);
+        assert(st.class_allocations[cls] - before.class_allocations[cls] == N);
+        assert(st.class_live[cls] - before.class_live[cls] == N);
+
+        std::thread([&] {
+            for (int i = 0; i < M; ++i) mini_alloc::free(ptrs[i]);
+        }).join();
+        mini_alloc::Stats freed = mini_alloc::get_stats();
+        assert(freed.allocations == st.allocations && freed.frees - before.frees == M);
+        assert(freed.bytes_allocated - before.bytes_allocated == (N - M) * usable);
+        assert(freed.class_allocations[cls] == st.class_allocations[cls]);
+        assert(freed.class_live[cls] - before.class_live[cls] == N - M);
+        for (int i = M; i < N; ++i) mini_alloc::free(ptrs[i]);
+        assert(mini_alloc::get_stats().bytes_allocated == before.bytes_allocated);
+        std::puts("stats test OK");
+    }
+
+    // heap_report and the JSON and binary heap maps: each lists every block
+    // the report counted, and the JSON parses
+    {
+        void* held[3] = {mini_alloc::malloc(3000), mini_alloc::malloc(40), mini_alloc::malloc(20000)};
+        mini_alloc::free(held[0]);
+        mini_alloc::HeapReport report = mini_alloc::heap_report();
+        std::size_t walked = report.used_blocks + report.cached_blocks + report.free_blocks;
+        assert(report.chunks > 0 && walked > 0 && report.used_blocks > 0);
+        assert(report.free_bytes >= report.largest_free_block);
+
+        auto slurp = [](void (*dump)(std::FILE*)) {
+            std::FILE* f = std::tmpfile();
+            assert(f);
+            dump(f);
+            std::string bytes(static_cast<std::size_t>(std::ftell(f)), '\0');
+            std::rewind(f);
+            assert(std::fread(&bytes[0], 1, bytes.size(), f) == bytes.size());
+            std::fclose(f);
+            return bytes;
+        };
+
+        // a JSON value, counting the elements of every "blocks" array
+        struct Json {
+            const char* p;
+            std::size_t blocks = 0;
+            void ws() {
+                while (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') ++p;
+            }
+            bool string(std::string* out) {
+                if (*p != '"') return false;
+                for (++p; *p != '"'; ++p) {
+                    if (!*p || *p == '\\') return false; // the dump has no escapes
+                    if (out) out->push_back(*p);
+                }
+                ++p;
+                return true;
+            }
+            bool value(bool block_list = false) {
+                ws();
+                if (*p == '{') {
+                    ++p;
+                    ws();
+                    if (*p == '}') return ++p, true;
+                    for (;;) {
+                        std::string key;
+                        ws();
+                        if (!string(&key)) return false;
+                        ws();
+                        if (*p++ != ':' || !value(key == "blocks")) return false;
+                        ws();
+                        if (*p == '}') return ++p, true;
+                        if (*p++ != ',') return false;
+                    }
+                }
+                if (*p == '[') {
+                    ++p;
+                    ws();
+                    if (*p == ']') return ++p, true;
+                    for (;;) {
+                        if (!value()) return false;
+                        if (block_list) ++blocks;
+                        ws();
+                        if (*p == ']') return ++p, true;
+                        if (*p++ != ',') return false;
+                    }
+                }
+                if (*p == '"') return string(nullptr);
+                const char* start = p;
+                while (*p >= '0' && *p <= '9') ++p;
+                return p != start;
+            }
+        };
+        std::string json = slurp(mini_alloc::dump_heap_json);
+        Json parser{json.c_str()};
+        assert(parser.value());
+        parser.ws();
+        assert(!*parser.p && parser.blocks == walked);
+
+        std::string binary = slurp(mini_alloc::dump_heap_binary);
+        assert(binary.size() % 8 == 0 && binary.compare(0, 8, "MAHEAP01") == 0);
+        std::vector<std::uint64_t> words(binary.size() / 8 - 1);
+        std::memcpy(words.data(), binary.data() + 8, words.size() * 8);
+        std::size_t records = 0, at = 0;
+        for (;;) {
+            assert(at < words.size());
+            std::uint64_t kind = words[at];
+            if (kind == 0) break;
+            assert(kind == 1 || kind == 2);
+            std::size_t n = words[at + (kind == 1 ? 5 : 3)];
+            if (kind == 1) records += n;
+            at += (kind == 1 ? 6 : 4) + n;
+        }
+        assert(at + 1 == words.size() && records == walked);
+        mini_alloc::free(held[1]);
+        mini_alloc::free(held[2]);
+        std::puts("heap map test OK");
+    }
+
+    // allocation tracing: one record per call, in call order, read back raw
+    // and for replay
+    {
+        const char* path = "test_allocator.trace";
+        assert(mini_alloc::trace_start(path));
+        assert(!mini_alloc::trace_start(path)); // one trace at a time
+        void* m = mini_alloc::malloc(100);
+        void* c = mini_alloc::calloc(4, 50);
+        void* old = m;
+        m = mini_alloc::realloc(m, 5000);
+        void* al = mini_alloc::aligned_alloc(64, 64);
+        mini_alloc::free(c);
+        mini_alloc::free(al);
+        mini_alloc::free(m);
+        mini_alloc::trace_stop();
+
+        std::FILE* f = std::fopen(path, "rb");
+        assert(f);
+        mini_alloc::TraceFileHeader header;
+        assert(std::fread(&header, sizeof(header), 1, f) == 1);
+        assert(std::memcmp(header.magic, mini_alloc::TRACE_MAGIC, 8) == 0 && header.version == mini_alloc::TRACE_VERSION);
+        std::vector<mini_alloc::TraceRecord> records;
+        mini_alloc::TraceBlockHeader block;
+        while (std::fread(&block, sizeof(block), 1, f) == 1) {
+            std::size_t at = records.size();
+            records.resize(at + block.count);
+            assert(std::fread(&records[at], sizeof(mini_alloc::TraceRecord), block.count, f) == block.count);
+        }
+        std::fclose(f);
+        std::stable_sort(records.begin(), records.end(),
+                         [](const auto& a, const auto& b) { return a.time < b.time; });
+        using Op = mini_alloc::TraceOp;
+        const Op ops[] = {Op::Malloc, Op::Calloc, Op::Realloc, Op::AlignedAlloc, Op::Free, Op::Free, Op::Free};
+        const void* ids[] = {old, c, m, al, c, al, m};
+        assert(records.size() == 7);
+        for (std::size_t i = 0; i < 7; ++i) {
+            assert(records[i].op() == ops[i] && records[i].id == reinterpret_cast<std::uintptr_t>(ids[i]));
+        }
+        assert(records[0].size() == 100 && records[1].size() == 200 && records[2].size() == 5000);
+        assert(records[2].arg == reinterpret_cast<std::uintptr_t>(old) && records[3].arg == 64);
+
+        mini_alloc::ReplayTrace trace; // the same calls as operations on slots
+        std::string error;
+        bool loaded = mini_alloc::load_trace(path, trace, error);
+        std::remove(path);
+        assert(loaded && trace.skipped == 0 && trace.ops.size() == 7 && trace.slots == 3);
+        using Kind = mini_alloc::ReplayOp::Kind;
+        const Kind kinds[] = {Kind::Malloc, Kind::Calloc, Kind::Realloc, Kind::Malloc, Kind::Free, Kind::Free, Kind::Free};
+        for (std::size_t i = 0; i < 7; ++i) assert(trace.ops[i].kind == kinds[i]);
+        assert(trace.ops[2].slot == trace.ops[0].slot && trace.ops[6].slot == trace.ops[0].slot);
+        std::puts("trace test OK");
+    }
+
+    // malloc_on_node: node 0 always exists; other nodes only under NUMA
+    {
+        char* p = static_cast<char*>(mini_alloc::malloc_on_node(5000, 0));
+        char* q = static_cast<char*>(mini_alloc::malloc_on_node(40, 0));
+        assert(p && q);
+        std::memset(p, 0x77, 5000);
+        std::memset(q, 0x78, 40);
+        assert(p[4999] == 0x77 && q[39] == 0x78);
+        mini_alloc::free(p);
+        mini_alloc::free(q);
+        assert(!mini_alloc::malloc_on_node(64, -1));
+        assert(!mini_alloc::malloc_on_node(64, 4096));
+        std::puts("malloc_on_node test OK");
+    }
+
+    // transparent huge pages for chunks and huge allocations mapped from now on
+    {
+        mini_alloc::set_huge_pages(mini_alloc::HugePages::Transparent);
+        char* huge = static_cast<char*>(mini_alloc::malloc(3 * 1024 * 1024));
+        char* large = static_cast<char*>(mini_alloc::malloc(1536 * 1024)); // in a new 2 MiB chunk
+        assert(huge && large);
+        std::memset(huge, 1, 3 * 1024 * 1024);
+        std::memset(large, 2, 1536 * 1024);
+        assert(huge[3 * 1024 * 1024 - 1] == 1 && large[1536 * 1024 - 1] == 2);
+        mini_alloc::free(huge);
+        mini_alloc::free(large);
+        mini_alloc::set_huge_pages(mini_alloc::HugePages::Off);
+        std::puts("huge pages test OK");
+    }
+
+    // best fit: the tightest of the free blocks in a size class; first fit:
+    // the lowest-addressed, even when freed first. Allocated guards keep
+    // the free blocks apart.
+    {
+        mini_alloc::set_placement(mini_alloc::Placement::BestFit);
+        std::size_t sizes[3] = {12000, 9100, 11000};
+        void* fits[3];
+        void* guards[3];
+        for (int i = 0; i < 3; ++i) {
+            fits[i] = mini_alloc::malloc(sizes[i]);
+            guards[i] = mini_alloc::malloc(2000);
+        }
+        for (void* p : fits) mini_alloc::free(p);
+        void* best = mini_alloc::malloc(9000);
+        assert(best == fits[1]);
+        mini_alloc::free(best);
+        for (void* p : guards) mini_alloc::free(p);
+
+        mini_alloc::set_placement(mini_alloc::Placement::FirstFit);
+        std::size_t first_sizes[3] = {7000, 6000, 7500};
+        for (int i = 0; i < 3; ++i) {
+            fits[i] = mini_alloc::malloc(first_sizes[i]);
+            guards[i] = mini_alloc::malloc(2000);
+        }
+        std::sort(fits, fits + 3);
+        for (void* p : fits) mini_alloc::free(p); // the highest heads the list
+        void* first = mini_alloc::malloc(5000);
+        assert(first <= fits[0]);
+        mini_alloc::free(first);
+        for (void* p : guards) mini_alloc::free(p);
+        mini_alloc::set_placement(mini_alloc::Placement::BestFit);
+        std::puts("placement test OK");
+    }
+
+    // Heap instances: their own chunks and stats, and release dropping
+    // everything from the global stats as well
+    {
+        mini_alloc::Stats before = mini_alloc::get_stats();
+        mini_alloc::Heap heap(256 * 1024, mini_alloc::Placement::GoodFit);
+        void* ptrs[1000];
+        for (int i = 0; i < 1000; ++i) {
+            ptrs[i] = heap.malloc(16 + i * 3);
+            assert(ptrs[i] && heap.owns(ptrs[i]));
+        }
+        assert(!heap.owns(blocks[0]));
+        char* zeroed = static_cast<char*>(heap.calloc(100, 30));
+        for (int i = 0; i < 3000; ++i) assert(zeroed[i] == 0);
+        void* aligned = heap.aligned_alloc(256, 1000);
+        assert(heap.owns(aligned) && reinterpret_cast<std::uintptr_t>(aligned) % 256 == 0);
+        void* grown = mini_alloc::realloc(ptrs[0], 20000); // stays in its Heap
+        assert(heap.owns(grown));
+        ptrs[0] = grown;
+        for (int i = 1; i < 500; ++i) mini_alloc::free(ptrs[i]);
+
+        mini_alloc::Stats st = heap.stats();
+        assert(st.allocations == 1003 && st.frees == 500); // the moving realloc counts as both
+        assert(st.bytes_committed > 0 && st.bytes_allocated >= 20000);
+        assert(heap.report().used_blocks > 0);
+        mini_alloc::Stats global = mini_alloc::get_stats();
+        assert(global.allocations - global.frees == before.allocations - before.frees + 503);
+
+        mini_alloc::Heap moved(std::move(heap));
+        assert(moved.owns(ptrs[999]) && !heap.malloc(16));
+        moved.release();
+        assert(!moved.owns(ptrs[999]));
+        mini_alloc::Stats after = mini_alloc::get_stats();
+        assert(after.bytes_allocated == before.bytes_allocated);
+        assert(after.allocations - after.frees == before.allocations - before.frees);
+        assert(moved.malloc(64)); // usable again after release
+        std::puts("Heap test OK");
+    }
+
+    // heap profiler: at a rate of one byte every allocation is sampled
+    {
+        const char* path = "test_allocator.prof";
+        auto dump_header = [path](std::size_t& live, std::size_t& allocs, std::size_t& rate) {
+            assert(mini_alloc::profile_dump(path));
+            std::FILE* f = std::fopen(path, "r");
+            assert(f);
+            char line[256];
+            std::size_t live_bytes = 0, alloc_bytes = 0;
+            int fields = std::fscanf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &live, &live_bytes, &allocs,
+                                     &alloc_bytes, &rate);
+            bool stacks = false, maps = false;
+            while (std::fgets(line, sizeof(line), f)) {
+                if (std::strstr(line, "] @ 0x")) stacks = true;
+                if (std::strstr(line, "MAPPED_LIBRARIES:")) maps = true;
+            }
+            std::fclose(f);
+            std::remove(path);
+            assert(fields == 5 && maps && (stacks || !allocs));
+            assert((live_bytes == 0) == (live == 0) && alloc_bytes >= live_bytes);
+        };
+        assert(mini_alloc::profile_start(1));
+        assert(!mini_alloc::profile_start(1)); // already on
+        void* sampled[200];
+        for (int i = 0; i < 200; ++i) sampled[i] = mini_alloc::malloc(i % 2 ? 64 : 4096);
+        std::size_t live, allocs, rate;
+        dump_header(live, allocs, rate);
+        assert(rate == 1 && live >= 190 && allocs == live);
+        for (void* p : sampled) mini_alloc::free(p);
+        dump_header(live, allocs, rate);
+        assert(live == 0 && allocs >= 190);
+        mini_alloc::profile_stop();
+        std::puts("profiler test OK");
+    }
+
+    // malloc_usable_size, realloc_hint and calloc over reused memory
+    {
+        assert(mini_alloc::malloc_usable_size(nullptr) == 0);
+        char* p = static_cast<char*>(mini_alloc::malloc(100));
+        std::size_t usable = mini_alloc::malloc_usable_size(p);
+        assert(usable >= 100);
+        std::memset(p, 0x5A, usable); // all of it may be written
+        std::size_t capacity = 0;
+        char* q = static_cast<char*>(mini_alloc::realloc_hint(p, 2000, 8000, &capacity));
+        assert(q && capacity >= 8000 && capacity == mini_alloc::malloc_usable_size(q));
+        for (std::size_t i = 0; i < usable; ++i) assert(q[i] == 0x5A);
+        assert(mini_alloc::realloc_hint(q, capacity, 2 * capacity) == q); // growth within the capacity stays put
+        mini_alloc::free(q);
+
+        assert(!mini_alloc::calloc(std::size_t(1) << 40, std::size_t(1) << 40)); // overflows
+        void* dirty = mini_alloc::malloc(20000);
+        std::memset(dirty, 0xFF, 20000);
+        mini_alloc::free(dirty);
+        char* zeroed = static_cast<char*>(mini_alloc::calloc(1, 20000));
+        for (int i = 0; i < 20000; ++i) assert(zeroed[i] == 0);
+        mini_alloc::free(zeroed);
+        std::puts("usable size test OK");
+    }
+
+    // malloc_flags: MINI_ALLOC_CACHELINE payloads own their cache lines,
+    // and small objects two running threads carve from never-used slots
+    // share none. Freed slots go to any thread, so the objects are of a
+    // size no earlier test used.
+    {
+        void* lined[32];
+        std::uintptr_t ends[32]; // of the payloads' whole lines
+        for (int i = 0; i < 32; ++i) {
+            std::size_t size = 1 + i * 13;
+            lined[i] = mini_alloc::malloc_flags(size, mini_alloc::MINI_ALLOC_CACHELINE);
+            auto at = reinterpret_cast<std::uintptr_t>(lined[i]);
+            assert(at % 64 == 0 && mini_alloc::malloc_usable_size(lined[i]) >= size);
+            ends[i] = at + (size + 63) / 64 * 64;
+        }
+        for (int i = 0; i < 32; ++i) {
+            for (int j = 0; j < 32; ++j) {
+                auto a = reinterpret_cast<std::uintptr_t>(lined[i]), b = reinterpret_cast<std::uintptr_t>(lined[j]);
+                // neither the other payload nor its header word in our lines
+                assert(i == j || ends[j] <= a || b - 8 >= ends[i]);
+            }
+        }
+        for (void* p : lined) mini_alloc::free(p);
+        void* plain = mini_alloc::malloc_flags(24, 0);
+        assert(plain && mini_alloc::malloc_usable_size(plain) >= 24);
+        mini_alloc::free(plain);
+
+        std::set<std::uintptr_t> lines[2];
+        void* objs[2][100];
+        auto fill = [&](int t) {
+            for (int i = 0; i < 100; ++i) objs[t][i] = mini_alloc::malloc(152);
+        };
+        std::atomic<int> step{0}; // the other thread keeps its run until we are done
+        std::thread other([&] {
+            fill(1);
+            step = 1;
+            while (step != 2) std::this_thread::yield();
+        });
+        while (step != 1) std::this_thread::yield();
+        fill(0);
+        step = 2;
+        other.join();
+        for (int t = 0; t < 2; ++t) {
+            for (void* p : objs[t]) lines[t].insert(reinterpret_cast<std::uintptr_t>(p) / 64);
+        }
+        for (std::uintptr_t line : lines[0]) assert(!lines[1].count(line));
+        for (int t = 0; t < 2; ++t) {
+            for (void* p : objs[t]) mini_alloc::free(p);
+        }
+        std::puts("cache line test OK");
+    }
+
+    assert(mini_alloc::check_heap()); // every block chain and free list is consistent
+
+    // free_sized of a slot realloc shrank in place: it goes back to its own
+    // size class and the byte count balances
+    {
+        std::size_t live = mini_alloc::get_stats().bytes_allocated;
+        void* p = mini_alloc::realloc(mini_alloc::malloc(200), 10);
+        mini_alloc::free_sized(p, 10);
+        void* q = mini_alloc::malloc(10);
+        assert(q != p && mini_alloc::malloc_usable_size(q) < 200);
+        mini_alloc::free_sized(q, 10);
+        assert(mini_alloc::get_stats().bytes_allocated == live);
+        std::puts("free_sized of a shrunk slot test OK");
+    }
+
     std::puts("Final heap:");
     mini_alloc::dump_heap();
 